@@ -0,0 +1,481 @@
+/*
+Benchmarks for the simplefs library.
+
+Each bundled image is copied to a scratch file first, so the originals
+are never modified. An argument of the form gen:<blocks>[:extents|:journal|:inline|:compress|:dedup]
+stands for a generated image of that many blocks, formatted before use.
+The data written is synthetic log text, so that compressed images see
+a realistic ratio; seq_write reports it as the bytes written per byte
+of disk blocks they took.
+Every test prints one JSON object per line, so the output of different
+commits can be kept and compared.
+*/
+
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define BENCH_SCRATCH "bench.scratch"
+#define BENCH_SEQ_SIZE (64*1024)
+#define BENCH_RAND_SIZE DISK_BLOCK_SIZE
+#define BENCH_FILE_SIZE (1024*DISK_BLOCK_SIZE)	/* fits the 1029-block limit of pointer inodes */
+#define BENCH_MAX_FILES 4096
+#define BENCH_MOUNT_RUNS 10
+#define BENCH_FORMAT_RUNS 5
+
+struct bench_run {
+	const char *image;
+	int blocks;
+	const char *test;
+	double *latency;
+	int nops;
+	int maxops;
+	long long bytes;
+	long long stored;	/* bytes of disk the run's data took, 0 if not measured */
+	double start;
+	struct disk_counters before;
+};
+
+static int cacheblocks = DISK_CACHE_DEFAULT;
+static int nops = 2000;
+static unsigned seed = 1;
+
+static int files[BENCH_MAX_FILES];
+static int nfiles;
+static char *buffer;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void run_start( struct bench_run *run, const char *image, int blocks, const char *test )
+{
+	memset(run,0,sizeof(*run));
+	run->image = image;
+	run->blocks = blocks;
+	run->test = test;
+	disk_get_counters(&run->before);
+	run->start = now();
+}
+
+static void run_op( struct bench_run *run, double start, int bytes )
+{
+	if(run->nops==run->maxops) {
+		run->maxops = run->maxops ? run->maxops*2 : 1024;
+		run->latency = realloc(run->latency,run->maxops*sizeof(double));
+	}
+	run->latency[run->nops++] = now()-start;
+	run->bytes += bytes;
+}
+
+static int compare_double( const void *a, const void *b )
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x<y ? -1 : x>y;
+}
+
+static double percentile( struct bench_run *run, double p )
+{
+	int i;
+	if(!run->nops) return 0;
+	i = (int)(p*(run->nops-1)+0.5);
+	return run->latency[i]*1e6;
+}
+
+/* Print the results of a run as one line of JSON. */
+
+static void run_end( struct bench_run *run )
+{
+	struct disk_counters after;
+	double seconds = now()-run->start;
+	int n = run->nops ? run->nops : 1;
+
+	disk_get_counters(&after);
+	qsort(run->latency,run->nops,sizeof(double),compare_double);
+
+	printf("{\"image\":\"%s\",\"blocks\":%d,\"test\":\"%s\",\"ops\":%d,\"bytes\":%lld,\"seconds\":%.6f,",
+		run->image,run->blocks,run->test,run->nops,run->bytes,seconds);
+	printf("\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,",
+		seconds>0 ? run->nops/seconds : 0,seconds>0 ? run->bytes/seconds/(1024*1024) : 0);
+	if(run->stored>0) printf("\"ratio\":%.2f,",(double)run->bytes/run->stored);
+	printf("\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},",
+		percentile(run,0.5),percentile(run,0.9),percentile(run,0.99),percentile(run,1.0));
+	printf("\"disk_reads_per_op\":%.2f,\"disk_writes_per_op\":%.2f,\"disk_requests_per_op\":%.2f}\n",
+		(double)(after.reads-run->before.reads)/n,(double)(after.writes-run->before.writes)/n,(double)(after.requests-run->before.requests)/n);
+	fflush(stdout);
+
+	free(run->latency);
+}
+
+/* Remount with an empty buffer cache, so reads start cold. */
+
+static void remount()
+{
+	fs_unmount();
+	disk_cache_size(cacheblocks);
+	fs_mount();
+}
+
+/* Find the files already on the image; inode numbers follow the layout fs_format uses. */
+
+static void find_files( int blocks )
+{
+	int ninodes = (blocks+9)/10*128;
+	int i;
+
+	nfiles = 0;
+	for(i=1;i<ninodes && nfiles<BENCH_MAX_FILES;i++) {
+		if(fs_getsize(i)>=0) files[nfiles++] = i;
+	}
+}
+
+static void bench_format( const char *image, int blocks, int flags )
+{
+	struct bench_run run;
+	double start;
+	int i;
+
+	run_start(&run,image,blocks,"format");
+	for(i=0;i<BENCH_FORMAT_RUNS;i++) {
+		start = now();
+		if(!fs_format_flags(flags)) break;
+		run_op(&run,start,0);
+	}
+	disk_sync();
+	run_end(&run);
+}
+
+static void bench_mount( const char *image, int blocks )
+{
+	struct bench_run run;
+	double start;
+	int i;
+
+	fs_unmount();
+	run_start(&run,image,blocks,"mount");
+	for(i=0;i<BENCH_MOUNT_RUNS;i++) {
+		disk_cache_size(cacheblocks);
+		start = now();
+		if(!fs_mount()) break;
+		run_op(&run,start,0);
+		fs_unmount();
+	}
+	run_end(&run);
+	fs_mount();
+}
+
+/* Fill about 40% of the disk with new files, written front to back. */
+
+static void bench_seq_write( const char *image, int blocks )
+{
+	struct bench_run run;
+	long long target = (long long)blocks*DISK_BLOCK_SIZE*2/5;
+	double start;
+	int inumber, offset, actual, full=0;
+	int free_before = fs_freeblocks();
+
+	run_start(&run,image,blocks,"seq_write");
+	while(run.bytes<target && !full && nfiles<BENCH_MAX_FILES) {
+		inumber = fs_create();
+		if(inumber<=0) break;
+		files[nfiles++] = inumber;
+		for(offset=0;offset<BENCH_FILE_SIZE && run.bytes<target;offset+=actual) {
+			start = now();
+			actual = fs_write(inumber,buffer,BENCH_SEQ_SIZE,offset);
+			if(actual<=0) {
+				full = 1;
+				break;
+			}
+			run_op(&run,start,actual);
+			if(actual<BENCH_SEQ_SIZE) {
+				full = 1;
+				break;
+			}
+		}
+	}
+	fs_sync();
+	run.stored = (long long)(free_before-fs_freeblocks())*DISK_BLOCK_SIZE;
+	run_end(&run);
+}
+
+/* Overwrite single blocks at random inside the files. */
+
+static void bench_rand_write( const char *image, int blocks )
+{
+	struct bench_run run;
+	double start;
+	int i, inumber, size, offset;
+
+	run_start(&run,image,blocks,"rand_write");
+	for(i=0;i<nops && nfiles;i++) {
+		inumber = files[rand_r(&seed)%nfiles];
+		size = fs_getsize(inumber);
+		if(size<BENCH_RAND_SIZE) continue;
+		offset = rand_r(&seed)%(size/BENCH_RAND_SIZE)*BENCH_RAND_SIZE;
+		start = now();
+		if(fs_write(inumber,buffer,BENCH_RAND_SIZE,offset)!=BENCH_RAND_SIZE) break;
+		run_op(&run,start,BENCH_RAND_SIZE);
+	}
+	fs_sync();
+	run_end(&run);
+}
+
+static void bench_seq_read( const char *image, int blocks )
+{
+	struct bench_run run;
+	double start;
+	int i, offset, actual;
+
+	remount();
+	run_start(&run,image,blocks,"seq_read");
+	for(i=0;i<nfiles;i++) {
+		for(offset=0;;offset+=actual) {
+			start = now();
+			actual = fs_read(files[i],buffer,BENCH_SEQ_SIZE,offset);
+			if(actual<=0) break;
+			run_op(&run,start,actual);
+		}
+	}
+	run_end(&run);
+}
+
+static void bench_rand_read( const char *image, int blocks )
+{
+	struct bench_run run;
+	double start;
+	int i, inumber, size, offset, actual;
+
+	remount();
+	run_start(&run,image,blocks,"rand_read");
+	for(i=0;i<nops && nfiles;i++) {
+		inumber = files[rand_r(&seed)%nfiles];
+		size = fs_getsize(inumber);
+		if(size<=0) continue;
+		offset = rand_r(&seed)%size;
+		start = now();
+		actual = fs_read(inumber,buffer,BENCH_RAND_SIZE,offset);
+		run_op(&run,start,actual>0 ? actual : 0);
+	}
+	run_end(&run);
+}
+
+static void bench_create_delete( const char *image, int blocks )
+{
+	struct bench_run run;
+	int *created = malloc(nops*sizeof(int));
+	double start;
+	int i, n=0;
+
+	run_start(&run,image,blocks,"create");
+	for(i=0;i<nops;i++) {
+		start = now();
+		created[n] = fs_create();
+		if(created[n]<=0) break;
+		run_op(&run,start,0);
+		n++;
+	}
+	run_end(&run);
+
+	run_start(&run,image,blocks,"delete");
+	for(i=0;i<n;i++) {
+		start = now();
+		fs_delete(created[i]);
+		run_op(&run,start,0);
+	}
+	fs_sync();
+	run_end(&run);
+
+	free(created);
+}
+
+/* Fill the write buffer with log lines, the same on every run */
+
+static void fill_buffer()
+{
+	static const char *levels[] = { "INFO", "INFO", "INFO", "WARN", "DEBUG" };
+	static const char *paths[] = { "/index.html", "/api/v1/items", "/api/v1/users", "/static/app.js", "/login" };
+	unsigned state = 12345;
+	char line[160];
+	int n, used = 0;
+
+	for(n=0;used<BENCH_SEQ_SIZE;n++) {
+		int len = snprintf(line,sizeof(line),"2024-03-%02d 12:%02d:%02d.%03d %-5s worker-%d GET %s status=%d bytes=%u took=%ums\n",
+			1+n/86400%28,n/60%60,n%60,rand_r(&state)%1000,levels[rand_r(&state)%5],rand_r(&state)%8,
+			paths[rand_r(&state)%5],rand_r(&state)%10 ? 200 : 404,rand_r(&state)%65536,rand_r(&state)%250);
+		if(len>BENCH_SEQ_SIZE-used) len = BENCH_SEQ_SIZE-used;
+		memcpy(buffer+used,line,len);
+		used += len;
+	}
+}
+
+/* Copy a bundled image to the scratch file and return its size in blocks, or -1. */
+
+static int copy_image( const char *image )
+{
+	FILE *in, *out;
+	size_t n;
+	long size;
+
+	in = fopen(image,"r");
+	if(!in) return -1;
+	out = fopen(BENCH_SCRATCH,"w");
+	if(!out) {
+		fclose(in);
+		return -1;
+	}
+	while((n=fread(buffer,1,BENCH_SEQ_SIZE,in))>0) fwrite(buffer,1,n,out);
+	size = ftell(out);
+	fclose(in);
+	fclose(out);
+
+	return size/DISK_BLOCK_SIZE;
+}
+
+static int bench_image( const char *image, int backend )
+{
+	int blocks, flags=0, generated, saved, null;
+	char mode[16] = "";
+
+	generated = sscanf(image,"gen:%d:%15s",&blocks,mode)>=1;
+	if(generated) {
+		if(!strcmp(mode,"extents")) {
+			flags = FS_FORMAT_EXTENTS;
+		} else if(!strcmp(mode,"journal")) {
+			flags = FS_FORMAT_JOURNAL;
+		} else if(!strcmp(mode,"inline")) {
+			flags = FS_FORMAT_INLINE;
+		} else if(!strcmp(mode,"compress")) {
+			flags = FS_FORMAT_COMPRESS;
+		} else if(!strcmp(mode,"dedup")) {
+			flags = FS_FORMAT_DEDUP;
+		} else if(mode[0]) {
+			printf("unknown image mode: %s\n",mode);
+			return 0;
+		}
+		unlink(BENCH_SCRATCH);
+	} else {
+		blocks = copy_image(image);
+	}
+	if(blocks<=0) {
+		printf("couldn't open %s: %s\n",image,strerror(errno));
+		return 0;
+	}
+
+	if(!disk_cache_size(cacheblocks) || !disk_init_backend(BENCH_SCRATCH,blocks,backend)) {
+		printf("couldn't initialize %s: %s\n",BENCH_SCRATCH,strerror(errno));
+		return 0;
+	}
+
+	if(generated) bench_format(image,blocks,flags);
+	if(!fs_mount()) {
+		printf("couldn't mount %s\n",image);
+		disk_close();
+		return 0;
+	}
+	find_files(blocks);
+
+	bench_mount(image,blocks);
+	bench_seq_write(image,blocks);
+	bench_rand_write(image,blocks);
+	bench_seq_read(image,blocks);
+	bench_rand_read(image,blocks);
+	bench_create_delete(image,blocks);
+	fs_unmount();
+	if(!generated) bench_format(image,blocks,0);
+
+	/* disk_close reports its counters on stdout; keep them out of the results */
+	fflush(stdout);
+	saved = dup(1);
+	null = open("/dev/null",O_WRONLY);
+	dup2(null,1);
+	disk_close();
+	fflush(stdout);
+	dup2(saved,1);
+	close(null);
+	close(saved);
+	unlink(BENCH_SCRATCH);
+
+	return 1;
+}
+
+int main( int argc, char *argv[] )
+{
+	static const char *defaults[] = { "image.5", "image.20", "image.200", "gen:65536", "gen:65536:extents", "gen:65536:compress" };
+	int backend = DISK_BACKEND_DEFAULT;
+	int depth = DISK_QUEUE_DEPTH_DEFAULT;
+	int engine = DISK_ASYNC_AUTO;
+	int i, opt, ok=1;
+
+	while((opt=getopt(argc,argv,"a:b:c:n:q:s:"))!=-1) {
+		switch(opt) {
+			case 'a':
+				if(!strcmp(optarg,"auto")) {
+					engine = DISK_ASYNC_AUTO;
+				} else if(!strcmp(optarg,"sync")) {
+					engine = DISK_ASYNC_SYNC;
+				} else if(!strcmp(optarg,"uring")) {
+					engine = DISK_ASYNC_URING;
+				} else if(!strcmp(optarg,"threads")) {
+					engine = DISK_ASYNC_THREADS;
+				} else {
+					printf("unknown async engine: %s\n",optarg);
+					return 1;
+				}
+				break;
+			case 'b':
+				if(!strcmp(optarg,"stdio")) {
+					backend = DISK_BACKEND_STDIO;
+				} else if(!strcmp(optarg,"pread")) {
+					backend = DISK_BACKEND_PREAD;
+				} else if(!strcmp(optarg,"mmap")) {
+					backend = DISK_BACKEND_MMAP;
+				} else {
+					printf("unknown backend: %s\n",optarg);
+					return 1;
+				}
+				break;
+			case 'c':
+				cacheblocks = atoi(optarg);
+				break;
+			case 'n':
+				nops = atoi(optarg);
+				break;
+			case 'q':
+				depth = atoi(optarg);
+				break;
+			case 's':
+				seed = atoi(optarg);
+				break;
+			default:
+				printf("use: %s [-a auto|sync|uring|threads] [-b stdio|pread|mmap] [-c cacheblocks] [-n ops] [-q depth] [-s seed] [image|gen:<blocks>[:extents|:journal|:inline|:compress|:dedup] ...]\n",argv[0]);
+				return 1;
+		}
+	}
+
+	if(nops<0 || !disk_queue_depth(depth,engine)) {
+		printf("invalid option\n");
+		return 1;
+	}
+
+	buffer = malloc(BENCH_SEQ_SIZE);
+	fill_buffer();
+
+	if(optind==argc) {
+		for(i=0;i<sizeof(defaults)/sizeof(defaults[0]);i++) ok &= bench_image(defaults[i],backend);
+	} else {
+		for(i=optind;i<argc;i++) ok &= bench_image(argv[i],backend);
+	}
+
+	free(buffer);
+	return ok ? 0 : 1;
+}
@@ -1,30 +1,163 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 #include "disk.h"
+#include "stats.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
+/* Scatter/gather entries gathered before a vectored request is issued */
+#define DISK_IOV_BATCH 64
+
+/* Upper bound on worker threads for the thread-pool async engine */
+#define DISK_ASYNC_MAXTHREADS 16
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+A write-back buffer cache sits in front of the emulated disk.
+Every disk_read and disk_write goes through it, so nreads and
+nwrites count only the blocks that actually touch the image file.
+Entries are kept on an LRU list (most recent at the head) and
+found through a hash table chained on the block number.
+*/
+
+struct cache_entry {
+	int blocknum;
+	int dirty;
+	int pending;
+	int busy;
+	struct cache_entry *prev;
+	struct cache_entry *next;
+	struct cache_entry *hnext;
+	char *data;
+};
+
 static FILE *diskfile;
+static int diskfd=-1;
+static char *diskmap=0;
+static int backend=DISK_BACKEND_STDIO;
 static int nblocks=0;
 static int nreads=0;
 static int nwrites=0;
+static int nrequests=0;
+
+static struct cache_entry *cache=0;
+static struct cache_entry **cache_hash=0;
+static struct cache_entry cache_lru;
+static char *cache_data=0;
+static int cache_nentries=DISK_CACHE_DEFAULT;
+static int cache_nbuckets=0;
+static int nhits=0;
+static int nmisses=0;
+static int nevictions=0;
+
+/*
+disk_lock guards the cache and the async engine, so any number of
+threads may share the disk, but it is never held across a transfer to
+or from the image. An entry being filled or written back is marked
+busy, and anyone else wanting it waits on disk_ready. The block and
+request counters are bumped with atomics, from whichever thread did
+the transfer.
+*/
+
+static pthread_mutex_t disk_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disk_ready=PTHREAD_COND_INITIALIZER;
+
+/*
+Transfers that write past the cache (disk_writev, async writes and
+discards) are listed while they are on their way to the image. A block
+under one is not loaded into the cache until it lands, or a miss could
+cache the old contents and serve them from then on.
+*/
+
+struct write_span {
+	int blocknum;
+	int count;
+	struct write_span *next;
+};
+
+static struct write_span *writes_inflight=0;
+
+static void cache_free();
+static void cache_alloc();
+static void async_setup();
+static void async_teardown();
+static void async_quiesce();
+static int  async_reap( int wait );
+static int  async_idle();
 
 int disk_init( const char *filename, int n )
 {
+	return disk_init_backend(filename,n,DISK_BACKEND_DEFAULT);
+}
+
+/*
+The stdio backend keeps the original FILE* access. The pread backend
+issues one positioned system call per block with no stdio buffering.
+The mmap backend maps the whole image; it serves as its own cache, so
+the buffer cache is bypassed and blocks can be borrowed in place.
+*/
+
+int disk_init_backend( const char *filename, int n, int b )
+{
+	if(b<DISK_BACKEND_STDIO || b>DISK_BACKEND_MMAP) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	pthread_mutex_lock(&disk_lock);
+
 	diskfile = fopen(filename,"r+");
 	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	if(!diskfile) {
+		pthread_mutex_unlock(&disk_lock);
+		return 0;
+	}
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+	ftruncate(fileno(diskfile),(off_t)n*DISK_BLOCK_SIZE);
 
+	diskfd = fileno(diskfile);
+	diskmap = 0;
+	if(b==DISK_BACKEND_MMAP && n>0) {
+		diskmap = mmap(0,(size_t)n*DISK_BLOCK_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,diskfd,0);
+		if(diskmap==MAP_FAILED) {
+			diskmap = 0;
+			fclose(diskfile);
+			diskfile = 0;
+			pthread_mutex_unlock(&disk_lock);
+			return 0;
+		}
+	}
+
+	backend = b;
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	nrequests = 0;
+	nhits = 0;
+	nmisses = 0;
+	nevictions = 0;
 
+	cache_alloc();
+	async_setup();
+	stats_heatmap(n);
+
+	pthread_mutex_unlock(&disk_lock);
 	return 1;
 }
 
@@ -51,41 +184,1465 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
+static void raw_error()
+{
+	printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+	abort();
+}
+
+static void raw_count( int reads, int writes, int requests )
+{
+	__atomic_add_fetch(&nreads,reads,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&nwrites,writes,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&nrequests,requests,__ATOMIC_RELAXED);
+}
+
+static void raw_read( int blocknum, char *data )
+{
+	off_t offset = (off_t)blocknum*DISK_BLOCK_SIZE;
+
+	switch(backend) {
+		case DISK_BACKEND_STDIO:
+			flockfile(diskfile);
+			fseek(diskfile,offset,SEEK_SET);
+			if(fread(data,DISK_BLOCK_SIZE,1,diskfile)!=1) raw_error();
+			funlockfile(diskfile);
+			break;
+		case DISK_BACKEND_PREAD:
+			if(pread(diskfd,data,DISK_BLOCK_SIZE,offset)!=DISK_BLOCK_SIZE) raw_error();
+			break;
+		case DISK_BACKEND_MMAP:
+			memcpy(data,diskmap+offset,DISK_BLOCK_SIZE);
+			break;
+	}
+
+	raw_count(1,0,1);
+}
+
+static void raw_write( int blocknum, const char *data )
+{
+	off_t offset = (off_t)blocknum*DISK_BLOCK_SIZE;
+
+	switch(backend) {
+		case DISK_BACKEND_STDIO:
+			flockfile(diskfile);
+			fseek(diskfile,offset,SEEK_SET);
+			if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)!=1) raw_error();
+			funlockfile(diskfile);
+			break;
+		case DISK_BACKEND_PREAD:
+			if(pwrite(diskfd,data,DISK_BLOCK_SIZE,offset)!=DISK_BLOCK_SIZE) raw_error();
+			break;
+		case DISK_BACKEND_MMAP:
+			memcpy(diskmap+offset,data,DISK_BLOCK_SIZE);
+			break;
+	}
+
+	raw_count(0,1,1);
+}
+
+/*
+Move the blocks starting at blocknum to or from the buffers in iov,
+which cover whole blocks, using as few system calls as possible.
+*/
+
+static void raw_transfer( int write, int blocknum, const struct iovec *iov, int iovcnt )
+{
+	off_t offset = (off_t)blocknum*DISK_BLOCK_SIZE;
+	off_t start = offset;
+	ssize_t expected, actual;
+	int i, n, requests=0;
+
+	switch(backend) {
+		case DISK_BACKEND_STDIO:
+			flockfile(diskfile);
+			fseek(diskfile,offset,SEEK_SET);
+			for(i=0;i<iovcnt;i++) {
+				if(write) {
+					actual = fwrite(iov[i].iov_base,1,iov[i].iov_len,diskfile);
+				} else {
+					actual = fread(iov[i].iov_base,1,iov[i].iov_len,diskfile);
+				}
+				if(actual!=iov[i].iov_len) raw_error();
+				offset += actual;
+			}
+			funlockfile(diskfile);
+			requests++;
+			break;
+		case DISK_BACKEND_PREAD:
+			while(iovcnt>0) {
+				n = iovcnt<IOV_MAX ? iovcnt : IOV_MAX;
+				for(i=0,expected=0;i<n;i++) expected += iov[i].iov_len;
+				if(write) {
+					actual = pwritev(diskfd,iov,n,offset);
+				} else {
+					actual = preadv(diskfd,iov,n,offset);
+				}
+				if(actual!=expected) raw_error();
+				offset += actual;
+				iov += n;
+				iovcnt -= n;
+				requests++;
+			}
+			break;
+		case DISK_BACKEND_MMAP:
+			for(i=0;i<iovcnt;i++) {
+				if(write) {
+					memcpy(diskmap+offset,iov[i].iov_base,iov[i].iov_len);
+				} else {
+					memcpy(iov[i].iov_base,diskmap+offset,iov[i].iov_len);
+				}
+				offset += iov[i].iov_len;
+			}
+			requests++;
+			break;
+	}
+
+	if(write) {
+		raw_count(0,(offset-start)/DISK_BLOCK_SIZE,requests);
+	} else {
+		raw_count((offset-start)/DISK_BLOCK_SIZE,0,requests);
+	}
+}
+
+static void cache_alloc()
+{
+	int i;
+
+	cache_free();
+	if(cache_nentries<=0 || backend==DISK_BACKEND_MMAP) return;
+
+	cache = calloc(cache_nentries,sizeof(*cache));
+	cache_data = malloc((size_t)cache_nentries*DISK_BLOCK_SIZE);
+	cache_nbuckets = cache_nentries*2;
+	cache_hash = calloc(cache_nbuckets,sizeof(*cache_hash));
+	if(!cache || !cache_data || !cache_hash) {
+		printf("ERROR: couldn't allocate %d cache blocks\n",cache_nentries);
+		abort();
+	}
+
+	/* All entries start out unused, threaded on the LRU list. */
+	cache_lru.prev = cache_lru.next = &cache_lru;
+	for(i=0;i<cache_nentries;i++) {
+		cache[i].blocknum = -1;
+		cache[i].data = cache_data + (size_t)i*DISK_BLOCK_SIZE;
+		cache[i].prev = cache_lru.prev;
+		cache[i].next = &cache_lru;
+		cache_lru.prev->next = &cache[i];
+		cache_lru.prev = &cache[i];
+	}
+}
+
+static void cache_free()
+{
+	free(cache);
+	free(cache_data);
+	free(cache_hash);
+	cache = 0;
+	cache_data = 0;
+	cache_hash = 0;
+	cache_nbuckets = 0;
+}
+
+static struct cache_entry ** cache_bucket( int blocknum )
+{
+	return &cache_hash[(unsigned)blocknum%cache_nbuckets];
+}
+
+static struct cache_entry * cache_find( int blocknum )
+{
+	struct cache_entry *e;
+	for(e=*cache_bucket(blocknum);e;e=e->hnext) {
+		if(e->blocknum==blocknum) return e;
+	}
+	return 0;
+}
+
+static void write_begin( struct write_span *w, int blocknum, int count )
+{
+	w->blocknum = blocknum;
+	w->count = count;
+	w->next = writes_inflight;
+	writes_inflight = w;
+}
+
+static void write_end( struct write_span *w )
+{
+	struct write_span **p;
+	for(p=&writes_inflight;*p;p=&(*p)->next) {
+		if(*p==w) {
+			*p = w->next;
+			break;
+		}
+	}
+	pthread_cond_broadcast(&disk_ready);
+}
+
+/* Tell whether a write past the cache is still on its way to blocknum. */
+
+static int write_pending( int blocknum )
+{
+	struct write_span *w;
+	for(w=writes_inflight;w;w=w->next) {
+		if(blocknum>=w->blocknum && blocknum<w->blocknum+w->count) return 1;
+	}
+	return 0;
+}
+
+/* Wait for some write past the cache to land; async ones finish only when reaped. */
+
+static void write_wait()
+{
+	if(!async_idle()) {
+		async_reap(1);
+	} else {
+		pthread_cond_wait(&disk_ready,&disk_lock);
+	}
+}
+
+/*
+Wait for an entry another thread is using: one still being prefetched
+is waited for by reaping the engine, one being filled or written back
+by waiting on disk_ready. Either way disk_lock is dropped meanwhile,
+so the caller has to look the entry up again.
+*/
+
+static void cache_wait( struct cache_entry *e )
+{
+	if(e->pending && !async_idle()) {
+		async_reap(1);
+	} else {
+		pthread_cond_wait(&disk_ready,&disk_lock);
+	}
+}
+
+/* Find the entry for blocknum once nobody else is using it, or return 0 if it is not cached. */
+
+static struct cache_entry * cache_lookup( int blocknum )
+{
+	struct cache_entry *e;
+
+	while((e=cache_find(blocknum)) && (e->pending || e->busy)) cache_wait(e);
+	return e;
+}
+
+static void cache_unhash( struct cache_entry *e )
+{
+	struct cache_entry **p;
+	for(p=cache_bucket(e->blocknum);*p;p=&(*p)->hnext) {
+		if(*p==e) {
+			*p = e->hnext;
+			break;
+		}
+	}
+	e->hnext = 0;
+}
+
+static void cache_touch( struct cache_entry *e )
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	e->next = cache_lru.next;
+	e->prev = &cache_lru;
+	cache_lru.next->prev = e;
+	cache_lru.next = e;
+}
+
+/* Write back a dirty entry with disk_lock dropped, keeping it busy meanwhile. */
+
+static void cache_writeback( struct cache_entry *e )
+{
+	e->busy = 1;
+	e->dirty = 0;
+	pthread_mutex_unlock(&disk_lock);
+	raw_write(e->blocknum,e->data);
+	pthread_mutex_lock(&disk_lock);
+	e->busy = 0;
+	pthread_cond_broadcast(&disk_ready);
+}
+
+/* Fill a newly claimed entry from the disk with disk_lock dropped, keeping it busy meanwhile. */
+
+static void cache_fill( struct cache_entry *e )
+{
+	e->busy = 1;
+	pthread_mutex_unlock(&disk_lock);
+	raw_read(e->blocknum,e->data);
+	pthread_mutex_lock(&disk_lock);
+	e->busy = 0;
+	pthread_cond_broadcast(&disk_ready);
+}
+
+/* The least recently used entry that nobody else is using, or 0 if every one is in use. */
+
+static struct cache_entry * cache_victim()
+{
+	struct cache_entry *e;
+
+	for(e=cache_lru.prev;e!=&cache_lru;e=e->prev) {
+		if(!e->pending && !e->busy) return e;
+	}
+	return 0;
+}
+
+/*
+Claim an entry for blocknum by recycling the victim. A dirty one is
+written back first, with disk_lock dropped, and 0 returned: another
+thread may have cached the block meanwhile, so the caller looks again
+before claiming. If every entry is in use, it waits for one and
+returns 0 too.
+*/
+
+static struct cache_entry * cache_claim( int blocknum )
+{
+	struct cache_entry *e = cache_victim();
+
+	if(!e) {
+		cache_wait(cache_lru.prev);
+		return 0;
+	}
+	if(e->dirty) {
+		cache_writeback(e);
+		return 0;
+	}
+
+	if(e->blocknum>=0) {
+		cache_unhash(e);
+		nevictions++;
+	}
+
+	e->blocknum = blocknum;
+	e->dirty = 0;
+	e->hnext = *cache_bucket(blocknum);
+	*cache_bucket(blocknum) = e;
+	cache_touch(e);
+
+	return e;
+}
+
+/*
+Find the cache entry for blocknum, claiming one on a miss.
+If load is set, a newly claimed entry is filled from the disk.
+A miss waits for any write past the cache to the block first.
+*/
+
+static struct cache_entry * cache_get( int blocknum, int load )
+{
+	struct cache_entry *e;
+
+	while(!(e=cache_lookup(blocknum))) {
+		if(write_pending(blocknum)) {
+			write_wait();
+			continue;
+		}
+		e = cache_claim(blocknum);
+		if(!e) continue;
+		nmisses++;
+		if(load) cache_fill(e);
+		return e;
+	}
+
+	nhits++;
+	cache_touch(e);
+	return e;
+}
+
+/* Write back every dirty entry, until a pass finds none; disk_lock is dropped for each. */
+
+static void cache_flush()
+{
+	int i, again=1;
+
+	while(again && cache) {
+		again = 0;
+		for(i=0;i<cache_nentries;i++) {
+			while(cache[i].pending || cache[i].busy) {
+				cache_wait(&cache[i]);
+				again = 1;
+			}
+			if(cache[i].blocknum>=0 && cache[i].dirty) {
+				cache_writeback(&cache[i]);
+				again = 1;
+			}
+		}
+	}
+}
+
 void disk_read( int blocknum, char *data )
 {
-	sanity_check(blocknum,data);
+	struct stats_span s;
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	sanity_check(blocknum,data);
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	stats_begin(&s);
+	pthread_mutex_lock(&disk_lock);
+	if(cache) {
+		memcpy(data,cache_get(blocknum,1)->data,DISK_BLOCK_SIZE);
+		pthread_mutex_unlock(&disk_lock);
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		pthread_mutex_unlock(&disk_lock);
+		raw_read(blocknum,data);
+	}
+	stats_blocks(blocknum,1,0);
+	stats_end(&s,STATS_DISK_READ,DISK_BLOCK_SIZE);
+}
+
+/*
+Copy length bytes starting offset bytes into a block, straight out
+of the cache or the mapping when the block is there.
+*/
+
+void disk_read_partial( int blocknum, int offset, char *data, int length )
+{
+	char block[DISK_BLOCK_SIZE];
+	struct stats_span s;
+
+	sanity_check(blocknum,data);
+	if(offset<0 || length<0 || offset+length>DISK_BLOCK_SIZE) {
+		printf("ERROR: partial read of %d bytes at %d is outside the block!\n",length,offset);
 		abort();
 	}
+
+	stats_begin(&s);
+	if(diskmap) {
+		memcpy(data,diskmap+(size_t)blocknum*DISK_BLOCK_SIZE+offset,length);
+		raw_count(1,0,0);
+	} else {
+		pthread_mutex_lock(&disk_lock);
+		if(cache) {
+			memcpy(data,cache_get(blocknum,1)->data+offset,length);
+			pthread_mutex_unlock(&disk_lock);
+		} else {
+			pthread_mutex_unlock(&disk_lock);
+			if(length==DISK_BLOCK_SIZE) {
+				raw_read(blocknum,data);
+			} else {
+				raw_read(blocknum,block);
+				memcpy(data,block+offset,length);
+			}
+		}
+	}
+	stats_blocks(blocknum,1,0);
+	stats_end(&s,STATS_DISK_READ,length);
 }
 
 void disk_write( int blocknum, const char *data )
 {
-	sanity_check(blocknum,data);
+	struct cache_entry *e;
+	struct stats_span s;
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	sanity_check(blocknum,data);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	stats_begin(&s);
+	pthread_mutex_lock(&disk_lock);
+	if(cache) {
+		/* A full-block write never needs the old contents. */
+		e = cache_get(blocknum,0);
+		memcpy(e->data,data,DISK_BLOCK_SIZE);
+		e->dirty = 1;
+		pthread_mutex_unlock(&disk_lock);
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		pthread_mutex_unlock(&disk_lock);
+		raw_write(blocknum,data);
+	}
+	stats_blocks(blocknum,1,1);
+	stats_end(&s,STATS_DISK_WRITE,DISK_BLOCK_SIZE);
+}
+
+/*
+Copy length bytes into a block starting offset bytes in, straight into
+the cache or the mapping when the block is there. The rest of the
+block keeps its contents, or is zeroed if fresh is set, in which case
+the old contents are never read.
+*/
+
+void disk_write_partial( int blocknum, int offset, const char *data, int length, int fresh )
+{
+	char block[DISK_BLOCK_SIZE];
+	struct cache_entry *e;
+	char *dest;
+	int locked=0;
+	struct stats_span s;
+
+	sanity_check(blocknum,data);
+	if(offset<0 || length<0 || offset+length>DISK_BLOCK_SIZE) {
+		printf("ERROR: partial write of %d bytes at %d is outside the block!\n",length,offset);
 		abort();
 	}
+
+	stats_begin(&s);
+	if(diskmap) {
+		dest = diskmap+(size_t)blocknum*DISK_BLOCK_SIZE;
+		raw_count(0,1,0);
+	} else {
+		pthread_mutex_lock(&disk_lock);
+		if(cache) {
+			e = cache_get(blocknum,!fresh);
+			e->dirty = 1;
+			dest = e->data;
+			locked = 1;
+		} else {
+			pthread_mutex_unlock(&disk_lock);
+			if(!fresh) raw_read(blocknum,block);
+			dest = block;
+		}
+	}
+	if(fresh) {
+		memset(dest,0,offset);
+		memset(dest+offset+length,0,DISK_BLOCK_SIZE-offset-length);
+	}
+	memcpy(dest+offset,data,length);
+	if(locked) pthread_mutex_unlock(&disk_lock);
+	if(dest==block) raw_write(blocknum,block);
+	stats_blocks(blocknum,1,1);
+	stats_end(&s,STATS_DISK_WRITE,length);
+}
+
+/*
+Check a vectored request and return the number of blocks it covers.
+Every buffer must be a whole number of blocks.
+*/
+
+static int vector_check( int blocknum, const struct iovec *iov, int iovcnt )
+{
+	int i, count=0;
+
+	for(i=0;i<iovcnt;i++) {
+		sanity_check(blocknum,iov[i].iov_base);
+		if(iov[i].iov_len%DISK_BLOCK_SIZE) {
+			printf("ERROR: iov length (%d) is not a multiple of the block size!\n",(int)iov[i].iov_len);
+			abort();
+		}
+		count += iov[i].iov_len/DISK_BLOCK_SIZE;
+	}
+
+	if(count>0) sanity_check(blocknum+count-1,iov);
+
+	return count;
+}
+
+/*
+Read a run of consecutive blocks into scattered buffers, like preadv.
+Blocks already in the cache are copied from it (they may be newer
+than the disk); the remaining runs go to the backend in one request
+each. Blocks read this way are not added to the cache, so streaming
+a large file does not flush out the metadata.
+*/
+
+void disk_readv( int blocknum, const struct iovec *iov, int iovcnt )
+{
+	struct iovec run[DISK_IOV_BATCH];
+	struct cache_entry *e;
+	int runstart=0, runcnt=0;
+	int i, j, b=blocknum, count;
+	char *dest;
+	struct stats_span s;
+
+	count = vector_check(blocknum,iov,iovcnt);
+
+	stats_begin(&s);
+	stats_blocks(blocknum,count,0);
+	pthread_mutex_lock(&disk_lock);
+	if(!cache) {
+		pthread_mutex_unlock(&disk_lock);
+		raw_transfer(0,blocknum,iov,iovcnt);
+		stats_end(&s,STATS_DISK_READV,(long long)count*DISK_BLOCK_SIZE);
+		return;
+	}
+
+	for(i=0;i<iovcnt;i++) {
+		for(j=0;j<iov[i].iov_len/DISK_BLOCK_SIZE;j++,b++) {
+			dest = (char*)iov[i].iov_base + (size_t)j*DISK_BLOCK_SIZE;
+			e = cache_lookup(b);
+			if(e || runcnt==DISK_IOV_BATCH) {
+				if(runcnt) {
+					/* The run goes to the disk with the lock dropped, so look the block up again after */
+					pthread_mutex_unlock(&disk_lock);
+					raw_transfer(0,runstart,run,runcnt);
+					pthread_mutex_lock(&disk_lock);
+					e = cache_lookup(b);
+				}
+				runcnt = 0;
+			}
+			if(e) {
+				nhits++;
+				cache_touch(e);
+				memcpy(dest,e->data,DISK_BLOCK_SIZE);
+			} else if(runcnt && (char*)run[runcnt-1].iov_base+run[runcnt-1].iov_len==dest) {
+				run[runcnt-1].iov_len += DISK_BLOCK_SIZE;
+			} else {
+				if(!runcnt) runstart = b;
+				run[runcnt].iov_base = dest;
+				run[runcnt].iov_len = DISK_BLOCK_SIZE;
+				runcnt++;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&disk_lock);
+	if(runcnt) raw_transfer(0,runstart,run,runcnt);
+	stats_end(&s,STATS_DISK_READV,(long long)count*DISK_BLOCK_SIZE);
+}
+
+/*
+Write a run of consecutive blocks from scattered buffers, like pwritev.
+The data goes straight to the backend; cached copies of the blocks
+are refreshed first, so that the cache never holds stale contents
+and a dirty copy is never written back over the new data. The run
+is listed as in flight from before the refresh until it lands.
+*/
+
+void disk_writev( int blocknum, const struct iovec *iov, int iovcnt )
+{
+	struct cache_entry *e;
+	struct write_span w;
+	int i, j, b=blocknum, count;
+	struct stats_span s;
+
+	count = vector_check(blocknum,iov,iovcnt);
+
+	stats_begin(&s);
+	stats_blocks(blocknum,count,1);
+	pthread_mutex_lock(&disk_lock);
+	if(cache) write_begin(&w,blocknum,count);
+	for(i=0;i<iovcnt && cache;i++) {
+		for(j=0;j<iov[i].iov_len/DISK_BLOCK_SIZE;j++,b++) {
+			e = cache_lookup(b);
+			if(e) {
+				memcpy(e->data,(char*)iov[i].iov_base+(size_t)j*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+				e->dirty = 0;
+			}
+		}
+	}
+	pthread_mutex_unlock(&disk_lock);
+
+	raw_transfer(1,blocknum,iov,iovcnt);
+	if(cache) {
+		pthread_mutex_lock(&disk_lock);
+		write_end(&w);
+		pthread_mutex_unlock(&disk_lock);
+	}
+	stats_end(&s,STATS_DISK_WRITEV,(long long)count*DISK_BLOCK_SIZE);
+}
+
+/*
+Tell the emulator that a run of blocks no longer holds anything.
+The range is punched out of the image file so the host can reclaim
+the space; reads of it return zeros. If the host filesystem cannot
+punch holes, the blocks are overwritten with zeros instead.
+*/
+
+void disk_discard( int blocknum, int count )
+{
+	struct cache_entry *e;
+	struct write_span w;
+	char *zero;
+	int i, n, punched;
+
+	if(count<=0) return;
+	sanity_check(blocknum,(void*)1);
+	sanity_check(blocknum+count-1,(void*)1);
+
+	pthread_mutex_lock(&disk_lock);
+	async_quiesce();
+	write_begin(&w,blocknum,count);
+
+	/* Forget cached copies so they are not written back over the hole. */
+	for(i=0;i<count && cache;i++) {
+		e = cache_lookup(blocknum+i);
+		if(e) {
+			cache_unhash(e);
+			e->blocknum = -1;
+			e->dirty = 0;
+		}
+	}
+
+	if(backend==DISK_BACKEND_STDIO) fflush(diskfile);
+	pthread_mutex_unlock(&disk_lock);
+
+	punched = fallocate(diskfd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE,(off_t)count*DISK_BLOCK_SIZE)==0;
+	pthread_mutex_lock(&disk_lock);
+	write_end(&w);
+	pthread_mutex_unlock(&disk_lock);
+
+	if(punched) {
+		raw_count(0,0,1);
+	} else {
+		n = count<DISK_IOV_BATCH ? count : DISK_IOV_BATCH;
+		zero = calloc(n,DISK_BLOCK_SIZE);
+		for(i=0;i<count;i+=n) {
+			disk_write_range(blocknum+i,count-i<n ? count-i : n,zero);
+		}
+		free(zero);
+	}
+}
+
+void disk_read_range( int blocknum, int count, char *data )
+{
+	struct iovec iov;
+	iov.iov_base = data;
+	iov.iov_len = (size_t)count*DISK_BLOCK_SIZE;
+	disk_readv(blocknum,&iov,1);
+}
+
+void disk_write_range( int blocknum, int count, const char *data )
+{
+	struct iovec iov;
+	iov.iov_base = (char*)data;
+	iov.iov_len = (size_t)count*DISK_BLOCK_SIZE;
+	disk_writev(blocknum,&iov,1);
+}
+
+/*
+Asynchronous requests keep up to async_depth transfers in flight.
+Where the kernel allows it they go through an io_uring, set up with
+raw system calls; otherwise a pool of worker threads runs them with
+preadv/pwritev. With a depth of zero, or on the mmap backend, each
+request is carried out at submit time and is complete immediately.
+Block and request counters are updated when a request is reaped.
+Each thread counts its own outstanding requests, so disk_drain waits
+for that thread's requests and not for those of other threads. Only
+one thread at a time waits on the engine, with disk_lock dropped;
+the others wait on disk_ready for it to reap something.
+*/
+
+struct async_request {
+	int id;
+	int write;
+	int prefetch;
+	int blocknum;
+	struct iovec *iov;
+	int iovcnt;
+	ssize_t expected;
+	ssize_t result;
+	int *owner;
+	struct write_span span;
+	struct async_request *next;
+};
+
+static int async_depth=DISK_QUEUE_DEPTH_DEFAULT;
+static int async_wanted=DISK_ASYNC_AUTO;
+static int async_engine=DISK_ASYNC_SYNC;
+static struct async_request *async_slots=0;
+static struct async_request *async_free=0;
+static int async_inflight=0;
+static __thread int async_demand=0;
+static int async_nextid=0;
+static int *async_done=0;
+static int async_ndone=0;
+static int async_maxdone=0;
+static int async_reaping=0;
+
+static struct {
+	int fd;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+} ring = { -1 };
+
+static pthread_t async_threads[DISK_ASYNC_MAXTHREADS];
+static int async_nthreads=0;
+static pthread_mutex_t async_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_work=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_finished=PTHREAD_COND_INITIALIZER;
+static struct async_request *async_queue=0;
+static struct async_request *async_queue_tail=0;
+static struct async_request *async_results=0;
+static int async_shutdown=0;
+
+static int uring_setup( int depth )
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	int fd;
+
+	memset(&p,0,sizeof(p));
+	fd = syscall(__NR_io_uring_setup,depth,&p);
+	if(fd<0) return 0;
+
+	ring.fd = fd;
+	ring.sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	ring.cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	ring.sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+
+	ring.sq_ring = mmap(0,ring.sq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+	ring.cq_ring = mmap(0,ring.cq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+	ring.sqes = mmap(0,ring.sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+	if(ring.sq_ring==MAP_FAILED || ring.cq_ring==MAP_FAILED || ring.sqes==MAP_FAILED) {
+		if(ring.sq_ring!=MAP_FAILED) munmap(ring.sq_ring,ring.sq_size);
+		if(ring.cq_ring!=MAP_FAILED) munmap(ring.cq_ring,ring.cq_size);
+		if(ring.sqes!=MAP_FAILED) munmap(ring.sqes,ring.sqes_size);
+		close(fd);
+		ring.fd = -1;
+		return 0;
+	}
+
+	sq = ring.sq_ring;
+	cq = ring.cq_ring;
+	ring.sq_tail = (unsigned*)(sq+p.sq_off.tail);
+	ring.sq_mask = (unsigned*)(sq+p.sq_off.ring_mask);
+	ring.sq_array = (unsigned*)(sq+p.sq_off.array);
+	ring.cq_head = (unsigned*)(cq+p.cq_off.head);
+	ring.cq_tail = (unsigned*)(cq+p.cq_off.tail);
+	ring.cq_mask = (unsigned*)(cq+p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+
+	return 1;
+}
+
+static void uring_teardown()
+{
+	if(ring.fd<0) return;
+	munmap(ring.sq_ring,ring.sq_size);
+	munmap(ring.cq_ring,ring.cq_size);
+	munmap(ring.sqes,ring.sqes_size);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+static void uring_submit( struct async_request *r )
+{
+	unsigned tail = *ring.sq_tail;
+	unsigned index = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = diskfd;
+	sqe->addr = (unsigned long)r->iov;
+	sqe->len = r->iovcnt;
+	sqe->off = (off_t)r->blocknum*DISK_BLOCK_SIZE;
+	sqe->user_data = (unsigned long)r;
+	ring.sq_array[index] = index;
+	__atomic_store_n(ring.sq_tail,tail+1,__ATOMIC_RELEASE);
+
+	if(syscall(__NR_io_uring_enter,ring.fd,1,0,0,0,0)<0) raw_error();
+}
+
+/* Wait until a completion is ready, leaving it to be reaped. */
+
+static void uring_wait()
+{
+	while(__atomic_load_n(ring.cq_head,__ATOMIC_ACQUIRE)==__atomic_load_n(ring.cq_tail,__ATOMIC_ACQUIRE)) {
+		if(syscall(__NR_io_uring_enter,ring.fd,0,1,IORING_ENTER_GETEVENTS,0,0)<0 && errno!=EINTR) raw_error();
+	}
+}
+
+static struct async_request * uring_reap( int wait )
+{
+	struct io_uring_cqe *cqe;
+	struct async_request *r;
+	unsigned head;
+
+	if(wait) uring_wait();
+	head = *ring.cq_head;
+	if(head==__atomic_load_n(ring.cq_tail,__ATOMIC_ACQUIRE)) return 0;
+
+	cqe = &ring.cqes[head & *ring.cq_mask];
+	r = (struct async_request*)(unsigned long)cqe->user_data;
+	r->result = cqe->res;
+	__atomic_store_n(ring.cq_head,head+1,__ATOMIC_RELEASE);
+
+	return r;
+}
+
+/* Carry out a request in the calling thread. */
+
+static ssize_t async_transfer( struct async_request *r )
+{
+	off_t offset = (off_t)r->blocknum*DISK_BLOCK_SIZE;
+	ssize_t total=0, actual;
+	int i;
+
+	if(diskmap) {
+		for(i=0;i<r->iovcnt;i++) {
+			if(r->write) {
+				memcpy(diskmap+offset+total,r->iov[i].iov_base,r->iov[i].iov_len);
+			} else {
+				memcpy(r->iov[i].iov_base,diskmap+offset+total,r->iov[i].iov_len);
+			}
+			total += r->iov[i].iov_len;
+		}
+		return total;
+	}
+
+	for(i=0;i<r->iovcnt;i+=IOV_MAX) {
+		int n = r->iovcnt-i<IOV_MAX ? r->iovcnt-i : IOV_MAX;
+		if(r->write) {
+			actual = pwritev(diskfd,r->iov+i,n,offset+total);
+		} else {
+			actual = preadv(diskfd,r->iov+i,n,offset+total);
+		}
+		if(actual<0) return actual;
+		total += actual;
+	}
+
+	return total;
+}
+
+static void * async_worker( void *arg )
+{
+	struct async_request *r;
+
+	pthread_mutex_lock(&async_lock);
+	while(1) {
+		while(!async_queue && !async_shutdown) pthread_cond_wait(&async_work,&async_lock);
+		if(!async_queue) break;
+
+		r = async_queue;
+		async_queue = r->next;
+		if(!async_queue) async_queue_tail = 0;
+		pthread_mutex_unlock(&async_lock);
+
+		r->result = async_transfer(r);
+
+		pthread_mutex_lock(&async_lock);
+		r->next = async_results;
+		async_results = r;
+		pthread_cond_signal(&async_finished);
+	}
+	pthread_mutex_unlock(&async_lock);
+
+	return 0;
+}
+
+static int threads_setup( int depth )
+{
+	int n = depth<DISK_ASYNC_MAXTHREADS ? depth : DISK_ASYNC_MAXTHREADS;
+
+	async_shutdown = 0;
+	for(async_nthreads=0;async_nthreads<n;async_nthreads++) {
+		if(pthread_create(&async_threads[async_nthreads],0,async_worker,0)) break;
+	}
+
+	return async_nthreads>0;
+}
+
+static void threads_teardown()
+{
+	int i;
+
+	pthread_mutex_lock(&async_lock);
+	async_shutdown = 1;
+	pthread_cond_broadcast(&async_work);
+	pthread_mutex_unlock(&async_lock);
+
+	for(i=0;i<async_nthreads;i++) pthread_join(async_threads[i],0);
+	async_nthreads = 0;
+}
+
+static void threads_submit( struct async_request *r )
+{
+	pthread_mutex_lock(&async_lock);
+	r->next = 0;
+	if(async_queue_tail) {
+		async_queue_tail->next = r;
+	} else {
+		async_queue = r;
+	}
+	async_queue_tail = r;
+	pthread_cond_signal(&async_work);
+	pthread_mutex_unlock(&async_lock);
+}
+
+static void threads_wait()
+{
+	pthread_mutex_lock(&async_lock);
+	while(!async_results) pthread_cond_wait(&async_finished,&async_lock);
+	pthread_mutex_unlock(&async_lock);
+}
+
+static struct async_request * threads_reap( int wait )
+{
+	struct async_request *r;
+
+	pthread_mutex_lock(&async_lock);
+	while(!async_results && wait) pthread_cond_wait(&async_finished,&async_lock);
+	r = async_results;
+	if(r) async_results = r->next;
+	pthread_mutex_unlock(&async_lock);
+
+	return r;
+}
+
+static void async_setup()
+{
+	int i;
+
+	async_engine = DISK_ASYNC_SYNC;
+	if(async_depth<=0 || diskmap || async_wanted==DISK_ASYNC_SYNC) return;
+
+	async_slots = calloc(async_depth,sizeof(*async_slots));
+	async_free = 0;
+	for(i=async_depth-1;i>=0;i--) {
+		async_slots[i].next = async_free;
+		async_free = &async_slots[i];
+	}
+
+	if(async_wanted!=DISK_ASYNC_THREADS && uring_setup(async_depth)) {
+		async_engine = DISK_ASYNC_URING;
+	} else if(async_wanted!=DISK_ASYNC_URING && threads_setup(async_depth)) {
+		async_engine = DISK_ASYNC_THREADS;
+	}
+}
+
+static void async_teardown()
+{
+	async_quiesce();
+
+	if(async_engine==DISK_ASYNC_URING) uring_teardown();
+	if(async_engine==DISK_ASYNC_THREADS) threads_teardown();
+	async_engine = DISK_ASYNC_SYNC;
+
+	free(async_slots);
+	async_slots = 0;
+	async_free = 0;
+}
+
+static void async_finish( int id, int write, ssize_t bytes )
+{
+	if(write) {
+		raw_count(0,bytes/DISK_BLOCK_SIZE,1);
+	} else {
+		raw_count(bytes/DISK_BLOCK_SIZE,0,1);
+	}
+
+	if(async_ndone==async_maxdone) {
+		async_maxdone = async_maxdone ? async_maxdone*2 : 16;
+		async_done = realloc(async_done,async_maxdone*sizeof(int));
+	}
+	async_done[async_ndone++] = id;
+}
+
+/* A prefetch has landed: its cache entries may now be used. */
+
+static void prefetch_finish( const struct iovec *iov, int iovcnt )
+{
+	int i;
+	for(i=0;i<iovcnt;i++) {
+		cache[((char*)iov[i].iov_base-cache_data)/DISK_BLOCK_SIZE].pending = 0;
+	}
+	pthread_cond_broadcast(&disk_ready);
+}
+
+static struct async_request * engine_reap()
+{
+	if(async_engine==DISK_ASYNC_URING) {
+		return uring_reap(0);
+	} else {
+		return threads_reap(0);
+	}
+}
+
+/*
+Wait for the engine to finish something without taking it, so that
+the wait can be done with disk_lock dropped while the request itself
+is still reaped under it.
+*/
+
+static void engine_wait()
+{
+	if(async_engine==DISK_ASYNC_URING) {
+		uring_wait();
+	} else {
+		threads_wait();
+	}
+}
+
+/*
+Reap one request from the engine, retrying it in the calling thread
+if the kernel moved less than asked (e.g. a short read). Returns 0
+if nothing has finished and wait is not set, or if wait is set and
+another thread reaped meanwhile; callers wait in a loop on whatever
+they are waiting for.
+*/
+
+static int async_reap( int wait )
+{
+	struct async_request *r;
+
+	if(!async_inflight) return 0;
+
+	if(async_reaping) {
+		if(wait) pthread_cond_wait(&disk_ready,&disk_lock);
+		return 0;
+	}
+	r = engine_reap();
+	if(!r && wait) {
+		async_reaping = 1;
+		pthread_mutex_unlock(&disk_lock);
+		engine_wait();
+		pthread_mutex_lock(&disk_lock);
+		async_reaping = 0;
+		pthread_cond_broadcast(&disk_ready);
+		r = engine_reap();
+	}
+	if(!r) return 0;
+
+	if(r->result!=r->expected) r->result = async_transfer(r);
+	if(r->result!=r->expected) raw_error();
+
+	if(r->prefetch) {
+		prefetch_finish(r->iov,r->iovcnt);
+		raw_count(r->result/DISK_BLOCK_SIZE,0,1);
+	} else {
+		if(r->write) write_end(&r->span);
+		async_finish(r->id,r->write,r->result);
+		(*r->owner)--;
+	}
+
+	free(r->iov);
+	r->next = async_free;
+	async_free = r;
+	async_inflight--;
+
+	return 1;
+}
+
+static int async_submit( int write, int blocknum, const struct iovec *iov, int iovcnt, int prefetch )
+{
+	struct async_request *r, tmp;
+	struct cache_entry *e;
+	int i, j, b, count;
+
+	count = vector_check(blocknum,iov,iovcnt);
+
+	r = &tmp;
+	if(async_engine!=DISK_ASYNC_SYNC) {
+		while(!async_free) async_reap(1);
+		r = async_free;
+		async_free = r->next;
+	}
+
+	/*
+	Keep the cache coherent with requests that bypass it: dirty
+	blocks are written back before the disk is read under them,
+	and cached copies take on the contents being written. A write
+	is listed as in flight before the cached copies are refreshed,
+	as refreshing may drop the lock, and stays listed until the
+	request is retired.
+	*/
+	if(write) write_begin(&r->span,blocknum,count);
+	for(i=0,b=blocknum;i<iovcnt && cache && !prefetch;i++) {
+		for(j=0;j<iov[i].iov_len/DISK_BLOCK_SIZE;j++,b++) {
+			e = cache_lookup(b);
+			if(!e) continue;
+			if(write) {
+				memcpy(e->data,(char*)iov[i].iov_base+(size_t)j*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+				e->dirty = 0;
+			} else if(e->dirty) {
+				cache_writeback(e);
+			}
+		}
+	}
+
+	if(backend==DISK_BACKEND_STDIO) fflush(diskfile);
+
+	if(async_engine==DISK_ASYNC_SYNC) {
+		tmp.write = write;
+		tmp.blocknum = blocknum;
+		tmp.iov = (struct iovec*)iov;
+		tmp.iovcnt = iovcnt;
+		pthread_mutex_unlock(&disk_lock);
+		if(async_transfer(&tmp)!=(ssize_t)count*DISK_BLOCK_SIZE) raw_error();
+		pthread_mutex_lock(&disk_lock);
+		if(write) write_end(&tmp.span);
+		if(prefetch) {
+			prefetch_finish(iov,iovcnt);
+			raw_count(count,0,1);
+			return -1;
+		}
+		async_finish(async_nextid,write,(ssize_t)count*DISK_BLOCK_SIZE);
+		return async_nextid++;
+	}
+
+	r->id = prefetch ? -1 : async_nextid++;
+	r->write = write;
+	r->prefetch = prefetch;
+	r->blocknum = blocknum;
+	r->iov = malloc(iovcnt*sizeof(struct iovec));
+	memcpy(r->iov,iov,iovcnt*sizeof(struct iovec));
+	r->iovcnt = iovcnt;
+	r->expected = (ssize_t)count*DISK_BLOCK_SIZE;
+	r->result = 0;
+	r->owner = &async_demand;
+	async_inflight++;
+	if(!prefetch) async_demand++;
+
+	if(async_engine==DISK_ASYNC_URING) {
+		uring_submit(r);
+	} else {
+		threads_submit(r);
+	}
+
+	return r->id;
+}
+
+/*
+Start reading a run of consecutive blocks into scattered buffers.
+The buffers must not be touched until the request completes.
+Returns an id that disk_complete hands back once it is done.
+*/
+
+int disk_submit_read( int blocknum, const struct iovec *iov, int iovcnt )
+{
+	struct stats_span s;
+	int id, count;
+
+	count = vector_check(blocknum,iov,iovcnt);
+
+	stats_begin(&s);
+	pthread_mutex_lock(&disk_lock);
+	id = async_submit(0,blocknum,iov,iovcnt,0);
+	stats_blocks(blocknum,count,0);
+	pthread_mutex_unlock(&disk_lock);
+	stats_end(&s,STATS_DISK_SUBMIT_READ,(long long)count*DISK_BLOCK_SIZE);
+	return id;
+}
+
+int disk_submit_write( int blocknum, const struct iovec *iov, int iovcnt )
+{
+	struct stats_span s;
+	int id, count;
+
+	count = vector_check(blocknum,iov,iovcnt);
+
+	stats_begin(&s);
+	pthread_mutex_lock(&disk_lock);
+	id = async_submit(1,blocknum,iov,iovcnt,0);
+	stats_blocks(blocknum,count,1);
+	pthread_mutex_unlock(&disk_lock);
+	stats_end(&s,STATS_DISK_SUBMIT_WRITE,(long long)count*DISK_BLOCK_SIZE);
+	return id;
+}
+
+/*
+Return the id of a finished request, waiting for one if wait is
+set. Returns -1 if no request is outstanding or, without wait,
+none has finished yet. The ids of all threads' requests are handed
+out together, so threads sharing the disk should use disk_drain.
+*/
+
+int disk_complete( int wait )
+{
+	int id, i;
+
+	pthread_mutex_lock(&disk_lock);
+	if(!async_ndone) async_reap(wait);
+	while(wait && !async_ndone && async_inflight) async_reap(1);
+	if(!async_ndone) {
+		pthread_mutex_unlock(&disk_lock);
+		return -1;
+	}
+
+	id = async_done[0];
+	for(i=1;i<async_ndone;i++) async_done[i-1] = async_done[i];
+	async_ndone--;
+	pthread_mutex_unlock(&disk_lock);
+
+	return id;
+}
+
+/*
+Wait for every request this thread has outstanding and forget the
+finished ids. Prefetches are left to finish in the background.
+*/
+
+void disk_drain()
+{
+	pthread_mutex_lock(&disk_lock);
+	while(async_demand) async_reap(1);
+	async_ndone = 0;
+	pthread_mutex_unlock(&disk_lock);
+}
+
+/* Tell whether nothing is in flight, so that no reap will ever finish a pending entry. */
+
+static int async_idle()
+{
+	return !async_inflight;
+}
+
+/* Wait for everything in flight, prefetches included. */
+
+static void async_quiesce()
+{
+	while(async_inflight) async_reap(1);
+	async_ndone = 0;
+}
+
+/*
+Start loading a run of blocks into the cache without waiting.
+Each uncached block claims an entry that stays marked pending until
+its data arrives; anyone looking the block up meanwhile waits for it.
+At most half the cache is given to a single prefetch. On the mmap
+backend this just advises the kernel to page the range in.
+*/
+
+void disk_prefetch( int blocknum, int count )
+{
+	struct iovec run[DISK_IOV_BATCH];
+	struct cache_entry *e;
+	int runstart=0, runcnt=0;
+	int b;
+
+	if(blocknum<0 || count<=0 || blocknum>=nblocks) return;
+	if(blocknum+count>nblocks) count = nblocks-blocknum;
+
+	if(diskmap) {
+		madvise(diskmap+(size_t)blocknum*DISK_BLOCK_SIZE,(size_t)count*DISK_BLOCK_SIZE,MADV_WILLNEED);
+		return;
+	}
+
+	pthread_mutex_lock(&disk_lock);
+	if(!cache) {
+		pthread_mutex_unlock(&disk_lock);
+		return;
+	}
+	if(count>cache_nentries/2) count = cache_nentries/2;
+
+	for(b=blocknum;b<blocknum+count;b++) {
+		/*
+		Claiming may drop the lock to write back a victim, and someone
+		may cache b meanwhile. A prefetch never waits for an entry, as
+		its own unsubmitted ones could be all there is to wait for,
+		and skips blocks with a write past the cache on the way.
+		*/
+		e = 0;
+		while(!cache_find(b) && !write_pending(b) && cache_victim() && !(e=cache_claim(b)));
+		if(e) e->pending = 1;
+		if(!e || runcnt==DISK_IOV_BATCH) {
+			if(runcnt) async_submit(0,runstart,run,runcnt,1);
+			runcnt = 0;
+		}
+		if(!e && !cache_find(b) && !write_pending(b)) break;
+		if(!e) continue;
+
+		if(!runcnt) runstart = b;
+		run[runcnt].iov_base = e->data;
+		run[runcnt].iov_len = DISK_BLOCK_SIZE;
+		runcnt++;
+	}
+
+	if(runcnt) async_submit(0,runstart,run,runcnt,1);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+/* Tell whether a block is in the cache, or on its way there. */
+
+int disk_cached( int blocknum )
+{
+	int cached;
+	pthread_mutex_lock(&disk_lock);
+	cached = cache && blocknum>=0 && blocknum<nblocks && cache_find(blocknum);
+	pthread_mutex_unlock(&disk_lock);
+	return cached;
+}
+
+int disk_queue_depth( int depth, int engine )
+{
+	if(depth<0 || engine<DISK_ASYNC_AUTO || engine>DISK_ASYNC_THREADS) return 0;
+
+	pthread_mutex_lock(&disk_lock);
+	if(diskfile) async_teardown();
+	async_depth = depth;
+	async_wanted = engine;
+	if(diskfile) async_setup();
+	pthread_mutex_unlock(&disk_lock);
+
+	return 1;
+}
+
+const char * disk_queue_engine()
+{
+	switch(async_engine) {
+		case DISK_ASYNC_URING:   return "io_uring";
+		case DISK_ASYNC_THREADS: return "threads";
+		default:                 return "sync";
+	}
+}
+
+/* Take a snapshot of the counters disk_close reports. */
+
+void disk_get_counters( struct disk_counters *c )
+{
+	pthread_mutex_lock(&disk_lock);
+	c->reads = __atomic_load_n(&nreads,__ATOMIC_RELAXED);
+	c->writes = __atomic_load_n(&nwrites,__ATOMIC_RELAXED);
+	c->requests = __atomic_load_n(&nrequests,__ATOMIC_RELAXED);
+	c->hits = nhits;
+	c->misses = nmisses;
+	c->evictions = nevictions;
+	pthread_mutex_unlock(&disk_lock);
+}
+
+void disk_sync()
+{
+	pthread_mutex_lock(&disk_lock);
+	if(!diskfile) {
+		pthread_mutex_unlock(&disk_lock);
+		return;
+	}
+
+	async_quiesce();
+	cache_flush();
+	pthread_mutex_unlock(&disk_lock);
+
+	if(diskmap) {
+		msync(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE,MS_SYNC);
+	} else {
+		fflush(diskfile);
+	}
+	/* Flushing only reaches the page cache; writes through the descriptor need fdatasync to reach the device */
+	if(fdatasync(diskfd)<0) raw_error();
+}
+
+int disk_cache_size( int n )
+{
+	if(n<0) return 0;
+
+	pthread_mutex_lock(&disk_lock);
+	async_quiesce();
+	cache_flush();
+	cache_nentries = n;
+	if(diskfile) cache_alloc();
+	pthread_mutex_unlock(&disk_lock);
+
+	return 1;
 }
 
 void disk_close()
 {
+	disk_sync();
+
+	pthread_mutex_lock(&disk_lock);
 	if(diskfile) {
+		async_quiesce();
+		cache_flush();
+		async_teardown();
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
+		printf("%d disk requests\n",nrequests);
+		printf("%d cache hits\n",nhits);
+		printf("%d cache misses\n",nmisses);
+		printf("%d cache evictions\n",nevictions);
+		if(diskmap) munmap(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE);
 		fclose(diskfile);
 		diskfile = 0;
+		diskfd = -1;
+		diskmap = 0;
+		cache_free();
 	}
+	pthread_mutex_unlock(&disk_lock);
 }
 
@@ -1,12 +1,54 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <sys/uio.h>
+
 #define DISK_BLOCK_SIZE 4096
+#define DISK_CACHE_DEFAULT 256
+#define DISK_QUEUE_DEPTH_DEFAULT 16
+
+#define DISK_BACKEND_STDIO 0
+#define DISK_BACKEND_PREAD 1
+#define DISK_BACKEND_MMAP  2
+#define DISK_BACKEND_DEFAULT DISK_BACKEND_PREAD
+
+#define DISK_ASYNC_AUTO    0
+#define DISK_ASYNC_SYNC    1
+#define DISK_ASYNC_URING   2
+#define DISK_ASYNC_THREADS 3
+
+struct disk_counters {
+	int reads;      /* blocks read from the image */
+	int writes;     /* blocks written to the image */
+	int requests;   /* transfers issued to the backend */
+	int hits;
+	int misses;
+	int evictions;
+};
 
 int  disk_init( const char *filename, int nblocks );
+int  disk_init_backend( const char *filename, int nblocks, int backend );
 int  disk_size();
 void disk_read( int blocknum, char *data );
+void disk_read_partial( int blocknum, int offset, char *data, int length );
 void disk_write( int blocknum, const char *data );
+void disk_write_partial( int blocknum, int offset, const char *data, int length, int fresh );
+void disk_readv( int blocknum, const struct iovec *iov, int iovcnt );
+void disk_writev( int blocknum, const struct iovec *iov, int iovcnt );
+void disk_read_range( int blocknum, int count, char *data );
+void disk_write_range( int blocknum, int count, const char *data );
+void disk_discard( int blocknum, int count );
+int  disk_submit_read( int blocknum, const struct iovec *iov, int iovcnt );
+int  disk_submit_write( int blocknum, const struct iovec *iov, int iovcnt );
+int  disk_complete( int wait );
+void disk_drain();
+void disk_prefetch( int blocknum, int count );
+int  disk_cached( int blocknum );
+int  disk_queue_depth( int depth, int engine );
+const char * disk_queue_engine();
+void disk_get_counters( struct disk_counters *c );
+void disk_sync();
+int  disk_cache_size( int nentries );
 void disk_close();
 
 
@@ -1,31 +1,129 @@
 #include "fs.h"
 #include "disk.h"
+#include "stats.h"
+#include "lz.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 
 #define FS_MAGIC 0xf0f03410
 #define INODES_PER_BLOCK 128
 #define POINTERS_PER_INODE 5
 #define POINTERS_PER_BLOCK 1024
+#define BITS_PER_BLOCK (DISK_BLOCK_SIZE * 8)
 
+/* Bits of fs_inode.isvalid */
+#define INODE_VALID 1
+#define INODE_EXTENTS 2  /* blocks recorded as extents instead of pointers */
+#define INODE_INLINE 4   /* contents kept in the inode itself, in place of either */
+#define INODE_COMPRESSED 8  /* data blocks written as compressed clusters */
+#define INODE_DEDUP 16      /* data blocks shared with any holding the same contents */
+
+/* Bits of fs_superblock.features */
+#define FEATURE_EXTENTS 1  /* new files are created with INODE_EXTENTS */
+#define FEATURE_JOURNAL 2  /* metadata blocks are written through the journal */
+#define FEATURE_INLINE 4   /* new files are created with INODE_INLINE */
+#define FEATURE_COMPRESS 8  /* new files are created with INODE_COMPRESSED */
+#define FEATURE_DEDUP 16    /* new files are created with INODE_DEDUP */
+
+#define EXTENTS_PER_INODE 2
+#define EXTENTS_PER_NODE ((DISK_BLOCK_SIZE - 2 * (int)sizeof(int)) / (int)sizeof(struct fs_extent))
+#define CHILDREN_PER_NODE (EXTENTS_PER_NODE * 2)
+#define EXTENT_MAX_DEPTH 4
+/* File sizes are ints, which bounds the blocks an extent file can have */
+#define EXTENT_MAX_BLOCKS (INT_MAX / DISK_BLOCK_SIZE)
+/* Bytes a file can keep in its inode: the space of the block pointers */
+#define INLINE_BYTES ((POINTERS_PER_INODE + 1) * (int)sizeof(int))
+
+/*
+Images made before the on-disk bitmap existed have zero in every
+field past ninodes; they are still mounted by scanning the inodes.
+*/
 struct fs_superblock
 {
     int magic;
     int nblocks;
     int ninodeblocks;
     int ninodes;
+    int nbitmapblocks;  /* free-block bitmap, right after the inode blocks */
+    int clean;          /* set by fs_unmount, cleared while mounted */
+    int features;       /* FEATURE_ bits chosen at format time */
+    int journalblocks;  /* write-ahead journal, right after the bitmap */
+};
+
+/* A run of length adjacent disk blocks from start on; start 0 is a hole */
+struct fs_extent
+{
+    int start;
+    int length;
 };
 
+/*
+An extent inode keeps up to EXTENTS_PER_INODE extents in place of the
+block pointers. Files with more extents than that keep all of them in
+a tree instead: leaves hold extents in file order and index nodes hold
+the block numbers of the nodes one level down. An inline inode keeps
+the file's few bytes where the pointers or extents would be, and
+becomes an inode of the other kind when the file outgrows them.
+*/
 struct fs_inode
 {
     int isvalid;
     int size;
-    int direct[POINTERS_PER_INODE];
-    int indirect;
+    union
+    {
+        struct
+        {
+            int direct[POINTERS_PER_INODE];
+            int indirect;
+        };
+        struct
+        {
+            struct fs_extent extent[EXTENTS_PER_INODE];
+            int nextents;
+            int tree;  /* root of the extent tree, 0 if the extents fit in the inode */
+        };
+        char contents[INLINE_BYTES];
+    };
+};
+
+struct fs_extent_node
+{
+    int depth;  /* 0 for a leaf */
+    int count;
+    union
+    {
+        struct fs_extent extent[EXTENTS_PER_NODE];
+        int child[CHILDREN_PER_NODE];
+    };
+};
+
+/*
+Blocks of the journal. The first block of the journal is its header;
+a transaction is a descriptor, the new contents of the blocks it logs
+and a commit block, written one after the other.
+*/
+#define JOURNAL_MAGIC 0x4a524e4c
+#define JOURNAL_HEADER 0
+#define JOURNAL_DESCRIPTOR 1
+#define JOURNAL_COMMIT 2
+#define JOURNAL_TAGS ((DISK_BLOCK_SIZE - 5 * (int)sizeof(int)) / (int)sizeof(int))
+
+struct fs_journal_block
+{
+    int magic;
+    int kind;           /* JOURNAL_HEADER, JOURNAL_DESCRIPTOR or JOURNAL_COMMIT */
+    int sequence;       /* of the transaction; in the header, of the first one to replay */
+    int count;          /* blocks the transaction logs; in the header, where it starts */
+    unsigned checksum;  /* of the descriptor and the logged blocks, in the commit block */
+    int home[JOURNAL_TAGS];  /* in the descriptor, where each logged block belongs */
 };
 
 union fs_block
@@ -33,47 +131,545 @@ union fs_block
     struct fs_superblock super;
     struct fs_inode inode[INODES_PER_BLOCK];
     int pointers[POINTERS_PER_BLOCK];
+    struct fs_extent_node node;
+    struct fs_journal_block journal;
     char data[DISK_BLOCK_SIZE];
 };
 
-/* Free block bitmap */
-/* Index by block number, 1 - used, 0 - free */
-int *bitmap = NULL;
+/*
+Bit-packed bitmap, one bit per item: 1 - used, 0 - free.
+Free bits are found a 64-bit word at a time, starting from a
+next-fit hint that rotates past the last allocation.
+*/
+struct fs_bitmap
+{
+    uint64_t *words;
+    int nbits;
+    int nfree;
+    int hint;
+    char *dirty;  /* per on-disk bitmap block, NULL if not persisted */
+};
+
+/* Free block bitmap, indexed by block number */
+static struct fs_bitmap bitmap;
+
+/* Free inode bitmap, indexed by inode number, rebuilt from the inode table at mount */
+static struct fs_bitmap inode_bitmap;
+static pthread_mutex_t inode_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+Locking: the file operations hold fs_lock shared and the operations
+on the whole filesystem (format, mount, sync, unmount, debug) hold it
+exclusively. A file operation also holds the lock of its inode, read
+or write as the operation needs, so different files proceed in
+parallel. Inodes share INODE_LOCKS locks by number, and no thread
+ever holds two of them.
+*/
+#define INODE_LOCKS 256
+
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t inode_locks[INODE_LOCKS] = { [0 ... INODE_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER };
+
+/*
+The block bitmap is split into shards of whole words, each with its
+own lock and next-fit hint. A file allocates from the shard picked
+by its inode number, moving on to the next shard when that is full.
+*/
+#define ALLOC_SHARDS 16
+
+struct fs_shard
+{
+    pthread_mutex_t lock;
+    int start;  /* first block of the shard */
+    int end;
+    int hint;
+};
+
+static struct fs_shard shards[ALLOC_SHARDS] = { [0 ... ALLOC_SHARDS - 1] = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0 } };
+static int nshards = 0;
+static int shard_size = 0;
+
+/* Free blocks promised to the extent trees of resident block maps, which data allocations leave alone */
+static int tree_reserve = 0;
+/* Free blocks promised to file data waiting in the delayed buffers of block maps */
+static int delay_reserve = 0;
+/* Delayed blocks that found no disk block despite the promise; the next fs_sync or fs_unmount fails */
+static int delay_lost = 0;
+
+/*
+With FEATURE_JOURNAL, changed inode blocks, indirect blocks and extent
+tree nodes are not written in place. They are gathered in the running
+transaction, a later change to a block replacing its earlier one, and
+the whole transaction is appended to the journal at once and only
+then written to the blocks' home locations, through the disk cache.
+A block logged by the last committed transaction could be written by
+replay after a crash, so if it is freed it stays allocated until the
+next commit has made sure the transaction's blocks are home.
+Commits come with fs_sync, and also whenever the metadata waiting for
+one has filled half of what a transaction can log.
+*/
+#define JOURNAL_MIN_BLOCKS 8
+#define JOURNAL_MAX_BLOCKS 1024
+
+struct fs_journal
+{
+    int start;     /* first block of the journal, 0 if there is none */
+    int nblocks;
+    int head;      /* block of the journal the next transaction goes to */
+    int sequence;  /* of the next transaction */
+    char **images;  /* the running transaction: new contents of blocks */
+    int *homes;     /* and the blocks they belong in */
+    int count;
+    int capacity;
+    int *slot;      /* per disk block: 1 + its place in the running transaction, 0 if none */
+    int *logged;    /* blocks logged by the last committed transaction */
+    int nlogged;
+    char *live;     /* per disk block: set if logged by the last committed transaction */
+    int *deferred;  /* blocks freed while live */
+    int ndeferred;
+    int pending;    /* blocks the next commit would log: the running transaction, changed inode blocks and maps */
+};
+
+static struct fs_journal journal;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+With FEATURE_DEDUP, a data block whose contents are already on disk is
+shared rather than written again. The blocks are found through an
+index from a hash of their contents, chained per bucket through the
+blocks themselves. A block's references beyond the first are counted
+in shares, next to the bitmap bit that marks it used, and freeing a
+shared block only drops a reference. The counts are not kept on disk
+but counted from the inodes at mount, and the index starts out empty.
+*/
+#define DEDUP_MAX_SHARES 255
+
+struct fs_dedup
+{
+    unsigned char *shares;  /* per block: references beyond the first, NULL without FEATURE_DEDUP */
+    unsigned *hash;         /* per block: hash of the contents, if indexed */
+    int *next;              /* per block: next block of its bucket, 0 at the end, -1 if not indexed */
+    int *buckets;
+    int mask;
+};
+
+static struct fs_dedup dedup;
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Resident copy of the superblock and inode table while mounted */
+static struct fs_superblock super;
+/* First block past the metadata of the mounted filesystem */
+static int datastart = 0;
+static struct fs_inode *inodes = NULL;
+/* One flag per inode block, set when an inode in it has changed */
+static char *inode_dirty = NULL;
+
+/*
+Sequential readahead state for the few most recently read inodes.
+A read that starts where the last one ended (or at offset 0) counts
+as sequential and doubles the window of blocks prefetched past it;
+any other read resets the window.
+*/
+#define READAHEAD_STREAMS 8
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 128
+
+struct fs_stream
+{
+    int inumber;
+    int next;    /* offset the next sequential read starts at */
+    int window;  /* blocks to keep prefetched ahead of the reader */
+    int ahead;   /* file block up to which prefetches were issued */
+    int used;
+};
+
+static struct fs_stream streams[READAHEAD_STREAMS];
+static int stream_clock = 0;
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+Block maps of recently used inodes: file block number to disk block,
+so a lookup costs no I/O and the indirect block or extent tree is
+read once per load. Newly allocated pointers past the direct ones,
+and any new block of an extent inode, leave the map dirty until it
+is written back by fs_sync or on eviction. A file operation pins
+the map of its inode while it runs, and only unpinned maps are
+evicted.
+
+Data written past the last block of a map is held in the map's
+delayed buffer, with a free block promised for each buffered block,
+and only given disk blocks when the buffer fills or the map is
+written back. The blocks are then taken as a few runs of adjacent
+blocks, so files built from small appends stay contiguous.
+*/
+#define BLOCKMAP_SLOTS 32
+#define DELAY_BLOCKS 64
+
+struct fs_blockmap
+{
+    int inumber;  /* 0 for an unused slot */
+    int *blocks;
+    int nblocks;
+    int capacity;
+    int *meta;     /* indirect block or extent tree nodes */
+    int nmeta;
+    int nextents;  /* upper bound on the extents of the blocks, for extent inodes */
+    int reserved;  /* this map's share of tree_reserve */
+    int dirty;
+    int pending;   /* while dirty, this map's share of journal.pending */
+    int used;
+    int pins;
+    int loading;   /* inode the slot is being handed to, with blockmap_lock dropped; 0 if none */
+    char *delayed;  /* data of the file blocks from nblocks on, which have no disk blocks yet */
+    int ndelayed;
+};
+
+static struct fs_blockmap blockmaps[BLOCKMAP_SLOTS];
+static int blockmap_clock = 0;
+static pthread_mutex_t blockmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t blockmap_ready = PTHREAD_COND_INITIALIZER;
+
+static int inode_flush();
+static void table_scan(int rebuild);
+static void stream_forget(int inumber);
+static void blockmap_fill(struct fs_blockmap *map, const struct fs_inode *inode);
+static void blockmap_store(struct fs_blockmap *map);
+static void blockmap_flush();
+static void blockmap_reset();
+static void extent_reserve(struct fs_blockmap *map, int reserve);
+static void extent_reserve_next(struct fs_blockmap *map);
+static void extent_append(struct fs_blockmap *map, const struct fs_extent *extent);
+static void extents_store(struct fs_blockmap *map);
+static void blockmap_set(struct fs_blockmap *map, int n, int num);
+static void blockmap_meta(struct fs_blockmap *map, int num);
+static void blockmap_dirty(struct fs_blockmap *map);
+static void blockmap_clean(struct fs_blockmap *map);
+static void inode_save(int inumber);
+static void handle_forget(int inumber);
+static int delay_flush(struct fs_blockmap *map);
+static int write_blocks(struct fs_inode *inode, struct fs_blockmap *map, const char *data, int length, int offset);
+static void block_free(int num);
+static void dedup_init(int nblocks);
+static void dedup_close();
+static void journal_header(int start, int sequence, int head);
+static void journal_open();
+static void journal_close();
+static void journal_commit();
+static void journal_checkpoint();
+static int journal_forget(int blocknum);
+static void meta_write(int blocknum, const char *data);
+static void meta_read(int blocknum, char *data);
+
+#define BITMAP_BLOCKS(nbits) (((nbits) + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK)
+#define BITMAP_WORDS(nbits) (BITMAP_BLOCKS(nbits) * (DISK_BLOCK_SIZE / 8))
+
+/* The words are padded to whole blocks so they can be moved to and from disk as is */
+static void bitmap_init(struct fs_bitmap *bm, int nbits, int persistent)
+{
+    bm->words = (uint64_t *)calloc(BITMAP_WORDS(nbits), sizeof(uint64_t));
+    bm->nbits = nbits;
+    bm->nfree = nbits;
+    bm->hint = 0;
+    bm->dirty = persistent ? (char *)calloc(BITMAP_BLOCKS(nbits), sizeof(char)) : NULL;
+}
+
+static void bitmap_release(struct fs_bitmap *bm)
+{
+    free(bm->words);
+    free(bm->dirty);
+    memset(bm, 0, sizeof(*bm));
+}
+
+/* Shards may share a bitmap block, so the flag is stored atomically */
+static void bitmap_touch(struct fs_bitmap *bm, int n)
+{
+    if (bm->dirty)
+    {
+        __atomic_store_n(&bm->dirty[n / BITS_PER_BLOCK], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int bitmap_test(const struct fs_bitmap *bm, int n)
+{
+    return (bm->words[n / 64] >> (n % 64)) & 1;
+}
+
+static void bitmap_set(struct fs_bitmap *bm, int n)
+{
+    if (n < 0 || n >= bm->nbits || bitmap_test(bm, n))
+    {
+        return;
+    }
+    bm->words[n / 64] |= (uint64_t)1 << (n % 64);
+    __atomic_sub_fetch(&bm->nfree, 1, __ATOMIC_RELAXED);
+    bitmap_touch(bm, n);
+}
+
+/* Clearing bit 0 is ignored: a zero block pointer means "no block" */
+static void bitmap_clear(struct fs_bitmap *bm, int n)
+{
+    if (n <= 0 || n >= bm->nbits || !bitmap_test(bm, n))
+    {
+        return;
+    }
+    bm->words[n / 64] &= ~((uint64_t)1 << (n % 64));
+    __atomic_add_fetch(&bm->nfree, 1, __ATOMIC_RELAXED);
+    bitmap_touch(bm, n);
+}
+
+/* Recompute the free count from the words, e.g. after loading them wholesale */
+static void bitmap_recount(struct fs_bitmap *bm)
+{
+    int used = 0;
+    for (int i = 0; i < BITMAP_WORDS(bm->nbits); i++)
+    {
+        used += __builtin_popcountll(bm->words[i]);
+    }
+    bm->nfree = bm->nbits - used;
+}
+
+/* Return the first free bit in [from, to), or -1 if there is none */
+static int bitmap_find(const struct fs_bitmap *bm, int from, int to)
+{
+    while (from < to)
+    {
+        uint64_t free_bits = ~bm->words[from / 64] >> (from % 64);
+        if (free_bits)
+        {
+            int n = from + __builtin_ctzll(free_bits);
+            return n < to ? n : -1;
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return -1;
+}
+
+/* Return the first used bit in [from, to), or to if there is none */
+static int bitmap_find_used(const struct fs_bitmap *bm, int from, int to)
+{
+    while (from < to)
+    {
+        uint64_t used_bits = bm->words[from / 64] >> (from % 64);
+        if (used_bits)
+        {
+            int n = from + __builtin_ctzll(used_bits);
+            return n < to ? n : to;
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return to;
+}
+
+/*
+Find the first run of want free bits in [lo, hi), or failing that the
+longest run there is. Returns its first bit and sets *len, or returns
+-1 if every bit in the range is in use.
+*/
+static int bitmap_find_run(const struct fs_bitmap *bm, int lo, int hi, int want, int *len)
+{
+    int best = -1;
+    *len = 0;
+    int n = bitmap_find(bm, lo, hi);
+    while (n >= 0)
+    {
+        int end = bitmap_find_used(bm, n, n + want < hi ? n + want : hi);
+        if (end - n > *len)
+        {
+            best = n;
+            *len = end - n;
+        }
+        if (*len == want || end >= hi)
+        {
+            break;
+        }
+        n = bitmap_find(bm, end, hi);
+    }
+    return best;
+}
+
+/*
+Allocate a free bit in [lo, hi), searching from *hint and wrapping
+around once. Returns -1 if every bit in the range is in use.
+*/
+static int bitmap_alloc(struct fs_bitmap *bm, int lo, int hi, int *hint)
+{
+    if (__atomic_load_n(&bm->nfree, __ATOMIC_RELAXED) == 0)
+    {
+        return -1;
+    }
+
+    int start = *hint < lo || *hint >= hi ? lo : *hint;
+    int n = bitmap_find(bm, start, hi);
+    if (n < 0)
+    {
+        n = bitmap_find(bm, lo, start);
+    }
+    if (n < 0)
+    {
+        return -1;
+    }
+
+    bitmap_set(bm, n);
+    *hint = n + 1 < hi ? n + 1 : lo;
+    return n;
+}
+
+/* Write the changed bitmap blocks back to disk, starting at block start */
+static void bitmap_flush(struct fs_bitmap *bm, int start)
+{
+    if (bm->dirty == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < BITMAP_BLOCKS(bm->nbits); i++)
+    {
+        if (bm->dirty[i])
+        {
+            disk_write(start + i, (const char *)&bm->words[i * (DISK_BLOCK_SIZE / 8)]);
+            bm->dirty[i] = 0;
+        }
+    }
+}
+
+static void super_write()
+{
+    union fs_block block;
+    memset(block.data, 0, sizeof(block.data));
+    block.super = super;
+    disk_write(0, block.data);
+}
+
+/* Overwrite a run of blocks with zeros, a batch of blocks per request */
+static void zero_blocks(int start, int count)
+{
+    int batch = count < 256 ? count : 256;
+    char *buffer = (char *)calloc(batch, DISK_BLOCK_SIZE);
+    for (int i = 0; i < count; i += batch)
+    {
+        disk_write_range(start + i, count - i < batch ? count - i : batch, buffer);
+    }
+    free(buffer);
+}
 
 int fs_format()
+{
+    return fs_format_flags(0);
+}
+
+/*
+By default only the superblock and bitmap are written and the rest
+of the disk is discarded, so formatting takes about the same time
+whatever the disk size. FS_FORMAT_WIPE writes zeros over every block.
+FS_FORMAT_EXTENTS makes every file created on the disk an extent file.
+FS_FORMAT_JOURNAL sets aside a journal after the bitmap, about one
+block in 64 of the disk, for metadata to be written through.
+FS_FORMAT_INLINE keeps files of up to INLINE_BYTES in their inodes.
+FS_FORMAT_COMPRESS stores file data compressed, a cluster at a time.
+FS_FORMAT_DEDUP stores blocks with the same contents once; it cannot
+be combined with FS_FORMAT_COMPRESS.
+*/
+static int format_disk(int flags)
 {
     /* Return failure if attempting to format an already mounted disk */
-    if (bitmap != NULL)
+    if (inodes != NULL || ((flags & FS_FORMAT_COMPRESS) && (flags & FS_FORMAT_DEDUP)))
     {
         return 0;
     }
 
-    /* Destroy any data already present */
     int nblocks = disk_size();
-    char *buffer = (char *)calloc(4096, sizeof(char));
-    for (size_t i = 0; i < nblocks; i++)
-    {
-        disk_write(i, buffer);
-    }
-    free(buffer);
 
     /* Calculate # of blocks to be allocated for inodes and total # of inodes */
     int ninodeblocks = (nblocks + (10 - 1)) / 10;
     int ninodes = ninodeblocks * INODES_PER_BLOCK;
+    int nbitmapblocks = BITMAP_BLOCKS(nblocks);
+    int journalblocks = 0;
+    if (flags & FS_FORMAT_JOURNAL)
+    {
+        journalblocks = nblocks / 64;
+        journalblocks = journalblocks < JOURNAL_MIN_BLOCKS ? JOURNAL_MIN_BLOCKS : journalblocks > JOURNAL_MAX_BLOCKS ? JOURNAL_MAX_BLOCKS : journalblocks;
+    }
+    int metablocks = 1 + ninodeblocks + nbitmapblocks + journalblocks;
+    if (metablocks >= nblocks)
+    {
+        return 0;
+    }
 
-    /* Write the superblock */
-    union fs_block block;
-    block.super.magic = FS_MAGIC;
-    block.super.nblocks = nblocks;
-    block.super.ninodeblocks = ninodeblocks;
-    block.super.ninodes = ninodes;
-    disk_write(0, block.data);
+    /* Destroy any data already present; a discarded range reads back as zeros,
+       which is all an empty inode table needs */
+    if (flags & FS_FORMAT_WIPE)
+    {
+        zero_blocks(1, nblocks - 1);
+    }
+    else
+    {
+        disk_discard(1, nblocks - 1);
+    }
+
+    /* Write the superblock, marked clean so the first mount loads the bitmap */
+    memset(&super, 0, sizeof(super));
+    super.magic = FS_MAGIC;
+    super.nblocks = nblocks;
+    super.ninodeblocks = ninodeblocks;
+    super.ninodes = ninodes;
+    super.nbitmapblocks = nbitmapblocks;
+    super.clean = 1;
+    super.features = flags & FS_FORMAT_EXTENTS ? FEATURE_EXTENTS : 0;
+    if (flags & FS_FORMAT_INLINE)
+    {
+        super.features |= FEATURE_INLINE;
+    }
+    if (flags & FS_FORMAT_COMPRESS)
+    {
+        super.features |= FEATURE_COMPRESS;
+    }
+    if (flags & FS_FORMAT_DEDUP)
+    {
+        super.features |= FEATURE_DEDUP;
+    }
+    if (journalblocks > 0)
+    {
+        super.features |= FEATURE_JOURNAL;
+        super.journalblocks = journalblocks;
+        journal_header(1 + ninodeblocks + nbitmapblocks, 1, 1);
+    }
+    super_write();
+
+    /* Write a bitmap with only the metadata blocks in use */
+    struct fs_bitmap initial;
+    bitmap_init(&initial, nblocks, 1);
+    for (int i = 0; i < metablocks; i++)
+    {
+        bitmap_set(&initial, i);
+    }
+    memset(initial.dirty, 1, nbitmapblocks);
+    bitmap_flush(&initial, 1 + ninodeblocks);
+    bitmap_release(&initial);
 
     return 1;
 }
 
+int fs_format_flags(int flags)
+{
+    struct stats_span span;
+    stats_begin(&span);
+    pthread_rwlock_wrlock(&fs_lock);
+    int result = format_disk(flags);
+    pthread_rwlock_unlock(&fs_lock);
+    stats_end(&span, STATS_FS_FORMAT, 0);
+    return result;
+}
+
 void fs_debug()
 {
+    struct stats_span span;
+    stats_begin(&span);
+    pthread_rwlock_wrlock(&fs_lock);
+
+    /* Make sure the disk reflects any inodes changed while mounted */
+    blockmap_flush();
+    inode_flush();
+    journal_checkpoint();
+
     /* Read superblock data from disk */
     union fs_block block;
     disk_read(0, block.data);
@@ -91,8 +687,37 @@ void fs_debug()
     printf("    %d blocks on disk\n", block.super.nblocks);
     printf("    %d blocks for inodes\n", block.super.ninodeblocks);
     printf("    %d inodes total\n", block.super.ninodes);
+    if (block.super.nbitmapblocks > 0)
+    {
+        printf("    %d blocks for the free block bitmap\n", block.super.nbitmapblocks);
+        printf("    %s\n", block.super.clean ? "cleanly unmounted" : "not cleanly unmounted");
+    }
+    if (block.super.features & FEATURE_JOURNAL)
+    {
+        printf("    %d blocks for the journal\n", block.super.journalblocks);
+    }
+    if (block.super.features & FEATURE_EXTENTS)
+    {
+        printf("    files are stored as extents\n");
+    }
+    if (block.super.features & FEATURE_INLINE)
+    {
+        printf("    small files are stored in their inodes\n");
+    }
+    if (block.super.features & FEATURE_COMPRESS)
+    {
+        printf("    file data is stored compressed\n");
+    }
+    if (block.super.features & FEATURE_DEDUP)
+    {
+        printf("    blocks with the same contents are stored once\n");
+    }
+    if (inodes != NULL)
+    {
+        printf("    %d blocks free\n", bitmap.nfree);
+    }
 
-    /* Iterate through each block containing inodes */
+    /* Iterate through each block containing inodes, reading it once */
     int ninodeblocks = block.super.ninodeblocks;
     for (int i = 0; i < ninodeblocks; i++)
     {
@@ -101,7 +726,6 @@ void fs_debug()
         /* Iterate through each inode in block */
         for (int j = 0; j < INODES_PER_BLOCK; j++)
         {
-            disk_read(i + 1, block.data);
             int inode_no = 128 * i + j;
             struct fs_inode inode = block.inode[j];
             // printf("%d\n", inode_no);
@@ -110,6 +734,55 @@ void fs_debug()
                 printf("inode %d:\n", inode_no);
                 printf("    size %d bytes\n", inode.size);
 
+                if (inode.isvalid & INODE_INLINE)
+                {
+                    printf("    stored in the inode\n");
+                    continue;
+                }
+                if (inode.isvalid & INODE_COMPRESSED)
+                {
+                    printf("    stored compressed\n");
+                }
+
+                if (inode.isvalid & INODE_EXTENTS)
+                {
+                    struct fs_blockmap map;
+                    memset(&map, 0, sizeof(map));
+                    blockmap_fill(&map, &inode);
+                    if (map.nblocks > 0)
+                    {
+                        printf("    extents: ");
+                        for (int k = 0; k < map.nblocks;)
+                        {
+                            if (!map.blocks[k])
+                            {
+                                k++;
+                                continue;
+                            }
+                            int run = 1;
+                            while (k + run < map.nblocks && map.blocks[k] && map.blocks[k + run] == map.blocks[k] + run)
+                            {
+                                run++;
+                            }
+                            printf("%d-%d ", map.blocks[k], map.blocks[k] + run - 1);
+                            k += run;
+                        }
+                        printf("\n");
+                    }
+                    if (map.nmeta > 0)
+                    {
+                        printf("    extent tree blocks: ");
+                        for (int k = 0; k < map.nmeta; k++)
+                        {
+                            printf("%d ", map.meta[k]);
+                        }
+                        printf("\n");
+                    }
+                    free(map.blocks);
+                    free(map.meta);
+                    continue;
+                }
+
                 /* Iterate over direct blocks for inode */
                 int any_dblocks = 0;
                 for (int k = 0; k < POINTERS_PER_INODE; k++)
@@ -136,14 +809,15 @@ void fs_debug()
                 /* Iterate over indirect data blocks for inode */
                 if (inode.indirect)
                 {
+                    union fs_block indirect;
                     printf("    indirect block: %d\n", inode.indirect);
-                    disk_read(inode.indirect, block.data);
+                    disk_read(inode.indirect, indirect.data);
                     printf("    indirect data blocks: ");
                     for (int k = 0; k < POINTERS_PER_BLOCK; k++)
                     {
-                        if (block.pointers[k])
+                        if (indirect.pointers[k])
                         {
-                            printf("%d ", block.pointers[k]);
+                            printf("%d ", indirect.pointers[k]);
                         }
                     }
                     printf("\n");
@@ -151,450 +825,4009 @@ void fs_debug()
             }
         }
     }
+
+    pthread_rwlock_unlock(&fs_lock);
+    stats_end(&span, STATS_FS_DEBUG, 0);
 }
 
-int fs_mount()
+/* Split the block bitmap into shards of whole words */
+static void shards_init()
+{
+    shard_size = ((super.nblocks + ALLOC_SHARDS - 1) / ALLOC_SHARDS + 63) / 64 * 64;
+    nshards = (super.nblocks + shard_size - 1) / shard_size;
+    for (int i = 0; i < nshards; i++)
+    {
+        shards[i].start = i * shard_size;
+        shards[i].end = shards[i].start + shard_size < super.nblocks ? shards[i].start + shard_size : super.nblocks;
+        shards[i].hint = shards[i].start;
+    }
+}
+
+static int mount_disk()
 {
+    /* Refuse to mount twice */
+    if (inodes != NULL)
+    {
+        return 0;
+    }
+
     /* Examine the disk for a filesystem */
     union fs_block block;
     disk_read(0, block.data);
 
-    /* If there is a filesystem on disk, create the bitmap */
-    if (block.super.magic == FS_MAGIC)
+    /* No file system is present on disk */
+    if (block.super.magic != FS_MAGIC)
     {
-        bitmap = (int *)calloc(block.super.nblocks, sizeof(int));
-
-        /* Mark the superblock and inode blocks as used */
-        for (int i = 0; i < block.super.ninodeblocks + 1; i++)
-        {
-            bitmap[i] = 1;
-        }
+        return 0;
+    }
 
-        /* Scan through all of the inodes to populate the bitmap */
-        for (int i = 0; i < block.super.ninodeblocks; i++)
-        {
-            disk_read(i + 1, block.data);
-            for (int j = 0; j < INODES_PER_BLOCK; j++)
-            {
-                struct fs_inode inode = block.inode[j];
-                if (inode.isvalid)
-                {
-                    /* Scan through direct blocks */
-                    for (int k = 0; k < POINTERS_PER_INODE; k++)
-                    {
-                        if (inode.direct[k])
-                        {
-                            bitmap[inode.direct[k]] = 1;
-                        }
-                    }
+    /* Keep the superblock and the whole inode table in memory */
+    super = block.super;
+    inodes = (struct fs_inode *)calloc(super.ninodes, sizeof(struct fs_inode));
+    inode_dirty = (char *)calloc(super.ninodeblocks, sizeof(char));
 
-                    /* Scan through indirect blocks */
-                    if (inode.indirect)
-                    {
-                        disk_read(inode.indirect, block.data);
-                        for (int k = 0; k < POINTERS_PER_BLOCK; k++)
-                        {
-                            if (block.pointers[k])
-                            {
-                                bitmap[block.pointers[k]] = 1;
-                            }
-                        }
-                    }
-                }
-            }
-        }
+    /* Inode 0 is never handed out */
+    bitmap_init(&inode_bitmap, super.ninodes, 0);
+    bitmap_set(&inode_bitmap, 0);
 
-        return 1;
+    datastart = 1 + super.ninodeblocks + super.nbitmapblocks + super.journalblocks;
+    bitmap_init(&bitmap, super.nblocks, super.nbitmapblocks > 0);
+    if (super.features & FEATURE_DEDUP)
+    {
+        dedup_init(super.nblocks);
     }
 
-    /* No file system is present on disk */
-    return 0;
-}
+    /* Bring the metadata up to its last committed transaction before anything reads it */
+    journal_open();
 
-int fs_create()
-{
-    // create an inode of zero length
-    union fs_block block;
+    /* Reference counts are only on disk as the inodes, so shared blocks are counted afresh */
+    if (super.nbitmapblocks > 0 && super.clean && !(super.features & FEATURE_DEDUP))
+    {
+        /* Cleanly unmounted: the bitmap on disk is up to date */
+        disk_read_range(1 + super.ninodeblocks, super.nbitmapblocks, (char *)bitmap.words);
+        bitmap_recount(&bitmap);
+        table_scan(0);
+    }
+    else
+    {
+        table_scan(1);
+    }
+    shards_init();
+    tree_reserve = 0;
+    delay_reserve = 0;
+    delay_lost = 0;
 
-    // iterate over the inodes in the disk
-    disk_read(0, block.data);
-    for (int i = 0; i < block.super.ninodeblocks; i++)
+    /* Until fs_unmount, a crash leaves the on-disk bitmap suspect */
+    if (super.nbitmapblocks > 0)
     {
-        // get the inode block
-        disk_read(i + 1, block.data);
-        // iterate over the inodes in the inode block and find first invalid inode
-        for (int j = 1; j < INODES_PER_BLOCK + 1; j++)
+        super.clean = 0;
+        super_write();
+        disk_sync();
+    }
+
+    return 1;
+}
+
+int fs_mount()
+{
+    struct stats_span span;
+    stats_begin(&span);
+    pthread_rwlock_wrlock(&fs_lock);
+    int result = mount_disk();
+    pthread_rwlock_unlock(&fs_lock);
+    stats_end(&span, STATS_FS_MOUNT, 0);
+    return result;
+}
+
+/*
+Mount loads the inode table, indexes the free inodes and, for images
+without an on-disk bitmap or after an unclean shutdown, rebuilds the
+free block bitmap from the inodes. The table is split into slices of
+whole inode blocks, one per worker thread. A worker reads its slice
+straight into place with a few large asynchronous requests, and reads
+the indirect blocks its inodes point to a batch at a time, so the
+workers keep the disk busy while they mark blocks in a bitmap of
+their own. The bitmaps are merged once every worker is done.
+*/
+#define SCAN_THREADS 16
+#define SCAN_MIN_BLOCKS 64  /* inode blocks below which another worker is not worth starting */
+#define SCAN_BATCH 32       /* blocks read per request and indirect blocks read per batch */
+
+struct fs_scan
+{
+    int first;  /* inode blocks [first, last) of the table */
+    int last;
+    int rebuild;
+    struct fs_bitmap used;  /* blocks used by the inodes of the slice */
+    int *refs;              /* per block: references from deduplicated files, shared by the workers */
+};
+
+/* Mark the blocks named by the indirect blocks read for a batch */
+static void scan_pointers(struct fs_scan *scan, union fs_block *batch, int n)
+{
+    disk_drain();
+    for (int k = 0; k < n; k++)
+    {
+        for (int j = 0; j < POINTERS_PER_BLOCK; j++)
         {
-            struct fs_inode inode = block.inode[j];
-            if (!inode.isvalid)
-            {
-                // create the new inode struct
-                struct fs_inode new_inode;
-                // set all values to 0
-                new_inode.isvalid = 1;
-                new_inode.size = 0;
-                new_inode.indirect = 0;
-                for (int k = 0; k < POINTERS_PER_INODE; k++) {
-                    new_inode.direct[k] = 0;
-                }
-                // calculate the inode number
-                int inode_no = 128 * i + j;
-                // set the new inode in the blocks inodes
-                block.inode[j] = new_inode;
-                // write back to disk
-                disk_write(i + 1, block.data);
-                return inode_no;
+            if (batch[k].pointers[j])
+            {
+                bitmap_set(&scan->used, batch[k].pointers[j]);
             }
         }
     }
-    // return positive inode number on success and 0 on failure
-    return 0;
 }
 
-int fs_delete(int inumber)
+static void scan_blocks(struct fs_scan *scan)
 {
-    // create an inode of zero length
-    union fs_block block;
-    // read in the superblock
-    disk_read(0, block.data);
-    int block_no = ((inumber / 128) * 128) + 1;
-    // check to see if the inode number is in range
-    if (block_no > block.super.ninodeblocks || block_no < 1)
-    {
-        return 0;
-    }
-    // read in the data block
-    disk_read(block_no, block.data);
+    union fs_block *batch = (union fs_block *)malloc(SCAN_BATCH * sizeof(union fs_block));
+    struct fs_blockmap map;
+    memset(&map, 0, sizeof(map));
+    int n = 0;
 
-    // get the relative inumber in the block
-    int rel_inum = inumber % 128;
-    struct fs_inode del_inode = block.inode[rel_inum];
-    // check if it is a valid inode
-    if (!del_inode.isvalid)
-    {
-        return 0;
-    }
-    for (int k = 0; k < POINTERS_PER_INODE; k++)
+    for (int i = scan->first * INODES_PER_BLOCK; i < scan->last * INODES_PER_BLOCK; i++)
     {
-        if (del_inode.direct[k])
+        struct fs_inode *inode = &inodes[i];
+        if (!inode->isvalid || (inode->isvalid & INODE_INLINE))
         {
-            // get the data block
-            disk_read(del_inode.direct[k], block.data);
-            // create blank data for the block
-            char blank_data[DISK_BLOCK_SIZE];
-            // have the data block point to the blank data
-            *block.data = *blank_data;
-            // set the bitmap at that location to 0
-            bitmap[del_inode.direct[k]] = 0;
+            continue;
         }
-        else if (del_inode.indirect)
+
+        // extent trees are rare and deep, so they are read in place, as are the maps of shared blocks
+        if (inode->isvalid & (INODE_EXTENTS | INODE_DEDUP))
         {
-            // get the indirect block
-            disk_read(del_inode.indirect, block.data);
-            for (int j = 0; j < POINTERS_PER_BLOCK; j++)
+            blockmap_fill(&map, inode);
+            for (int k = 0; k < map.nblocks; k++)
             {
-                if (block.pointers[j])
+                bitmap_set(&scan->used, map.blocks[k]);
+                if (scan->refs != NULL && (inode->isvalid & INODE_DEDUP) && map.blocks[k] > 0 && map.blocks[k] < super.nblocks)
                 {
-                    // get the block from the pointer
-                    union fs_block data_block;
-                    disk_read(block.pointers[j], data_block.data);
-                    // create blank data for it to point to
-                    char blank_data[DISK_BLOCK_SIZE];
-                    *data_block.data = *blank_data;
-                    // set the bitmap at this location to 0
-                    bitmap[block.pointers[j]] = 0;
+                    __atomic_add_fetch(&scan->refs[map.blocks[k]], 1, __ATOMIC_RELAXED);
                 }
             }
+            for (int k = 0; k < map.nmeta; k++)
+            {
+                bitmap_set(&scan->used, map.meta[k]);
+            }
+            continue;
+        }
+
+        for (int k = 0; k < POINTERS_PER_INODE; k++)
+        {
+            bitmap_set(&scan->used, inode->direct[k]);
+        }
+        if (inode->indirect <= 0 || inode->indirect >= super.nblocks)
+        {
+            continue;
+        }
+        bitmap_set(&scan->used, inode->indirect);
+
+        struct iovec iov;
+        iov.iov_base = batch[n].data;
+        iov.iov_len = DISK_BLOCK_SIZE;
+        disk_submit_read(inode->indirect, &iov, 1);
+        if (++n == SCAN_BATCH)
+        {
+            scan_pointers(scan, batch, n);
+            n = 0;
         }
     }
-    // set the inode to invalid
-    disk_read(block_no, block.data);
-    // set the valid bit to 0
-    del_inode.isvalid = 0;
-    block.inode[rel_inum] = del_inode;
-    disk_write(block_no, block.data);
+    scan_pointers(scan, batch, n);
 
-    return 1;
+    free(batch);
+    free(map.blocks);
+    free(map.meta);
 }
 
-int fs_getsize(int inumber)
+static void *scan_worker(void *arg)
 {
-    // create an inode of zero length
-    union fs_block block;
-    // read in the superblock
-    disk_read(0, block.data);
-    int block_no = ((inumber / 128) * 128) + 1;
-    // check if the block number is valid
-    if (block_no > block.super.ninodeblocks || block_no < 1)
+    struct fs_scan *scan = (struct fs_scan *)arg;
+
+    // The inode blocks are laid out on disk just as the table is in memory
+    for (int i = scan->first; i < scan->last; i += SCAN_BATCH)
     {
-        return -1;
+        struct iovec iov;
+        iov.iov_base = &inodes[i * INODES_PER_BLOCK];
+        iov.iov_len = (size_t)(scan->last - i < SCAN_BATCH ? scan->last - i : SCAN_BATCH) * DISK_BLOCK_SIZE;
+        disk_submit_read(1 + i, &iov, 1);
+    }
+    disk_drain();
+
+    // Slices are whole inode blocks, so workers never share a word of the inode index
+    for (int i = scan->first * INODES_PER_BLOCK; i < scan->last * INODES_PER_BLOCK; i++)
+    {
+        if (inodes[i].isvalid)
+        {
+            bitmap_set(&inode_bitmap, i);
+        }
     }
-    // get the offset relative to the block
-    disk_read(block_no, block.data);
-    int rel_inum = inumber % 128;
-    struct fs_inode my_inode = block.inode[rel_inum];
-    // check if it is a valid inode
-    if (!my_inode.isvalid)
+
+    if (scan->rebuild)
     {
-        return -1;
+        scan_blocks(scan);
     }
-    return my_inode.size;
+    return NULL;
 }
 
-int fs_read(int inumber, char *data, int length, int offset)
+/* Number of threads worth splitting the inode table across */
+static int scan_threads()
 {
-    // create an inode of zero length
-    union fs_block block;
-    // read in the superblock
-    disk_read(0, block.data);
-    int block_no = ((inumber / 128) * 128) + 1;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nworkers = super.ninodeblocks / SCAN_MIN_BLOCKS;
+    if (nworkers > ncpus)
+    {
+        nworkers = ncpus;
+    }
+    if (nworkers > SCAN_THREADS)
+    {
+        nworkers = SCAN_THREADS;
+    }
+    return nworkers < 1 ? 1 : nworkers;
+}
+
+/*
+Run worker on each of the nworkers argument structures in args, each
+size bytes long, in threads of their own. The calling thread takes
+the first, and any that a thread could not be started for.
+*/
+static void scan_run(void *(*worker)(void *), void *args, size_t size, int nworkers)
+{
+    pthread_t threads[SCAN_THREADS];
+    int started[SCAN_THREADS] = {0};
+    for (int w = 1; w < nworkers; w++)
+    {
+        started[w] = pthread_create(&threads[w], NULL, worker, (char *)args + w * size) == 0;
+    }
+    for (int w = 0; w < nworkers; w++)
+    {
+        if (!started[w])
+        {
+            worker((char *)args + w * size);
+        }
+    }
+    for (int w = 1; w < nworkers; w++)
+    {
+        if (started[w])
+        {
+            pthread_join(threads[w], NULL);
+        }
+    }
+}
 
-    // check to see if the inode number is in range
-    if (block_no > block.super.ninodeblocks || block_no < 1)
+static void table_scan(int rebuild)
+{
+    int nworkers = scan_threads();
+    struct fs_scan scans[SCAN_THREADS];
+    memset(scans, 0, sizeof(scans));
+    int *refs = rebuild && dedup.shares != NULL ? (int *)calloc(super.nblocks, sizeof(int)) : NULL;
+    for (int w = 0; w < nworkers; w++)
     {
-        return 0; // need to change this on Mike's
+        scans[w].first = (int)((long long)super.ninodeblocks * w / nworkers);
+        scans[w].last = (int)((long long)super.ninodeblocks * (w + 1) / nworkers);
+        scans[w].rebuild = rebuild;
+        scans[w].refs = refs;
+        if (rebuild)
+        {
+            bitmap_init(&scans[w].used, super.nblocks, 0);
+        }
     }
-    // read in the data block
-    disk_read(block_no, block.data);
 
-    // get the relative inumber in the block
-    int rel_inum = inumber % 128;
-    struct fs_inode read_inode = block.inode[rel_inum];
+    scan_run(scan_worker, scans, sizeof(scans[0]), nworkers);
 
-    // check if it is a valid inode
-    if (!read_inode.isvalid)
+    if (!rebuild)
     {
-        return 0;
+        return;
     }
 
-    // // set length copied
-    int length_copied = 0;
+    // Merge the workers' bitmaps with the superblock, inode blocks and bitmap blocks
+    for (int i = 0; i < datastart; i++)
+    {
+        bitmap_set(&bitmap, i);
+    }
+    for (int w = 0; w < nworkers; w++)
+    {
+        for (int i = 0; i < BITMAP_WORDS(bitmap.nbits); i++)
+        {
+            bitmap.words[i] |= scans[w].used.words[i];
+        }
+        bitmap_release(&scans[w].used);
+    }
+    bitmap_recount(&bitmap);
+    if (refs != NULL)
+    {
+        for (int i = 0; i < super.nblocks; i++)
+        {
+            dedup.shares[i] = refs[i] > DEDUP_MAX_SHARES ? DEDUP_MAX_SHARES : refs[i] > 1 ? refs[i] - 1 : 0;
+        }
+        free(refs);
+    }
 
-    // keep track of direct pointer
-    int pointer_number = offset / DISK_BLOCK_SIZE;
-    int inner_offset = offset - (pointer_number * DISK_BLOCK_SIZE);
+    /* Whatever was on disk is replaced by the rebuilt bitmap */
+    if (bitmap.dirty != NULL)
+    {
+        memset(bitmap.dirty, 1, BITMAP_BLOCKS(bitmap.nbits));
+    }
+}
 
-    // Number of bytes that needs to be read
-    int size_to_read = read_inode.size - offset;
+/*
+A compact form of fs_debug: totals for the whole filesystem in place
+of a list of every block. The inode table is read a batch of blocks
+at a time, and each indirect block or extent tree node once.
+*/
+void fs_summary()
+{
+    struct stats_span span;
+    stats_begin(&span);
+    pthread_rwlock_wrlock(&fs_lock);
+
+    /* Make sure the disk reflects any inodes changed while mounted */
+    blockmap_flush();
+    inode_flush();
+    journal_checkpoint();
 
-    while (length_copied < length && size_to_read > 0)
+    union fs_block block;
+    disk_read(0, block.data);
+    struct fs_superblock sb = block.super;
+    if (sb.magic != FS_MAGIC || sb.ninodeblocks <= 0 || 1 + sb.ninodeblocks > disk_size())
+    {
+        printf("superblock: magic number or layout is invalid\n");
+        pthread_rwlock_unlock(&fs_lock);
+        stats_end(&span, STATS_FS_DEBUG, 0);
+        return;
+    }
+    printf("superblock: %d blocks, %d inode blocks with %d inodes, %d bitmap blocks, %s%s",
+           sb.nblocks, sb.ninodeblocks, sb.ninodes, sb.nbitmapblocks,
+           sb.nbitmapblocks == 0 ? "no on-disk bitmap" : sb.clean ? "cleanly unmounted" : "not cleanly unmounted",
+           sb.features & FEATURE_EXTENTS ? ", extent files" : "");
+    if (sb.features & FEATURE_INLINE)
+    {
+        printf(", inline files");
+    }
+    if (sb.features & FEATURE_COMPRESS)
     {
+        printf(", compressed files");
+    }
+    if (sb.features & FEATURE_DEDUP)
+    {
+        printf(", shared blocks");
+    }
+    if (sb.features & FEATURE_JOURNAL)
+    {
+        printf(", %d journal blocks", sb.journalblocks);
+    }
+    printf("\n");
 
-        // initialize data block
-        union fs_block data_block;
+    union fs_block *table = (union fs_block *)malloc(SCAN_BATCH * sizeof(union fs_block));
+    struct fs_blockmap map;
+    memset(&map, 0, sizeof(map));
+    int nfiles = 0, nextentfiles = 0, ninlinefiles = 0, largest = -1, largest_size = 0;
+    int datablocks = 0, metablocks = 0, runs = 0;
+    long long bytes = 0;
+    int ncompressed = 0, compressed_blocks = 0;
+    long long compressed_bytes = 0;
+    int references = 0;
 
-        if (pointer_number < POINTERS_PER_INODE && read_inode.direct[pointer_number])
-        {
-            disk_read(read_inode.direct[pointer_number], data_block.data);
+    // Blocks shared between files are counted once
+    struct fs_bitmap seen;
+    bitmap_init(&seen, sb.features & FEATURE_DEDUP ? sb.nblocks : 0, 0);
 
-            // Loop through data block and insert into data
-            for (int i = inner_offset; i < DISK_BLOCK_SIZE && size_to_read > 0; i++)
+    for (int i = 0; i < sb.ninodeblocks; i += SCAN_BATCH)
+    {
+        int count = sb.ninodeblocks - i < SCAN_BATCH ? sb.ninodeblocks - i : SCAN_BATCH;
+        disk_read_range(1 + i, count, table[0].data);
+        for (int j = 0; j < count * INODES_PER_BLOCK; j++)
+        {
+            struct fs_inode *inode = &table[j / INODES_PER_BLOCK].inode[j % INODES_PER_BLOCK];
+            if (!inode->isvalid)
             {
-                data[length_copied] = data_block.data[i];
-                length_copied++;
-                size_to_read--;
+                continue;
+            }
+            nfiles++;
+            if (inode->isvalid & INODE_EXTENTS)
+            {
+                nextentfiles++;
+            }
+            if (inode->isvalid & INODE_INLINE)
+            {
+                ninlinefiles++;
+            }
+            bytes += inode->size;
+            if (largest < 0 || inode->size > largest_size)
+            {
+                largest = i * INODES_PER_BLOCK + j;
+                largest_size = inode->size;
             }
-            pointer_number++;
-            inner_offset = 0;
-        }
-        else if (read_inode.indirect)
-        {
-            // read indirect pointers into indirects_block
-            union fs_block indirects_block;
-            disk_read(read_inode.indirect, indirects_block.data);
 
-            // If inode in range and is valid
-            if (pointer_number < POINTERS_PER_BLOCK + POINTERS_PER_INODE && indirects_block.pointers[pointer_number - POINTERS_PER_INODE])
+            // Count the blocks and the runs of adjacent blocks they form
+            blockmap_fill(&map, inode);
+            for (int k = 0; k < map.nblocks; k++)
             {
-                disk_read(indirects_block.pointers[pointer_number - POINTERS_PER_INODE], data_block.data);
-                // Loop through characters in data block and add to data
-                for (int i = inner_offset; i < DISK_BLOCK_SIZE && size_to_read > 0; i++)
+                if (!map.blocks[k])
+                {
+                    continue;
+                }
+                references++;
+                if (seen.nbits == 0 || !bitmap_test(&seen, map.blocks[k]))
+                {
+                    datablocks++;
+                    bitmap_set(&seen, map.blocks[k]);
+                }
+                if (k == 0 || map.blocks[k] != map.blocks[k - 1] + 1)
                 {
-                    data[length_copied] = data_block.data[i];
-                    length_copied++;
-                    size_to_read--;
+                    runs++;
                 }
-                pointer_number++;
-                inner_offset = 0;
             }
-            else
+            metablocks += map.nmeta;
+            if ((inode->isvalid & INODE_COMPRESSED) && !(inode->isvalid & INODE_INLINE))
             {
-                break;
+                ncompressed++;
+                compressed_bytes += inode->size;
+                for (int k = 0; k < map.nblocks; k++)
+                {
+                    compressed_blocks += map.blocks[k] != 0;
+                }
             }
         }
-        else
+    }
+    free(table);
+    free(map.blocks);
+    free(map.meta);
+    bitmap_release(&seen);
+
+    int reserved = 1 + sb.ninodeblocks + sb.nbitmapblocks + sb.journalblocks;
+    printf("files: %d, %d of them extent files, %lld bytes", nfiles, nextentfiles, bytes);
+    if (ninlinefiles > 0)
+    {
+        printf(", %d files stored in their inodes", ninlinefiles);
+    }
+    if (largest >= 0)
+    {
+        printf(", largest is inode %d with %d bytes", largest, largest_size);
+    }
+    printf("\n");
+    printf("blocks: %d metadata, %d data, %d indirect or extent tree, %d free",
+           reserved, datablocks, metablocks, sb.nblocks - reserved - datablocks - metablocks);
+    if (inodes != NULL && bitmap.nfree != sb.nblocks - reserved - datablocks - metablocks)
+    {
+        printf(" (the bitmap says %d)", bitmap.nfree);
+    }
+    printf("\n");
+    if (nfiles > 0)
+    {
+        printf("layout: %d runs of adjacent data blocks, %.2f per file\n", runs, (double)runs / nfiles);
+    }
+    if (ncompressed > 0)
+    {
+        printf("compression: %d files, %lld bytes in %d blocks, %.2f to 1\n", ncompressed, compressed_bytes, compressed_blocks,
+               compressed_blocks > 0 ? (double)compressed_bytes / ((double)compressed_blocks * DISK_BLOCK_SIZE) : 0.0);
+    }
+    if (sb.features & FEATURE_DEDUP)
+    {
+        printf("sharing: %d references to %d data blocks, %d blocks saved\n", references, datablocks, references - datablocks);
+    }
+
+    pthread_rwlock_unlock(&fs_lock);
+    stats_end(&span, STATS_FS_DEBUG, 0);
+}
+
+/* Write every inode block holding a changed inode back to disk */
+static int inode_flush()
+{
+    if (inodes == NULL)
+    {
+        return 0;
+    }
+
+    union fs_block block;
+    for (int i = 0; i < super.ninodeblocks; i++)
+    {
+        if (inode_dirty[i])
         {
-            break;
+            memcpy(block.inode, &inodes[i * INODES_PER_BLOCK], sizeof(block.inode));
+            inode_dirty[i] = 0;
+            __atomic_sub_fetch(&journal.pending, 1, __ATOMIC_RELAXED);
+            meta_write(i + 1, block.data);
         }
     }
-    return length_copied;
+    return 1;
 }
 
-int fs_write(int inumber, const char *data, int length, int offset)
+/* Write the journal header: replay starts with transaction sequence at block head of the journal */
+static void journal_header(int start, int sequence, int head)
 {
-    // create an inode of zero length
     union fs_block block;
-    // read in the superblock
-    disk_read(0, block.data);
-    int block_no = ((inumber / 128) * 128) + 1;
-    // check if the block number is valid
-    if (block_no > block.super.ninodeblocks || block_no < 1)
+    memset(block.data, 0, sizeof(block.data));
+    block.journal.magic = JOURNAL_MAGIC;
+    block.journal.kind = JOURNAL_HEADER;
+    block.journal.sequence = sequence;
+    block.journal.count = head;
+    disk_write_range(start, 1, block.data);
+}
+
+static unsigned journal_checksum(unsigned sum, const char *data)
+{
+    const uint32_t *words = (const uint32_t *)data;
+    for (int i = 0; i < DISK_BLOCK_SIZE / 4; i++)
     {
-        return 0;
+        sum = (sum ^ words[i]) * 16777619u;
+    }
+    return sum;
+}
+
+/* Blocks one transaction can log: a descriptor's worth, and the journal less its header, descriptor and commit block */
+static int journal_limit()
+{
+    return journal.nblocks - 3 < JOURNAL_TAGS ? journal.nblocks - 3 : JOURNAL_TAGS;
+}
+
+/* Whether the metadata waiting for the next commit has filled half a transaction, leaving the rest for operations in flight */
+static int journal_full()
+{
+    return journal.start && __atomic_load_n(&journal.pending, __ATOMIC_RELAXED) >= journal_limit() / 2;
+}
+
+/*
+Read the transaction with the given sequence number at block head of
+the journal, checking it against its commit block. Returns the blocks
+it logs, or -1 if it is not there or was never completely written.
+The descriptor is left in desc and the logged blocks in *images.
+*/
+static int journal_read(int head, int sequence, union fs_block *desc, char **images)
+{
+    *images = NULL;
+    if (head < 1 || head + 2 > journal.nblocks)
+    {
+        return -1;
     }
-    // get the offset relative to the block
-    disk_read(block_no, block.data);
-    int rel_inum = inumber % 128;
-    struct fs_inode inode = block.inode[rel_inum];
-    // check if it is a valid inode
-    if (!inode.isvalid)
+    disk_read(journal.start + head, desc->data);
+    struct fs_journal_block *d = &desc->journal;
+    if (d->magic != JOURNAL_MAGIC || d->kind != JOURNAL_DESCRIPTOR || d->sequence != sequence ||
+        d->count < 1 || d->count > journal_limit() || head + d->count + 2 > journal.nblocks)
     {
         return -1;
     }
-    // Set the current size to the offset
-    inode.size = offset;
 
-    union fs_block superblock;
-    // read in the superblock
-    disk_read(0, superblock.data);
-    int ninodeblocks = superblock.super.ninodeblocks;
-    int nblocks = superblock.super.nblocks;
+    *images = (char *)malloc((size_t)(d->count + 1) * DISK_BLOCK_SIZE);
+    disk_read_range(journal.start + head + 1, d->count + 1, *images);
+    unsigned sum = journal_checksum(2166136261u, desc->data);
+    for (int i = 0; i < d->count; i++)
+    {
+        sum = journal_checksum(sum, *images + (size_t)i * DISK_BLOCK_SIZE);
+    }
+    struct fs_journal_block *c = (struct fs_journal_block *)(*images + (size_t)d->count * DISK_BLOCK_SIZE);
+    if (c->magic != JOURNAL_MAGIC || c->kind != JOURNAL_COMMIT || c->sequence != sequence ||
+        c->count != d->count || c->checksum != sum)
+    {
+        free(*images);
+        *images = NULL;
+        return -1;
+    }
+    return d->count;
+}
 
-    // Clear all data blocks when writing to the start of an inode
-    if (offset == 0)
+/*
+Set up the journal of a filesystem being mounted, replaying the
+transactions committed since its header was last written: their
+blocks are copied home, and the journal starts out empty.
+*/
+static void journal_open()
+{
+    memset(&journal, 0, sizeof(journal));
+    if (!(super.features & FEATURE_JOURNAL) || super.journalblocks < JOURNAL_MIN_BLOCKS || datastart > super.nblocks)
+    {
+        return;
+    }
+    journal.start = datastart - super.journalblocks;
+    journal.nblocks = super.journalblocks;
+    journal.slot = (int *)calloc(super.nblocks, sizeof(int));
+    journal.live = (char *)calloc(super.nblocks, sizeof(char));
+
+    union fs_block block;
+    disk_read(journal.start, block.data);
+    int sequence = 1;
+    if (block.journal.magic == JOURNAL_MAGIC && block.journal.kind == JOURNAL_HEADER)
     {
-        for (int i = 0; i < POINTERS_PER_INODE; i++)
+        sequence = block.journal.sequence;
+        int head = block.journal.count;
+        int wrapped = 0;
+        for (;;)
         {
-            if (inode.direct[i])
+            char *images;
+            int count = journal_read(head, sequence, &block, &images);
+            if (count < 0 && !wrapped && head != 1)
             {
-                bitmap[inode.direct[i]] = 0;
-                inode.direct[i] = 0;
+                // A transaction that did not fit at the end went to the start
+                wrapped = 1;
+                head = 1;
+                continue;
             }
-        }
-        if (inode.indirect)
-        {
-            union fs_block initial_indirect;
-            disk_read(inode.indirect, initial_indirect.data);
-            for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+            if (count < 0)
+            {
+                break;
+            }
+            for (int i = 0; i < count; i++)
             {
-                if (initial_indirect.pointers[i] < nblocks)
+                int home = block.journal.home[i];
+                if (home > 0 && home < super.nblocks && (home < journal.start || home >= datastart))
                 {
-                    bitmap[initial_indirect.pointers[i]] = 0;
+                    disk_write(home, images + (size_t)i * DISK_BLOCK_SIZE);
                 }
-                initial_indirect.pointers[i] = 0;
             }
-            bitmap[inode.indirect] = 0;
-            inode.indirect = 0;
+            free(images);
+            head += count + 2;
+            sequence++;
+            wrapped = 0;
         }
     }
 
-    // Counter for amount of data written
-    int written = 0;
-
-    // Keep track of direct pointer
-    int direct = offset / DISK_BLOCK_SIZE;
-    int inner_offset = offset - (direct * DISK_BLOCK_SIZE);
+    journal.head = 1;
+    journal.sequence = sequence;
+    disk_sync();
+    journal_header(journal.start, journal.sequence, journal.head);
+    disk_sync();
+}
 
-    // While there is still data to write
-    while (written < length)
+/* Drop the running transaction, which must have been committed, and everything else the journal holds */
+static void journal_close()
+{
+    for (int i = 0; i < journal.count; i++)
     {
-        // Starting data block to look at
-        int num = ninodeblocks + 1;
+        free(journal.images[i]);
+    }
+    free(journal.images);
+    free(journal.homes);
+    free(journal.slot);
+    free(journal.logged);
+    free(journal.live);
+    free(journal.deferred);
+    memset(&journal, 0, sizeof(journal));
+}
 
-        // Initialize a data block
-        union fs_block data_block;
+/* Write a metadata block, into the running transaction if there is a journal */
+static void meta_write(int blocknum, const char *data)
+{
+    if (!journal.start)
+    {
+        disk_write(blocknum, data);
+        return;
+    }
 
-        // If there is data block at the offset specified
-        if (direct < POINTERS_PER_INODE && inode.direct[direct])
+    pthread_mutex_lock(&journal_lock);
+    int i = journal.slot[blocknum] - 1;
+    if (i < 0)
+    {
+        if (journal.count == journal.capacity)
         {
-            disk_read(inode.direct[direct], data_block.data);
-            // Continue writing data until reaching the end of the block or writing the requested amount of data
-            for (int i = inner_offset; i < DISK_BLOCK_SIZE && written < length; i++)
-            {
-                data_block.data[i] = data[written];
-                written++;
-            }
-            direct++;
-            inner_offset = 0;
+            journal.capacity = journal.capacity ? journal.capacity * 2 : 64;
+            journal.images = (char **)realloc(journal.images, journal.capacity * sizeof(char *));
+            journal.homes = (int *)realloc(journal.homes, journal.capacity * sizeof(int));
+        }
+        i = journal.count++;
+        journal.images[i] = (char *)malloc(DISK_BLOCK_SIZE);
+        journal.homes[i] = blocknum;
+        journal.slot[blocknum] = i + 1;
+        __atomic_add_fetch(&journal.pending, 1, __ATOMIC_RELAXED);
+    }
+    memcpy(journal.images[i], data, DISK_BLOCK_SIZE);
+    pthread_mutex_unlock(&journal_lock);
+}
 
-            // Write block to disk
-            disk_write(inode.direct[direct], data_block.data);
+/* Read a metadata block as last written, which may be in the running transaction */
+static void meta_read(int blocknum, char *data)
+{
+    if (journal.start && blocknum > 0 && blocknum < super.nblocks)
+    {
+        pthread_mutex_lock(&journal_lock);
+        int i = journal.slot[blocknum] - 1;
+        if (i >= 0)
+        {
+            memcpy(data, journal.images[i], DISK_BLOCK_SIZE);
         }
-        else
+        pthread_mutex_unlock(&journal_lock);
+        if (i >= 0)
         {
-            // Searching for an open data block
-            while (bitmap[num] != 0 && num < nblocks)
-            {
-                num++;
-            }
-            // If there are no more data blocks return the amount written
-            if (num >= nblocks)
-            {
-                break;
-            }
-            if (direct < POINTERS_PER_INODE)
-            {
-                inode.direct[direct] = num;
-            }
-            else
-            {
-                int indirect = direct - POINTERS_PER_INODE;
-                if (indirect > POINTERS_PER_BLOCK)
-                {
-                    // No more room for indirect pointers
-                    break;
-                }
-                union fs_block indirect_block;
-                // Get indirect pointer if the inode already has one
-                if (inode.indirect != 0)
-                {
-                    disk_read(inode.indirect, indirect_block.data);
-                }
-                // Allocate space for a new indirect pointer otherwise
-                else
-                {
-                    // Create data block for indirect pointers
-                    char blank_data[DISK_BLOCK_SIZE];
-                    for (int i = 0; i < DISK_BLOCK_SIZE; i++) {
-                        blank_data[i] = 0;
-                    }
-                    *indirect_block.data = *blank_data;
-                    inode.indirect = num;
-                    bitmap[num] = 1;
-
-                    // Searching for an open data block because the other block was used for the indirect block
-                    while (bitmap[num] != 0 && num < nblocks)
-                    {
-                        num++;
-                    }
-                    // If there are no more data blocks return the amount written
-                    if (num >= nblocks)
-                    {
-                        break;
-                    }
-                }
-                // Set the indirect pointer to the next open block
-                indirect_block.pointers[indirect] = num;
-                disk_write(inode.indirect, indirect_block.data);
-                char blank_data[DISK_BLOCK_SIZE];
-                *data_block.data = *blank_data;
-            }
-
-            // Write data to the block
-            for (int i = inner_offset; i < DISK_BLOCK_SIZE && written < length; i++)
-            {
-                data_block.data[i] = data[written];
-                written++;
-            }
-            inner_offset = 0;
-            direct++;
-            bitmap[num] = 1;
-            disk_write(num, data_block.data);
+            return;
         }
     }
-    // Add to the size of the inode and write back to the inode block
-    inode.size += written;
-    block.inode[rel_inum] = inode;
-    disk_write(block_no, block.data);
-    return written;
-}
\ No newline at end of file
+    disk_read(blocknum, data);
+}
+
+/*
+A block is being freed: drop any new contents the running transaction
+has for it. Returns 1 if it was logged by the last committed transaction,
+in which case it is kept until that transaction is retired.
+*/
+static int journal_forget(int blocknum)
+{
+    if (!journal.start)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    int i = journal.slot[blocknum] - 1;
+    if (i >= 0)
+    {
+        free(journal.images[i]);
+        journal.count--;
+        journal.images[i] = journal.images[journal.count];
+        journal.homes[i] = journal.homes[journal.count];
+        journal.slot[journal.homes[i]] = i + 1;
+        journal.slot[blocknum] = 0;
+        __atomic_sub_fetch(&journal.pending, 1, __ATOMIC_RELAXED);
+    }
+    int held = journal.live[blocknum];
+    if (held)
+    {
+        journal.deferred = (int *)realloc(journal.deferred, (journal.ndeferred + 1) * sizeof(int));
+        journal.deferred[journal.ndeferred++] = blocknum;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return held;
+}
+
+/*
+Commit the first count blocks of the running transaction, with every
+operation shut out. The disk is synced first, which puts the data
+written since the last commit on disk ahead of the metadata that
+points to it, and brings the blocks of the last transaction home so
+it can be retired. The header is moved up to the new transaction,
+which is written to the journal as one request and synced, and its
+blocks are then written to the disk cache, to reach their homes
+whenever the cache writes them back.
+*/
+static void journal_write(int count)
+{
+    disk_sync();
+
+    if (count > 0 && journal.head + count + 2 > journal.nblocks)
+    {
+        journal.head = 1;
+    }
+    journal_header(journal.start, journal.sequence, journal.head);
+
+    if (count > 0)
+    {
+        union fs_block desc, commit;
+        memset(desc.data, 0, sizeof(desc.data));
+        desc.journal.magic = JOURNAL_MAGIC;
+        desc.journal.kind = JOURNAL_DESCRIPTOR;
+        desc.journal.sequence = journal.sequence;
+        desc.journal.count = count;
+        memcpy(desc.journal.home, journal.homes, count * sizeof(int));
+
+        struct iovec *iov = (struct iovec *)malloc((count + 2) * sizeof(struct iovec));
+        iov[0].iov_base = desc.data;
+        iov[0].iov_len = DISK_BLOCK_SIZE;
+        unsigned sum = journal_checksum(2166136261u, desc.data);
+        for (int i = 0; i < count; i++)
+        {
+            iov[i + 1].iov_base = journal.images[i];
+            iov[i + 1].iov_len = DISK_BLOCK_SIZE;
+            sum = journal_checksum(sum, journal.images[i]);
+        }
+
+        memset(commit.data, 0, sizeof(commit.data));
+        commit.journal.magic = JOURNAL_MAGIC;
+        commit.journal.kind = JOURNAL_COMMIT;
+        commit.journal.sequence = journal.sequence;
+        commit.journal.count = count;
+        commit.journal.checksum = sum;
+        iov[count + 1].iov_base = commit.data;
+        iov[count + 1].iov_len = DISK_BLOCK_SIZE;
+
+        disk_writev(journal.start + journal.head, iov, count + 2);
+        free(iov);
+        journal.head += count + 2;
+        journal.sequence++;
+    }
+    disk_sync();
+
+    // The last transaction is retired, so the blocks freed under it can go
+    for (int i = 0; i < journal.nlogged; i++)
+    {
+        journal.live[journal.logged[i]] = 0;
+    }
+    for (int i = 0; i < journal.ndeferred; i++)
+    {
+        block_free(journal.deferred[i]);
+    }
+    journal.nlogged = 0;
+    journal.ndeferred = 0;
+
+    if (count > 0)
+    {
+        journal.logged = (int *)realloc(journal.logged, count * sizeof(int));
+        memcpy(journal.logged, journal.homes, count * sizeof(int));
+        journal.nlogged = count;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        disk_write(journal.homes[i], journal.images[i]);
+        free(journal.images[i]);
+        journal.slot[journal.homes[i]] = 0;
+        journal.live[journal.homes[i]] = 1;
+    }
+
+    // Whatever did not fit moves up to start the next transaction
+    journal.count -= count;
+    if (journal.count > 0)
+    {
+        memmove(journal.images, journal.images + count, journal.count * sizeof(char *));
+        memmove(journal.homes, journal.homes + count, journal.count * sizeof(int));
+        for (int i = 0; i < journal.count; i++)
+        {
+            journal.slot[journal.homes[i]] = i + 1;
+        }
+    }
+    __atomic_sub_fetch(&journal.pending, count, __ATOMIC_RELAXED);
+}
+
+/*
+Commit the running transaction. Group commit keeps it to what one
+journal transaction can log, but should it still outgrow that, it is
+committed as several, the inode blocks last so that they never point
+at tree blocks that are not home yet. Metadata never goes home
+without passing through the journal.
+*/
+static void journal_commit()
+{
+    if (!journal.start || (journal.count == 0 && journal.nlogged == 0))
+    {
+        return;
+    }
+
+    int limit = journal_limit();
+    if (journal.count > limit)
+    {
+        // Move the inode table blocks to the end, keeping the order of the rest
+        int n = 0;
+        for (int i = 0; i < journal.count; i++)
+        {
+            if (journal.homes[i] > super.ninodeblocks)
+            {
+                char *image = journal.images[i];
+                int home = journal.homes[i];
+                memmove(journal.images + n + 1, journal.images + n, (i - n) * sizeof(char *));
+                memmove(journal.homes + n + 1, journal.homes + n, (i - n) * sizeof(int));
+                journal.images[n] = image;
+                journal.homes[n] = home;
+                n++;
+            }
+        }
+        for (int i = 0; i < journal.count; i++)
+        {
+            journal.slot[journal.homes[i]] = i + 1;
+        }
+    }
+    do
+    {
+        journal_write(journal.count < limit ? journal.count : limit);
+    } while (journal.count > 0);
+}
+
+/*
+Metadata has piled up towards what one transaction can log: commit it
+as a transaction of its own, between operations, before it outgrows
+the journal. Called by file operations holding nothing.
+*/
+static void journal_group_commit()
+{
+    pthread_rwlock_wrlock(&fs_lock);
+    if (inodes != NULL && journal_full())
+    {
+        blockmap_flush();
+        inode_flush();
+        journal_commit();
+    }
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+/* Commit the running transaction and retire it too, leaving nothing in the journal to replay */
+static void journal_checkpoint()
+{
+    journal_commit();
+    journal_commit();
+}
+
+static int sync_all()
+{
+    if (inodes == NULL)
+    {
+        return 0;
+    }
+    blockmap_flush();
+    inode_flush();
+    journal_commit();
+    bitmap_flush(&bitmap, 1 + super.ninodeblocks);
+    disk_sync();
+    return 1;
+}
+
+int fs_sync()
+{
+    struct stats_span span;
+    stats_begin(&span);
+    pthread_rwlock_wrlock(&fs_lock);
+    int result = sync_all();
+    if (__atomic_exchange_n(&delay_lost, 0, __ATOMIC_SEQ_CST))
+    {
+        result = 0;
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    stats_end(&span, STATS_FS_SYNC, 0);
+    return result;
+}
+
+static int unmount_disk()
+{
+    if (!sync_all())
+    {
+        return 0;
+    }
+
+    /* Retire the last transaction, now that its blocks are home, and free the blocks it held */
+    journal_commit();
+    bitmap_flush(&bitmap, 1 + super.ninodeblocks);
+
+    /* Everything is on disk, so the next mount can trust the bitmap */
+    if (super.nbitmapblocks > 0)
+    {
+        super.clean = 1;
+        super_write();
+        disk_sync();
+    }
+
+    free(inodes);
+    free(inode_dirty);
+    bitmap_release(&bitmap);
+    bitmap_release(&inode_bitmap);
+    dedup_close();
+    memset(streams, 0, sizeof(streams));
+    handle_forget(0);
+    blockmap_reset();
+    journal_close();
+    inodes = NULL;
+    inode_dirty = NULL;
+    return !__atomic_exchange_n(&delay_lost, 0, __ATOMIC_SEQ_CST);
+}
+
+int fs_unmount()
+{
+    struct stats_span span;
+    stats_begin(&span);
+    pthread_rwlock_wrlock(&fs_lock);
+    int result = unmount_disk();
+    pthread_rwlock_unlock(&fs_lock);
+    stats_end(&span, STATS_FS_UNMOUNT, 0);
+    return result;
+}
+
+/* Free blocks on the mounted disk, less those promised to delayed data; -1 if none is mounted */
+int fs_freeblocks()
+{
+    pthread_rwlock_rdlock(&fs_lock);
+    int result = inodes == NULL ? -1 : __atomic_load_n(&bitmap.nfree, __ATOMIC_RELAXED) - __atomic_load_n(&delay_reserve, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&fs_lock);
+    return result;
+}
+
+static pthread_rwlock_t *inode_lock(int inumber)
+{
+    return &inode_locks[inumber % INODE_LOCKS];
+}
+
+/*
+Take fs_lock shared and the lock of inode inumber for reading or
+writing, and return the resident inode. Returns NULL, with nothing
+locked, if the inode is out of range or not in use.
+*/
+static struct fs_inode *inode_acquire(int inumber, int write)
+{
+    pthread_rwlock_rdlock(&fs_lock);
+    if (journal_full())
+    {
+        pthread_rwlock_unlock(&fs_lock);
+        journal_group_commit();
+        pthread_rwlock_rdlock(&fs_lock);
+    }
+    if (inodes == NULL || inumber < 1 || inumber >= super.ninodes)
+    {
+        pthread_rwlock_unlock(&fs_lock);
+        return NULL;
+    }
+
+    if (write)
+    {
+        pthread_rwlock_wrlock(inode_lock(inumber));
+    }
+    else
+    {
+        pthread_rwlock_rdlock(inode_lock(inumber));
+    }
+    if (!inodes[inumber].isvalid)
+    {
+        pthread_rwlock_unlock(inode_lock(inumber));
+        pthread_rwlock_unlock(&fs_lock);
+        return NULL;
+    }
+    return &inodes[inumber];
+}
+
+static void inode_release(int inumber)
+{
+    pthread_rwlock_unlock(inode_lock(inumber));
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+/* Mark the inode block holding inumber for write-back */
+static void inode_save(int inumber)
+{
+    if (!__atomic_exchange_n(&inode_dirty[inumber / INODES_PER_BLOCK], 1, __ATOMIC_RELAXED))
+    {
+        __atomic_add_fetch(&journal.pending, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Free blocks that data allocations must leave alone */
+static int block_reserved()
+{
+    return __atomic_load_n(&tree_reserve, __ATOMIC_RELAXED) + __atomic_load_n(&delay_reserve, __ATOMIC_RELAXED);
+}
+
+static void dedup_init(int nblocks)
+{
+    int nbuckets = 1;
+    while (nbuckets < nblocks)
+    {
+        nbuckets *= 2;
+    }
+    dedup.shares = (unsigned char *)calloc(nblocks, sizeof(unsigned char));
+    dedup.hash = (unsigned *)calloc(nblocks, sizeof(unsigned));
+    dedup.next = (int *)malloc(nblocks * sizeof(int));
+    memset(dedup.next, -1, nblocks * sizeof(int));
+    dedup.buckets = (int *)calloc(nbuckets, sizeof(int));
+    dedup.mask = nbuckets - 1;
+}
+
+static void dedup_close()
+{
+    free(dedup.shares);
+    free(dedup.hash);
+    free(dedup.next);
+    free(dedup.buckets);
+    memset(&dedup, 0, sizeof(dedup));
+}
+
+/* Empty the index, keeping the reference counts */
+static void dedup_forget()
+{
+    if (dedup.shares != NULL)
+    {
+        memset(dedup.next, -1, super.nblocks * sizeof(int));
+        memset(dedup.buckets, 0, (dedup.mask + 1) * sizeof(int));
+    }
+}
+
+/* The index functions are called with dedup_lock held */
+static void dedup_insert(int num, unsigned hash)
+{
+    if (dedup.next[num] >= 0)
+    {
+        return;
+    }
+    dedup.hash[num] = hash;
+    dedup.next[num] = dedup.buckets[hash & dedup.mask];
+    dedup.buckets[hash & dedup.mask] = num;
+}
+
+static void dedup_remove(int num)
+{
+    if (dedup.next[num] < 0)
+    {
+        return;
+    }
+    int *link = &dedup.buckets[dedup.hash[num] & dedup.mask];
+    while (*link != num)
+    {
+        link = &dedup.next[*link];
+    }
+    *link = dedup.next[num];
+    dedup.next[num] = -1;
+}
+
+/*
+An indexed block holding data, with a reference taken for the caller;
+0 if there is none. Each candidate is read with dedup_lock dropped,
+holding a reference meanwhile so that it is neither freed nor written
+over in place, and so stays in the index.
+*/
+static int dedup_find(unsigned hash, const char *data)
+{
+    union fs_block block;
+    int num = dedup.buckets[hash & dedup.mask];
+    while (num > 0)
+    {
+        if (dedup.hash[num] != hash || dedup.shares[num] == DEDUP_MAX_SHARES)
+        {
+            num = dedup.next[num];
+            continue;
+        }
+        dedup.shares[num]++;
+        pthread_mutex_unlock(&dedup_lock);
+        disk_read(num, block.data);
+        int same = memcmp(block.data, data, DISK_BLOCK_SIZE) == 0;
+        pthread_mutex_lock(&dedup_lock);
+        if (same)
+        {
+            return num;
+        }
+        if (dedup.shares[num] > 0)
+        {
+            dedup.shares[num]--;
+            num = dedup.next[num];
+            continue;
+        }
+        // The other references went while the lock was dropped, so the block is this one's to free
+        pthread_mutex_unlock(&dedup_lock);
+        block_free(num);
+        pthread_mutex_lock(&dedup_lock);
+        num = dedup.buckets[hash & dedup.mask];
+    }
+    return 0;
+}
+
+/* Drop a reference to a block; returns 0 if it was the last, leaving the block to be freed */
+static int dedup_release(int num)
+{
+    pthread_mutex_lock(&dedup_lock);
+    int shared = dedup.shares[num] > 0;
+    if (shared)
+    {
+        dedup.shares[num]--;
+    }
+    else
+    {
+        dedup_remove(num);
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    return !shared;
+}
+
+/* Give a block back to its shard, or with FEATURE_DEDUP drop one of its references */
+static void block_free(int num)
+{
+    if (num <= 0 || num >= super.nblocks || journal_forget(num))
+    {
+        return;
+    }
+    if (dedup.shares != NULL && !dedup_release(num))
+    {
+        return;
+    }
+    struct fs_shard *shard = &shards[num / shard_size];
+    pthread_mutex_lock(&shard->lock);
+    bitmap_clear(&bitmap, num);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+Undo an allocation that ate into the blocks promised to delayed data,
+or a data allocation that ate into those reserved for extent trees
+*/
+static int block_check(int num, int for_tree)
+{
+    int reserved = for_tree ? __atomic_load_n(&delay_reserve, __ATOMIC_RELAXED) : block_reserved();
+    if (__atomic_load_n(&bitmap.nfree, __ATOMIC_RELAXED) < reserved)
+    {
+        block_free(num);
+        return 0;
+    }
+    return num;
+}
+
+/*
+Find a free block for inode inumber and mark it used, 0 if the disk
+is full. Only blocks for an extent tree (for_tree) may be taken from
+tree_reserve.
+*/
+static int block_alloc(int inumber, int for_tree)
+{
+    for (int i = 0; i < nshards; i++)
+    {
+        struct fs_shard *shard = &shards[(inumber + i) % nshards];
+        int lo = shard->start > datastart ? shard->start : datastart;
+        if (lo >= shard->end)
+        {
+            continue;
+        }
+        pthread_mutex_lock(&shard->lock);
+        int num = bitmap_alloc(&bitmap, lo, shard->end, &shard->hint);
+        pthread_mutex_unlock(&shard->lock);
+        if (num >= 0)
+        {
+            return block_check(num, for_tree);
+        }
+    }
+    return 0;
+}
+
+/* Like block_alloc, but take block goal if it is free */
+static int block_alloc_near(int goal, int inumber)
+{
+    if (goal >= datastart && goal < super.nblocks)
+    {
+        struct fs_shard *shard = &shards[goal / shard_size];
+        int taken = 0;
+        pthread_mutex_lock(&shard->lock);
+        if (!bitmap_test(&bitmap, goal))
+        {
+            bitmap_set(&bitmap, goal);
+            taken = 1;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        if (taken)
+        {
+            return block_check(goal, 0);
+        }
+    }
+    return block_alloc(inumber, 0);
+}
+
+/*
+Find up to want adjacent free blocks for inode inumber and mark them
+used: the blocks from goal on if goal is free, otherwise the first run
+that long in the inode's shards, or else the longest run in the first
+shard with a free block. Blocks for delayed data (reserved) come out
+of delay_reserve; any others must leave the reserved blocks alone.
+Returns the first block and sets *len, or returns 0 if the disk is full.
+*/
+static int block_alloc_run(int goal, int want, int inumber, int reserved, int *len)
+{
+    int start = -1;
+    *len = 0;
+    if (goal >= datastart && goal < super.nblocks)
+    {
+        struct fs_shard *shard = &shards[goal / shard_size];
+        pthread_mutex_lock(&shard->lock);
+        if (!bitmap_test(&bitmap, goal))
+        {
+            start = goal;
+            *len = bitmap_find_used(&bitmap, goal, goal + want < shard->end ? goal + want : shard->end) - goal;
+            for (int n = start; n < start + *len; n++)
+            {
+                bitmap_set(&bitmap, n);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    // The first pass only takes a run of the full length
+    for (int pass = 0; pass < 2 && start < 0; pass++)
+    {
+        for (int i = 0; i < nshards && start < 0; i++)
+        {
+            struct fs_shard *shard = &shards[(inumber + i) % nshards];
+            int lo = shard->start > datastart ? shard->start : datastart;
+            if (lo >= shard->end)
+            {
+                continue;
+            }
+            pthread_mutex_lock(&shard->lock);
+            int n = bitmap_find_run(&bitmap, lo, shard->end, want, len);
+            if (n >= 0 && (*len == want || pass == 1))
+            {
+                start = n;
+                for (int k = start; k < start + *len; k++)
+                {
+                    bitmap_set(&bitmap, k);
+                }
+            }
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+    if (start < 0)
+    {
+        *len = 0;
+        return 0;
+    }
+
+    if (reserved)
+    {
+        __atomic_sub_fetch(&delay_reserve, *len, __ATOMIC_RELAXED);
+        return start;
+    }
+    while (*len > 0 && __atomic_load_n(&bitmap.nfree, __ATOMIC_RELAXED) < block_reserved())
+    {
+        block_free(start + --*len);
+    }
+    return *len > 0 ? start : 0;
+}
+
+/*
+Find the block map of an inode and pin it, loading it into the least
+recently used unpinned slot if needed. The caller holds the inode's
+lock and unpins the map with blockmap_put. The slot's old map is
+written back and the new one read in with blockmap_lock dropped, the
+slot marked as loading so that nobody else takes it or looks in it.
+*/
+static struct fs_blockmap *blockmap_get(int inumber)
+{
+    pthread_mutex_lock(&blockmap_lock);
+    struct fs_blockmap *victim = NULL;
+    while (victim == NULL)
+    {
+        int busy = 0;
+        for (int i = 0; i < BLOCKMAP_SLOTS; i++)
+        {
+            if (blockmaps[i].loading)
+            {
+                busy |= blockmaps[i].loading == inumber || blockmaps[i].inumber == inumber;
+                continue;
+            }
+            if (blockmaps[i].inumber == inumber)
+            {
+                blockmaps[i].used = ++blockmap_clock;
+                blockmaps[i].pins++;
+                pthread_mutex_unlock(&blockmap_lock);
+                return &blockmaps[i];
+            }
+            if (!blockmaps[i].pins && (victim == NULL || blockmaps[i].used < victim->used))
+            {
+                victim = &blockmaps[i];
+            }
+        }
+        if (victim == NULL || busy)
+        {
+            // Every slot is pinned by another operation, or this inode's map is on its way in or out
+            victim = NULL;
+            pthread_cond_wait(&blockmap_ready, &blockmap_lock);
+        }
+    }
+    victim->loading = inumber;
+    pthread_mutex_unlock(&blockmap_lock);
+
+    blockmap_store(victim);
+    extent_reserve(victim, 0);
+    blockmap_clean(victim);
+    blockmap_fill(victim, &inodes[inumber]);
+    if (inodes[inumber].isvalid & INODE_EXTENTS)
+    {
+        extent_reserve_next(victim);
+    }
+
+    pthread_mutex_lock(&blockmap_lock);
+    victim->inumber = inumber;
+    victim->loading = 0;
+    victim->used = ++blockmap_clock;
+    victim->pins = 1;
+    pthread_cond_broadcast(&blockmap_ready);
+    pthread_mutex_unlock(&blockmap_lock);
+    return victim;
+}
+
+static void blockmap_put(struct fs_blockmap *map)
+{
+    pthread_mutex_lock(&blockmap_lock);
+    if (--map->pins == 0)
+    {
+        pthread_cond_broadcast(&blockmap_ready);
+    }
+    pthread_mutex_unlock(&blockmap_lock);
+}
+
+/* Write back every changed block map */
+static void blockmap_flush()
+{
+    for (int i = 0; i < BLOCKMAP_SLOTS; i++)
+    {
+        blockmap_store(&blockmaps[i]);
+    }
+}
+
+/* Forget every block map, which must have been written back, and the blocks they had reserved */
+static void blockmap_reset()
+{
+    for (int i = 0; i < BLOCKMAP_SLOTS; i++)
+    {
+        free(blockmaps[i].blocks);
+        free(blockmaps[i].meta);
+        free(blockmaps[i].delayed);
+    }
+    memset(blockmaps, 0, sizeof(blockmaps));
+    tree_reserve = 0;
+    delay_reserve = 0;
+}
+
+/* Record that file block n lives in disk block num */
+static void blockmap_set(struct fs_blockmap *map, int n, int num)
+{
+    if (n >= map->capacity)
+    {
+        int capacity = map->capacity ? map->capacity : 64;
+        while (capacity <= n)
+        {
+            capacity *= 2;
+        }
+        map->blocks = (int *)realloc(map->blocks, capacity * sizeof(int));
+        memset(map->blocks + map->capacity, 0, (capacity - map->capacity) * sizeof(int));
+        map->capacity = capacity;
+    }
+    if (n >= map->nblocks)
+    {
+        // Blocks skipped over are holes, whatever the slot held before
+        memset(map->blocks + map->nblocks, 0, (n - map->nblocks) * sizeof(int));
+        map->nblocks = n + 1;
+    }
+    map->blocks[n] = num;
+}
+
+/* Mark a map changed, counting the blocks writing it back will log towards the next commit */
+static void blockmap_dirty(struct fs_blockmap *map)
+{
+    if (!map->dirty)
+    {
+        map->pending = map->nmeta > 0 ? map->nmeta : 1;
+        __atomic_add_fetch(&journal.pending, map->pending, __ATOMIC_RELAXED);
+        map->dirty = 1;
+    }
+}
+
+/* Mark a map written back, or no longer worth writing */
+static void blockmap_clean(struct fs_blockmap *map)
+{
+    __atomic_sub_fetch(&journal.pending, map->pending, __ATOMIC_RELAXED);
+    map->pending = 0;
+    map->dirty = 0;
+}
+
+/* Record a block holding pointers or extents rather than file data */
+static void blockmap_meta(struct fs_blockmap *map, int num)
+{
+    map->meta = (int *)realloc(map->meta, (map->nmeta + 1) * sizeof(int));
+    map->meta[map->nmeta++] = num;
+}
+
+/* Append the blocks of an extent to the end of the map */
+static void extent_append(struct fs_blockmap *map, const struct fs_extent *extent)
+{
+    for (int j = 0; j < extent->length && map->nblocks < EXTENT_MAX_BLOCKS; j++)
+    {
+        blockmap_set(map, map->nblocks, extent->start ? extent->start + j : 0);
+    }
+    map->nextents++;
+}
+
+/* Append the extents under an extent tree node, whose depth must be below limit, in file order */
+static void extent_node_load(struct fs_blockmap *map, int blocknum, int limit)
+{
+    union fs_block block;
+    if (blocknum <= 0)
+    {
+        return;
+    }
+    meta_read(blocknum, block.data);
+
+    struct fs_extent_node *node = &block.node;
+    if (node->depth < 0 || node->depth >= limit)
+    {
+        return;
+    }
+    blockmap_meta(map, blocknum);
+    if (node->depth == 0)
+    {
+        for (int k = 0; k < node->count && k < EXTENTS_PER_NODE; k++)
+        {
+            extent_append(map, &node->extent[k]);
+        }
+    }
+    else
+    {
+        for (int k = 0; k < node->count && k < CHILDREN_PER_NODE; k++)
+        {
+            extent_node_load(map, node->child[k], node->depth);
+        }
+    }
+}
+
+/* Read the whole block map of an inode, which need not be resident */
+static void blockmap_fill(struct fs_blockmap *map, const struct fs_inode *inode)
+{
+    map->nblocks = 0;
+    map->nmeta = 0;
+    map->nextents = 0;
+
+    if (inode->isvalid & INODE_INLINE)
+    {
+        return;
+    }
+    if (inode->isvalid & INODE_EXTENTS)
+    {
+        if (inode->tree)
+        {
+            extent_node_load(map, inode->tree, EXTENT_MAX_DEPTH);
+        }
+        else
+        {
+            for (int k = 0; k < inode->nextents && k < EXTENTS_PER_INODE; k++)
+            {
+                extent_append(map, &inode->extent[k]);
+            }
+        }
+        return;
+    }
+
+    for (int k = 0; k < POINTERS_PER_INODE; k++)
+    {
+        if (inode->direct[k])
+        {
+            blockmap_set(map, k, inode->direct[k]);
+        }
+    }
+    if (inode->indirect)
+    {
+        union fs_block block;
+        meta_read(inode->indirect, block.data);
+        blockmap_meta(map, inode->indirect);
+        for (int k = 0; k < POINTERS_PER_BLOCK; k++)
+        {
+            if (block.pointers[k])
+            {
+                blockmap_set(map, POINTERS_PER_INODE + k, block.pointers[k]);
+            }
+        }
+    }
+}
+
+/* Number of extent tree nodes needed to hold nextents extents */
+static int extent_nodes(int nextents)
+{
+    if (nextents <= EXTENTS_PER_INODE)
+    {
+        return 0;
+    }
+    int level = (nextents + EXTENTS_PER_NODE - 1) / EXTENTS_PER_NODE;
+    int total = level;
+    while (level > 1)
+    {
+        level = (level + CHILDREN_PER_NODE - 1) / CHILDREN_PER_NODE;
+        total += level;
+    }
+    return total;
+}
+
+/* Set the share of tree_reserve held for the extent tree of a map */
+static void extent_reserve(struct fs_blockmap *map, int reserve)
+{
+    __atomic_add_fetch(&tree_reserve, reserve - map->reserved, __ATOMIC_RELAXED);
+    map->reserved = reserve;
+}
+
+/* Hold enough blocks for the extent tree to take one more extent */
+static void extent_reserve_next(struct fs_blockmap *map)
+{
+    int reserve = extent_nodes(map->nextents + 1) - map->nmeta;
+    extent_reserve(map, reserve > 0 ? reserve : 0);
+}
+
+/*
+Rewrite the extents of a changed map: in the inode if they fit,
+otherwise as a tree built bottom up from the leaves, reusing the
+blocks of the old tree.
+*/
+static void extents_store(struct fs_blockmap *map)
+{
+    struct fs_inode *inode = &inodes[map->inumber];
+
+    // Collapse the map into runs of adjacent blocks
+    struct fs_extent *extents = (struct fs_extent *)malloc((map->nblocks + 1) * sizeof(struct fs_extent));
+    int n = 0;
+    for (int k = 0; k < map->nblocks; k++)
+    {
+        int num = map->blocks[k];
+        if (n > 0 && (extents[n - 1].start ? num == extents[n - 1].start + extents[n - 1].length : num == 0))
+        {
+            extents[n - 1].length++;
+            continue;
+        }
+        extents[n].start = num;
+        extents[n].length = 1;
+        n++;
+    }
+
+    // Bring the tree to the number of nodes the extents need
+    int needed = extent_nodes(n);
+    while (map->nmeta > needed)
+    {
+        block_free(map->meta[--map->nmeta]);
+    }
+    while (map->nmeta < needed)
+    {
+        int num = block_alloc(map->inumber, 1);
+        if (!num)
+        {
+            // No room for the tree: leave the map dirty for a later try
+            free(extents);
+            return;
+        }
+        blockmap_meta(map, num);
+    }
+
+    memset(inode->extent, 0, sizeof(inode->extent));
+    inode->nextents = n;
+    inode->tree = 0;
+    if (needed == 0)
+    {
+        memcpy(inode->extent, extents, n * sizeof(struct fs_extent));
+    }
+    else
+    {
+        union fs_block block;
+        int *level = (int *)malloc(((n + EXTENTS_PER_NODE - 1) / EXTENTS_PER_NODE) * sizeof(int));
+        int nlevel = 0;
+        int next = 0;
+
+        for (int i = 0; i < n; i += EXTENTS_PER_NODE)
+        {
+            memset(block.data, 0, sizeof(block.data));
+            block.node.count = n - i < EXTENTS_PER_NODE ? n - i : EXTENTS_PER_NODE;
+            memcpy(block.node.extent, &extents[i], block.node.count * sizeof(struct fs_extent));
+            meta_write(map->meta[next], block.data);
+            level[nlevel++] = map->meta[next++];
+        }
+
+        // Each pass writes the index nodes over the level below, in place
+        for (int depth = 1; nlevel > 1; depth++)
+        {
+            int up = 0;
+            for (int i = 0; i < nlevel; i += CHILDREN_PER_NODE)
+            {
+                memset(block.data, 0, sizeof(block.data));
+                block.node.depth = depth;
+                block.node.count = nlevel - i < CHILDREN_PER_NODE ? nlevel - i : CHILDREN_PER_NODE;
+                memcpy(block.node.child, &level[i], block.node.count * sizeof(int));
+                meta_write(map->meta[next], block.data);
+                level[up++] = map->meta[next++];
+            }
+            nlevel = up;
+        }
+
+        inode->tree = level[0];
+        free(level);
+    }
+
+    free(extents);
+    map->nextents = n;
+    blockmap_clean(map);
+    extent_reserve_next(map);
+    inode_save(map->inumber);
+}
+
+/* Write back a changed map: its delayed data, then the indirect block or the extents of an extent inode */
+static void blockmap_store(struct fs_blockmap *map)
+{
+    delay_flush(map);
+    if (!map->dirty)
+    {
+        return;
+    }
+    if (inodes[map->inumber].isvalid & INODE_EXTENTS)
+    {
+        extents_store(map);
+        return;
+    }
+
+    union fs_block block;
+    memset(block.data, 0, sizeof(block.data));
+    for (int k = POINTERS_PER_INODE; k < map->nblocks; k++)
+    {
+        block.pointers[k - POINTERS_PER_INODE] = map->blocks[k];
+    }
+    meta_write(inodes[map->inumber].indirect, block.data);
+    blockmap_clean(map);
+}
+
+/*
+Translate block number n of a file into a disk block number, using
+its pinned block map. With allocate set, missing blocks (and the
+indirect block) are allocated on the way, next to the block before
+them when possible so that files stay contiguous. Returns 0 if there
+is no such block.
+*/
+static int inode_map(struct fs_blockmap *map, int n, int allocate)
+{
+    struct fs_inode *inode = &inodes[map->inumber];
+    int extents = inode->isvalid & INODE_EXTENTS;
+    if (n < 0 || n >= (extents ? EXTENT_MAX_BLOCKS : POINTERS_PER_INODE + POINTERS_PER_BLOCK))
+    {
+        return 0;
+    }
+
+    if (n < map->nblocks && map->blocks[n])
+    {
+        return map->blocks[n];
+    }
+    if (!allocate)
+    {
+        return 0;
+    }
+
+    if (!extents && n >= POINTERS_PER_INODE && !inode->indirect)
+    {
+        inode->indirect = block_alloc(map->inumber, 0);
+        if (!inode->indirect)
+        {
+            return 0;
+        }
+        blockmap_meta(map, inode->indirect);
+        blockmap_dirty(map);  // the new block holds old data until the pointers are written
+    }
+
+    int previous = n > 0 && n <= map->nblocks ? map->blocks[n - 1] : 0;
+    int num = block_alloc_near(previous ? previous + 1 : 0, map->inumber);
+    if (!num)
+    {
+        return 0;
+    }
+
+    blockmap_set(map, n, num);
+    if (!extents && n < POINTERS_PER_INODE)
+    {
+        inode->direct[n] = num;
+    }
+    else
+    {
+        blockmap_dirty(map);
+    }
+    if (extents && num != previous + 1)
+    {
+        map->nextents++;
+        extent_reserve_next(map);
+    }
+    return num;
+}
+
+/*
+Give the count file blocks past the end of a map disk blocks, in as
+few runs of adjacent blocks as the free space allows, each run
+starting right after the block before it if that is free. Blocks for
+delayed data (reserved) come out of delay_reserve. Returns the number
+of blocks placed, which is short only if the disk or the file is full.
+*/
+static int blockmap_extend(struct fs_blockmap *map, int count, int reserved)
+{
+    struct fs_inode *inode = &inodes[map->inumber];
+    int extents = inode->isvalid & INODE_EXTENTS;
+    int limit = extents ? EXTENT_MAX_BLOCKS : POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+    int placed = 0;
+    while (placed < count && map->nblocks < limit)
+    {
+        int n = map->nblocks;
+        int want = count - placed < limit - n ? count - placed : limit - n;
+        if (!extents && n < POINTERS_PER_INODE && want > POINTERS_PER_INODE - n)
+        {
+            // The rest needs the indirect block, which is taken on the next round
+            want = POINTERS_PER_INODE - n;
+        }
+        if (!extents && n >= POINTERS_PER_INODE && !inode->indirect)
+        {
+            inode->indirect = block_alloc(map->inumber, 0);
+            if (!inode->indirect)
+            {
+                break;
+            }
+            blockmap_meta(map, inode->indirect);
+            blockmap_dirty(map);  // the new block holds old data until the pointers are written
+        }
+
+        int previous = n > 0 ? map->blocks[n - 1] : 0;
+        int len;
+        int start = block_alloc_run(previous ? previous + 1 : 0, want, map->inumber, reserved, &len);
+        if (!start && reserved && __atomic_load_n(&bitmap.nfree, __ATOMIC_SEQ_CST) > 0)
+        {
+            // Promised blocks can only be missing while another allocation takes them and gives them back
+            continue;
+        }
+        if (!start)
+        {
+            break;
+        }
+        for (int k = 0; k < len; k++)
+        {
+            blockmap_set(map, n + k, start + k);
+            if (!extents && n + k < POINTERS_PER_INODE)
+            {
+                inode->direct[n + k] = start + k;
+            }
+            else
+            {
+                blockmap_dirty(map);
+            }
+        }
+        if (extents && start != previous + 1)
+        {
+            map->nextents++;
+            extent_reserve_next(map);
+        }
+        placed += len;
+    }
+    if (placed > 0)
+    {
+        inode_save(map->inumber);
+    }
+    return placed;
+}
+
+/*
+Blocks promised along with the delayed data of an extent inode, for
+the tree nodes its extents may need once placed. They are handed over
+to tree_reserve when the data is flushed.
+*/
+static int delay_cushion(struct fs_blockmap *map)
+{
+    return inodes[map->inumber].isvalid & INODE_EXTENTS ? EXTENT_MAX_DEPTH : 0;
+}
+
+/* Promise count free blocks to delayed data, returning 0 if there are not that many left to promise */
+static int delay_promise(int count)
+{
+    int promised = __atomic_add_fetch(&delay_reserve, count, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bitmap.nfree, __ATOMIC_SEQ_CST) < __atomic_load_n(&tree_reserve, __ATOMIC_RELAXED) + promised)
+    {
+        __atomic_sub_fetch(&delay_reserve, count, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+/* Drop the delayed data of a map and the blocks promised to it */
+static void delay_discard(struct fs_blockmap *map)
+{
+    if (map->ndelayed > 0)
+    {
+        __atomic_sub_fetch(&delay_reserve, map->ndelayed + delay_cushion(map), __ATOMIC_RELAXED);
+    }
+    map->ndelayed = 0;
+}
+
+/*
+Give the delayed data of a map its disk blocks and write it out, a run
+of blocks per request. Returns 0 if some of it found no blocks, which
+the promised blocks rule out unless the accounting is wrong.
+*/
+static int delay_flush(struct fs_blockmap *map)
+{
+    if (map->ndelayed == 0)
+    {
+        return 1;
+    }
+    int first = map->nblocks;
+    int placed = blockmap_extend(map, map->ndelayed, 1);
+    for (int k = 0; k < placed;)
+    {
+        int run = 1;
+        while (k + run < placed && map->blocks[first + k + run] == map->blocks[first + k] + run)
+        {
+            run++;
+        }
+        struct iovec iov = { map->delayed + k * DISK_BLOCK_SIZE, (size_t)run * DISK_BLOCK_SIZE };
+        disk_submit_write(map->blocks[first + k], &iov, 1);
+        k += run;
+    }
+    disk_drain();
+
+    // Data already reported written is lost: keep the size within the blocks the file has, and have the next sync fail
+    int lost = map->ndelayed - placed;
+    if (lost > 0)
+    {
+        struct fs_inode *inode = &inodes[map->inumber];
+        if (inode->size > (first + placed) * DISK_BLOCK_SIZE)
+        {
+            inode->size = (first + placed) * DISK_BLOCK_SIZE;
+            inode_save(map->inumber);
+        }
+        __atomic_add_fetch(&delay_lost, lost, __ATOMIC_SEQ_CST);
+    }
+
+    // Any tree nodes the new extents need are in tree_reserve by now
+    __atomic_sub_fetch(&delay_reserve, lost + delay_cushion(map), __ATOMIC_RELAXED);
+    map->ndelayed = 0;
+    return lost == 0;
+}
+
+/*
+Copy length bytes for file block n on, starting skip bytes into it,
+into the delayed buffer of a map, flushing the buffer first if it is
+full. Block n is at most one past the buffered ones. Returns the bytes
+taken, which fall short if no more blocks can be promised, or none if
+flushing lost data.
+*/
+static int delay_write(struct fs_blockmap *map, int n, int skip, const char *data, int length)
+{
+    if (n - map->nblocks >= DELAY_BLOCKS && !delay_flush(map))
+    {
+        return 0;
+    }
+    if (map->delayed == NULL)
+    {
+        map->delayed = (char *)malloc(DELAY_BLOCKS * DISK_BLOCK_SIZE);
+    }
+
+    struct fs_inode *inode = &inodes[map->inumber];
+    int extents = inode->isvalid & INODE_EXTENTS;
+    int limit = extents ? EXTENT_MAX_BLOCKS : POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+    int k = n - map->nblocks;
+    int copied = 0;
+    while (copied < length && k < DELAY_BLOCKS && k <= map->ndelayed)
+    {
+        if (k == map->ndelayed)
+        {
+            if (n >= limit)
+            {
+                break;
+            }
+            // The indirect block is taken now, so that placing the data later cannot fail
+            if (!extents && n >= POINTERS_PER_INODE && !inode->indirect)
+            {
+                inode->indirect = block_alloc(map->inumber, 0);
+                if (!inode->indirect)
+                {
+                    break;
+                }
+                blockmap_meta(map, inode->indirect);
+                blockmap_dirty(map);  // the new block holds old data until the pointers are written
+            }
+            if (!delay_promise(map->ndelayed == 0 ? 1 + delay_cushion(map) : 1))
+            {
+                break;
+            }
+            memset(map->delayed + k * DISK_BLOCK_SIZE, 0, DISK_BLOCK_SIZE);
+            map->ndelayed++;
+        }
+        int chunk = DISK_BLOCK_SIZE - skip < length - copied ? DISK_BLOCK_SIZE - skip : length - copied;
+        memcpy(map->delayed + k * DISK_BLOCK_SIZE + skip, data + copied, chunk);
+        copied += chunk;
+        skip = 0;
+        k++;
+        n++;
+    }
+    return copied;
+}
+
+/* Release every data block of an inode, and its indirect block or extent tree, and set its size to zero */
+static void inode_truncate(struct fs_blockmap *map)
+{
+    struct fs_inode *inode = &inodes[map->inumber];
+    for (int k = 0; k < map->nblocks; k++)
+    {
+        block_free(map->blocks[k]);
+    }
+    for (int k = 0; k < map->nmeta; k++)
+    {
+        block_free(map->meta[k]);
+    }
+    map->nblocks = 0;
+    map->nmeta = 0;
+    map->nextents = 0;
+    blockmap_clean(map);
+    extent_reserve(map, 0);
+    delay_discard(map);
+
+    memset(inode->direct, 0, sizeof(inode->direct));
+    inode->indirect = 0;
+    inode->size = 0;
+    if (super.features & FEATURE_INLINE)
+    {
+        inode->isvalid |= INODE_INLINE;
+    }
+}
+
+static int create_file()
+{
+    pthread_rwlock_rdlock(&fs_lock);
+    if (journal_full())
+    {
+        pthread_rwlock_unlock(&fs_lock);
+        journal_group_commit();
+        pthread_rwlock_rdlock(&fs_lock);
+    }
+    if (inodes == NULL)
+    {
+        pthread_rwlock_unlock(&fs_lock);
+        return 0;
+    }
+
+    // take the lowest free inode from the index
+    pthread_mutex_lock(&inode_alloc_lock);
+    int inumber = bitmap_alloc(&inode_bitmap, 1, inode_bitmap.nbits, &inode_bitmap.hint);
+    pthread_mutex_unlock(&inode_alloc_lock);
+    if (inumber < 0)
+    {
+        // return positive inode number on success and 0 on failure
+        pthread_rwlock_unlock(&fs_lock);
+        return 0;
+    }
+
+    // create an inode of zero length
+    pthread_rwlock_wrlock(inode_lock(inumber));
+    struct fs_inode *inode = &inodes[inumber];
+    memset(inode, 0, sizeof(struct fs_inode));
+    inode->isvalid = INODE_VALID;
+    if (super.features & FEATURE_EXTENTS)
+    {
+        inode->isvalid |= INODE_EXTENTS;
+    }
+    if (super.features & FEATURE_INLINE)
+    {
+        inode->isvalid |= INODE_INLINE;
+    }
+    if (super.features & FEATURE_COMPRESS)
+    {
+        inode->isvalid |= INODE_COMPRESSED;
+    }
+    if (super.features & FEATURE_DEDUP)
+    {
+        inode->isvalid |= INODE_DEDUP;
+    }
+    inode_save(inumber);
+    inode_release(inumber);
+    return inumber;
+}
+
+int fs_create()
+{
+    struct stats_span span;
+    stats_begin(&span);
+    int result = create_file();
+    stats_end(&span, STATS_FS_CREATE, 0);
+    return result;
+}
+
+static int delete_file(int inumber)
+{
+    struct fs_inode *inode = inode_acquire(inumber, 1);
+    if (inode == NULL)
+    {
+        return 0;
+    }
+
+    // release the data blocks and set the inode to invalid
+    stream_forget(inumber);
+    struct fs_blockmap *map = blockmap_get(inumber);
+    inode_truncate(map);
+    blockmap_put(map);
+    handle_forget(inumber);
+    inode->isvalid = 0;
+    inode_save(inumber);
+
+    // keep the search hint at or below the lowest free inode
+    pthread_mutex_lock(&inode_alloc_lock);
+    bitmap_clear(&inode_bitmap, inumber);
+    if (inumber < inode_bitmap.hint)
+    {
+        inode_bitmap.hint = inumber;
+    }
+    pthread_mutex_unlock(&inode_alloc_lock);
+
+    inode_release(inumber);
+    return 1;
+}
+
+int fs_delete(int inumber)
+{
+    struct stats_span span;
+    stats_begin(&span);
+    int result = delete_file(inumber);
+    stats_end(&span, STATS_FS_DELETE, 0);
+    return result;
+}
+
+static int file_size(int inumber)
+{
+    struct fs_inode *inode = inode_acquire(inumber, 0);
+    if (inode == NULL)
+    {
+        return -1;
+    }
+    int size = inode->size;
+    inode_release(inumber);
+    return size;
+}
+
+int fs_getsize(int inumber)
+{
+    struct stats_span span;
+    stats_begin(&span);
+    int result = file_size(inumber);
+    stats_end(&span, STATS_FS_GETSIZE, 0);
+    return result;
+}
+
+/* Copy n bytes starting skip bytes into a disk block out to data */
+static void block_copy_out(int blocknum, int skip, char *data, int n)
+{
+    // The disk layer copies straight out of its cache or mapping
+    disk_read_partial(blocknum, skip, data, n);
+}
+
+/* Copy n bytes from data into a disk block at skip, keeping its other contents unless fresh */
+static void block_copy_in(int blocknum, int skip, const char *data, int n, int fresh)
+{
+    // Whole blocks go straight from data; the disk layer patches partial ones in place
+    if (n == DISK_BLOCK_SIZE)
+    {
+        disk_write(blocknum, data);
+    }
+    else
+    {
+        disk_write_partial(blocknum, skip, data, n, fresh);
+    }
+}
+
+/*
+Read length bytes starting skip bytes into a run of consecutive disk
+blocks. Partial or lone blocks go through the block cache; two or more
+whole blocks are submitted as one asynchronous request straight into
+data, so the runs of one fs_read overlap. Callers disk_drain before
+handing data back.
+*/
+static void read_run(int blocknum, int skip, char *data, int length)
+{
+    if (skip || length < DISK_BLOCK_SIZE)
+    {
+        int n = DISK_BLOCK_SIZE - skip < length ? DISK_BLOCK_SIZE - skip : length;
+        block_copy_out(blocknum, skip, data, n);
+        blocknum++;
+        data += n;
+        length -= n;
+    }
+
+    // Whole blocks already cached (e.g. by readahead) are copied from the cache
+    int full = length / DISK_BLOCK_SIZE;
+    for (int i = 0; i < full;)
+    {
+        int j = i;
+        while (j < full && !disk_cached(blocknum + j))
+        {
+            j++;
+        }
+        if (j - i > 1)
+        {
+            struct iovec iov = { data + i * DISK_BLOCK_SIZE, (size_t)(j - i) * DISK_BLOCK_SIZE };
+            disk_submit_read(blocknum + i, &iov, 1);
+        }
+        else if (j - i == 1)
+        {
+            block_copy_out(blocknum + i, 0, data + i * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+        }
+        if (j < full)
+        {
+            block_copy_out(blocknum + j, 0, data + j * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+            j++;
+        }
+        i = j;
+    }
+    blocknum += full;
+    data += full * DISK_BLOCK_SIZE;
+    length -= full * DISK_BLOCK_SIZE;
+
+    if (length > 0)
+    {
+        block_copy_out(blocknum, 0, data, length);
+    }
+}
+
+/*
+Write length bytes starting skip bytes into a run of consecutive disk
+blocks, which hold file blocks from pointer_number on. Partial blocks
+keep their old contents unless they lie past the old size. As with
+read_run, whole blocks are submitted asynchronously.
+*/
+static void write_run(int blocknum, int skip, const char *data, int length, int pointer_number, int size)
+{
+    if (skip || length < DISK_BLOCK_SIZE)
+    {
+        int n = DISK_BLOCK_SIZE - skip < length ? DISK_BLOCK_SIZE - skip : length;
+        block_copy_in(blocknum, skip, data, n, pointer_number * DISK_BLOCK_SIZE >= size);
+        blocknum++;
+        pointer_number++;
+        data += n;
+        length -= n;
+    }
+
+    int full = length / DISK_BLOCK_SIZE;
+    if (full > 1)
+    {
+        struct iovec iov = { (char *)data, (size_t)full * DISK_BLOCK_SIZE };
+        disk_submit_write(blocknum, &iov, 1);
+    }
+    else if (full == 1)
+    {
+        block_copy_in(blocknum, 0, data, DISK_BLOCK_SIZE, 1);
+    }
+    blocknum += full;
+    pointer_number += full;
+    data += full * DISK_BLOCK_SIZE;
+    length -= full * DISK_BLOCK_SIZE;
+
+    if (length > 0)
+    {
+        block_copy_in(blocknum, 0, data, length, pointer_number * DISK_BLOCK_SIZE >= size);
+    }
+}
+
+/* Find the readahead stream for an inode, taking over the least recently used one if needed */
+static struct fs_stream *stream_find(int inumber)
+{
+    struct fs_stream *victim = &streams[0];
+    for (int i = 0; i < READAHEAD_STREAMS; i++)
+    {
+        if (streams[i].inumber == inumber)
+        {
+            victim = &streams[i];
+            break;
+        }
+        if (streams[i].used < victim->used)
+        {
+            victim = &streams[i];
+        }
+    }
+    if (victim->inumber != inumber)
+    {
+        memset(victim, 0, sizeof(*victim));
+        victim->inumber = inumber;
+        victim->next = -1;
+    }
+    victim->used = ++stream_clock;
+    return victim;
+}
+
+/* Forget the readahead state of an inode whose blocks are changing */
+static void stream_forget(int inumber)
+{
+    pthread_mutex_lock(&stream_lock);
+    for (int i = 0; i < READAHEAD_STREAMS; i++)
+    {
+        if (streams[i].inumber == inumber)
+        {
+            memset(&streams[i], 0, sizeof(streams[i]));
+        }
+    }
+    pthread_mutex_unlock(&stream_lock);
+}
+
+/*
+Called after a read of length bytes at offset: if the inode is being
+read sequentially, prefetch the next window of its blocks into the
+block cache, a run of adjacent disk blocks per request.
+*/
+static void readahead(struct fs_blockmap *map, int offset, int length)
+{
+    pthread_mutex_lock(&stream_lock);
+    struct fs_stream *stream = stream_find(map->inumber);
+    int sequential = offset == 0 || offset == stream->next;
+    stream->next = offset + length;
+    if (!sequential)
+    {
+        stream->window = 0;
+        stream->ahead = 0;
+        pthread_mutex_unlock(&stream_lock);
+        return;
+    }
+
+    // Grow the window, but never let it fall behind the size of the reads
+    int nread = (length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    stream->window = stream->window ? stream->window * 2 : READAHEAD_MIN;
+    if (stream->window < nread)
+    {
+        stream->window = nread;
+    }
+    if (stream->window > READAHEAD_MAX)
+    {
+        stream->window = READAHEAD_MAX;
+    }
+
+    int first = (offset + length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    int last = first + stream->window;
+    int nfileblocks = (inodes[map->inumber].size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    if (last > nfileblocks)
+    {
+        last = nfileblocks;
+    }
+    // Top the window up in large batches, once half of it has been consumed
+    if (stream->ahead - first > stream->window / 2)
+    {
+        pthread_mutex_unlock(&stream_lock);
+        return;
+    }
+    if (first < stream->ahead)
+    {
+        first = stream->ahead;
+    }
+
+    while (first < last)
+    {
+        int blocknum = inode_map(map, first, 0);
+        if (!blocknum)
+        {
+            break;
+        }
+        int run = 1;
+        while (first + run < last && inode_map(map, first + run, 0) == blocknum + run)
+        {
+            run++;
+        }
+        disk_prefetch(blocknum, run);
+        first += run;
+    }
+    if (first > stream->ahead)
+    {
+        stream->ahead = first;
+    }
+    pthread_mutex_unlock(&stream_lock);
+}
+
+/*
+Compressed files (INODE_COMPRESSED) are written a cluster of
+CLUSTER_BLOCKS file blocks at a time, each write rewriting the
+clusters it touches whole. A cluster that compresses into fewer
+blocks than its data needs keeps only those, at the front of its
+place in the block map, and the rest of its place stays empty; the
+first block starts with the compressed length. Other clusters are
+stored as is. So a cluster is compressed exactly when the map lacks
+a block of it that the file size calls for.
+*/
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_BYTES (CLUSTER_BLOCKS * DISK_BLOCK_SIZE)
+#define CLUSTER_HEADER ((int)sizeof(int))
+
+/* Bytes of cluster c within the file */
+static int cluster_bytes(struct fs_inode *inode, int c)
+{
+    int bytes = inode->size - c * CLUSTER_BYTES;
+    return bytes < 0 ? 0 : bytes > CLUSTER_BYTES ? CLUSTER_BYTES : bytes;
+}
+
+/* Blocks cluster c is stored in: the ones the map has at the front of its place */
+static int cluster_stored(struct fs_blockmap *map, int c)
+{
+    int first = c * CLUSTER_BLOCKS;
+    int n = 0;
+    while (n < CLUSTER_BLOCKS && first + n < map->nblocks && map->blocks[first + n])
+    {
+        n++;
+    }
+    return n;
+}
+
+/* Read or write the first n blocks of cluster c, a run of adjacent blocks per request */
+static void cluster_transfer(struct fs_blockmap *map, int c, int n, char *buffer, int write)
+{
+    int *blocks = &map->blocks[c * CLUSTER_BLOCKS];
+    for (int k = 0; k < n;)
+    {
+        int run = 1;
+        while (k + run < n && blocks[k + run] == blocks[k] + run)
+        {
+            run++;
+        }
+        if (write)
+        {
+            disk_write_range(blocks[k], run, buffer + k * DISK_BLOCK_SIZE);
+        }
+        else
+        {
+            disk_read_range(blocks[k], run, buffer + k * DISK_BLOCK_SIZE);
+        }
+        k += run;
+    }
+}
+
+/* Decompress cluster c, held in its first stored blocks, into buffer; returns 0 if it is damaged */
+static int cluster_unpack(struct fs_blockmap *map, int c, int stored, char *buffer)
+{
+    char packed[CLUSTER_BYTES];
+    int length;
+    cluster_transfer(map, c, stored, packed, 0);
+    memcpy(&length, packed, sizeof(length));
+    return length >= 0 && length <= stored * DISK_BLOCK_SIZE - CLUSTER_HEADER &&
+           lz_decompress(packed + CLUSTER_HEADER, length, buffer, CLUSTER_BYTES) >= 0;
+}
+
+/* Fill buffer with the contents of cluster c, zeros past the end of the file; returns 0 if the cluster is damaged */
+static int cluster_load(struct fs_inode *inode, struct fs_blockmap *map, int c, char *buffer)
+{
+    int needed = (cluster_bytes(inode, c) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    int stored = cluster_stored(map, c);
+    memset(buffer, 0, CLUSTER_BYTES);
+    if (stored >= needed)
+    {
+        cluster_transfer(map, c, needed, buffer, 0);
+        return 1;
+    }
+    return stored > 0 && cluster_unpack(map, c, stored, buffer);
+}
+
+/* The last block of the file before cluster c, 0 if there is none */
+static int cluster_previous(struct fs_blockmap *map, int c)
+{
+    for (int k = c * CLUSTER_BLOCKS - 1; k >= 0 && k >= (c - 1) * CLUSTER_BLOCKS; k--)
+    {
+        if (k < map->nblocks && map->blocks[k])
+        {
+            return map->blocks[k];
+        }
+    }
+    return 0;
+}
+
+/*
+Give cluster c of a map n disk blocks, keeping those it has as far as
+they go and freeing any it no longer needs. New blocks are placed
+after the block before them where possible. Returns 0, leaving the
+cluster as it was, if the disk or the file is full.
+*/
+static int cluster_place(struct fs_inode *inode, struct fs_blockmap *map, int c, int n)
+{
+    int extents = inode->isvalid & INODE_EXTENTS;
+    int limit = extents ? EXTENT_MAX_BLOCKS : POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+    int first = c * CLUSTER_BLOCKS;
+    if (first + n > limit)
+    {
+        return 0;
+    }
+    if (!extents && first + n > POINTERS_PER_INODE && !inode->indirect)
+    {
+        inode->indirect = block_alloc(map->inumber, 0);
+        if (!inode->indirect)
+        {
+            return 0;
+        }
+        blockmap_meta(map, inode->indirect);
+        blockmap_dirty(map);  // the new block holds old data until the pointers are written
+    }
+
+    int stored = cluster_stored(map, c);
+    int keep = stored < n ? stored : n;
+    int fresh[CLUSTER_BLOCKS];
+    int got = 0, runs = 0;
+    int previous = keep > 0 ? map->blocks[first + keep - 1] : cluster_previous(map, c);
+    int goal = previous ? previous + 1 : 0;
+    if (extents)
+    {
+        // Hold the tree blocks for every extent the cluster could add before its data takes them
+        int reserve = extent_nodes(map->nextents + CLUSTER_BLOCKS + 2) - map->nmeta;
+        extent_reserve(map, reserve > 0 ? reserve : 0);
+    }
+    while (keep + got < n)
+    {
+        int len;
+        int start = block_alloc_run(goal, n - keep - got, map->inumber, 0, &len);
+        if (!start)
+        {
+            for (int k = 0; k < got; k++)
+            {
+                block_free(fresh[k]);
+            }
+            if (extents)
+            {
+                extent_reserve_next(map);
+            }
+            return 0;
+        }
+        for (int k = 0; k < len; k++)
+        {
+            fresh[got++] = start + k;
+        }
+        goal = start + len;
+        runs++;
+    }
+    if (stored == n && runs == 0)
+    {
+        if (extents)
+        {
+            extent_reserve_next(map);
+        }
+        return 1;
+    }
+
+    for (int k = keep; k < stored; k++)
+    {
+        block_free(map->blocks[first + k]);
+    }
+    for (int k = 0; k < CLUSTER_BLOCKS && first + k < limit; k++)
+    {
+        int num = k < keep ? map->blocks[first + k] : k < n ? fresh[k - keep] : 0;
+        if (num == 0 && first + k >= map->nblocks)
+        {
+            break;
+        }
+        blockmap_set(map, first + k, num);
+        if (!extents && first + k < POINTERS_PER_INODE)
+        {
+            inode->direct[first + k] = num;
+        }
+        else
+        {
+            blockmap_dirty(map);
+        }
+    }
+    while (map->nblocks > 0 && !map->blocks[map->nblocks - 1])
+    {
+        map->nblocks--;
+    }
+    // Each new run, the gap after the cluster's blocks and the blocks after the gap may start an extent
+    if (extents)
+    {
+        map->nextents += runs + 2;
+        extent_reserve_next(map);
+    }
+    inode_save(map->inumber);
+    return 1;
+}
+
+/* Store the first bytes of buffer, a whole cluster long, as cluster c; returns 0 if there is no room */
+static int cluster_store(struct fs_inode *inode, struct fs_blockmap *map, int c, char *buffer, int bytes)
+{
+    int needed = (bytes + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    char packed[CLUSTER_BYTES];
+    char *out = buffer;
+    int n = needed;
+
+    // Compress only if that saves a block
+    int length = needed > 1 ? lz_compress(buffer, bytes, packed + CLUSTER_HEADER, (needed - 1) * DISK_BLOCK_SIZE - CLUSTER_HEADER) : 0;
+    if (length > 0)
+    {
+        memcpy(packed, &length, sizeof(length));
+        n = (CLUSTER_HEADER + length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+        memset(packed + CLUSTER_HEADER + length, 0, n * DISK_BLOCK_SIZE - CLUSTER_HEADER - length);
+        out = packed;
+    }
+    else
+    {
+        memset(buffer + bytes, 0, needed * DISK_BLOCK_SIZE - bytes);
+    }
+
+    if (!cluster_place(inode, map, c, n))
+    {
+        return 0;
+    }
+    cluster_transfer(map, c, n, out, 1);
+    return 1;
+}
+
+/*
+read_blocks for a compressed file, with the length already cut to the
+file size. A damaged cluster ends the read short, or fails it with -1
+if it is the first the read needs.
+*/
+static int cluster_read(struct fs_inode *inode, struct fs_blockmap *map, char *data, int length, int offset)
+{
+    char buffer[CLUSTER_BYTES];
+    int copied = 0;
+    while (copied < length)
+    {
+        int c = (offset + copied) / CLUSTER_BYTES;
+        int skip = (offset + copied) % CLUSTER_BYTES;
+        int chunk = CLUSTER_BYTES - skip < length - copied ? CLUSTER_BYTES - skip : length - copied;
+        if (!cluster_load(inode, map, c, buffer))
+        {
+            return copied > 0 ? copied : -1;
+        }
+        memcpy(data + copied, buffer + skip, chunk);
+        copied += chunk;
+    }
+    return copied;
+}
+
+/*
+write_blocks for a compressed file, rewriting each cluster the write
+touches. A damaged cluster is left alone rather than rewritten around
+zeros, ending the write short, or failing it with -1 if it is first.
+*/
+static int cluster_write(struct fs_inode *inode, struct fs_blockmap *map, const char *data, int length, int offset)
+{
+    int limit = inode->isvalid & INODE_EXTENTS ? EXTENT_MAX_BLOCKS : POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+    char buffer[CLUSTER_BYTES];
+    int written = 0;
+    while (written < length)
+    {
+        int c = (offset + written) / CLUSTER_BYTES;
+        int skip = (offset + written) % CLUSTER_BYTES;
+        int room = (limit - c * CLUSTER_BLOCKS) * DISK_BLOCK_SIZE;
+        room = room < CLUSTER_BYTES ? room : CLUSTER_BYTES;
+        if (skip >= room)
+        {
+            break;
+        }
+        int chunk = room - skip < length - written ? room - skip : length - written;
+
+        // Only a write that covers what the cluster holds can do without its old contents
+        int bytes = cluster_bytes(inode, c);
+        if ((skip > 0 || chunk < bytes) && !cluster_load(inode, map, c, buffer))
+        {
+            if (written == 0)
+            {
+                written = -1;
+            }
+            break;
+        }
+        memcpy(buffer + skip, data + written, chunk);
+        if (!cluster_store(inode, map, c, buffer, skip + chunk > bytes ? skip + chunk : bytes))
+        {
+            break;
+        }
+
+        written += chunk;
+        if (offset + written > inode->size)
+        {
+            inode->size = offset + written;
+        }
+    }
+    inode_save(map->inumber);
+    return written;
+}
+
+/* Read from a locked inode through its pinned block map */
+static int read_blocks(struct fs_inode *inode, struct fs_blockmap *map, char *data, int length, int offset)
+{
+    if (offset < 0 || offset >= inode->size)
+    {
+        return 0;
+    }
+
+    // Never read past the end of the file
+    if (length > inode->size - offset)
+    {
+        length = inode->size - offset;
+    }
+    if (inode->isvalid & INODE_INLINE)
+    {
+        memcpy(data, inode->contents + offset, length);
+        return length;
+    }
+    if (inode->isvalid & INODE_COMPRESSED)
+    {
+        return cluster_read(inode, map, data, length, offset);
+    }
+
+    // set length copied
+    int length_copied = 0;
+
+    // keep track of which block of the file we are in
+    int pointer_number = offset / DISK_BLOCK_SIZE;
+    int inner_offset = offset - (pointer_number * DISK_BLOCK_SIZE);
+
+    while (length_copied < length)
+    {
+        int blocknum = inode_map(map, pointer_number, 0);
+        if (!blocknum)
+        {
+            // The tail of the file may still be waiting in the delayed buffer
+            int k = pointer_number - map->nblocks;
+            if (k < 0 || k >= map->ndelayed)
+            {
+                break;
+            }
+            int chunk = (map->ndelayed - k) * DISK_BLOCK_SIZE - inner_offset;
+            if (chunk > length - length_copied)
+            {
+                chunk = length - length_copied;
+            }
+            memcpy(data + length_copied, map->delayed + k * DISK_BLOCK_SIZE + inner_offset, chunk);
+            length_copied += chunk;
+            pointer_number = map->nblocks + map->ndelayed;
+            inner_offset = 0;
+            continue;
+        }
+
+        // Extend the run while the file's blocks are adjacent on disk
+        int remaining = (inner_offset + length - length_copied + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+        int run = 1;
+        while (run < remaining && inode_map(map, pointer_number + run, 0) == blocknum + run)
+        {
+            run++;
+        }
+
+        int chunk = run * DISK_BLOCK_SIZE - inner_offset;
+        if (chunk > length - length_copied)
+        {
+            chunk = length - length_copied;
+        }
+        read_run(blocknum, inner_offset, data + length_copied, chunk);
+
+        length_copied += chunk;
+        pointer_number += run;
+        inner_offset = 0;
+    }
+
+    // Start on the blocks a sequential reader will want next, then wait for this read
+    readahead(map, offset, length_copied);
+    disk_drain();
+    return length_copied;
+}
+
+static int read_file(int inumber, char *data, int length, int offset)
+{
+    struct fs_inode *inode = inode_acquire(inumber, 0);
+    if (inode == NULL)
+    {
+        return 0;
+    }
+    struct fs_blockmap *map = blockmap_get(inumber);
+    int result = read_blocks(inode, map, data, length, offset);
+    blockmap_put(map);
+    inode_release(inumber);
+    return result;
+}
+
+int fs_read(int inumber, char *data, int length, int offset)
+{
+    struct stats_span span;
+    stats_begin(&span);
+    int result = read_file(inumber, data, length, offset);
+    stats_end(&span, STATS_FS_READ, result);
+    return result;
+}
+
+/*
+Turn an inline inode into one with blocks, moving its contents to the
+first of them. Returns 0, leaving the inode as it was, if the disk is
+too full to take them.
+*/
+static int inline_spill(struct fs_inode *inode, struct fs_blockmap *map)
+{
+    char contents[INLINE_BYTES];
+    int length = inode->size;
+    memcpy(contents, inode->contents, length);
+    memset(inode->contents, 0, sizeof(inode->contents));
+    inode->isvalid &= ~INODE_INLINE;
+    inode->size = 0;
+    if (write_blocks(inode, map, contents, length, 0) < length)
+    {
+        inode_truncate(map);
+        inode->isvalid |= INODE_INLINE;
+        memcpy(inode->contents, contents, length);
+        inode->size = length;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+Point file block n of a deduplicated file at disk block num in place
+of the block it had, if any. Returns 0 if the indirect block cannot
+be had.
+*/
+static int dedup_map(struct fs_inode *inode, struct fs_blockmap *map, int n, int num)
+{
+    int extents = inode->isvalid & INODE_EXTENTS;
+    if (!extents && n >= POINTERS_PER_INODE && !inode->indirect)
+    {
+        inode->indirect = block_alloc(map->inumber, 0);
+        if (!inode->indirect)
+        {
+            return 0;
+        }
+        blockmap_meta(map, inode->indirect);
+        blockmap_dirty(map);  // the new block holds old data until the pointers are written
+    }
+
+    blockmap_set(map, n, num);
+    if (!extents && n < POINTERS_PER_INODE)
+    {
+        inode->direct[n] = num;
+    }
+    else
+    {
+        blockmap_dirty(map);
+    }
+    // The block may start an extent, and split the one it lands in
+    if (extents)
+    {
+        int previous = n > 0 ? map->blocks[n - 1] : 0;
+        int following = n + 1 < map->nblocks ? map->blocks[n + 1] : 0;
+        map->nextents += (num != previous + 1) + (following && following != num + 1);
+        extent_reserve_next(map);
+    }
+    inode_save(map->inumber);
+    return 1;
+}
+
+/*
+Store the contents of file block n, a whole block, which was held in
+disk block old (0 for none): in a block that already holds them if
+the index has one, in old itself if nothing else refers to it, or
+else in a new block. Returns 0 if the disk or the file is full.
+*/
+static int dedup_store(struct fs_inode *inode, struct fs_blockmap *map, int n, int old, const char *data)
+{
+    unsigned hash = journal_checksum(2166136261u, data);
+    pthread_mutex_lock(&dedup_lock);
+    int num = dedup_find(hash, data);
+    if (num && num == old)
+    {
+        dedup.shares[num]--;
+        pthread_mutex_unlock(&dedup_lock);
+        return 1;
+    }
+    if (num)
+    {
+        pthread_mutex_unlock(&dedup_lock);
+        if (!dedup_map(inode, map, n, num))
+        {
+            block_free(num);
+            return 0;
+        }
+        block_free(old);
+        return 1;
+    }
+    if (old && dedup.shares[old] == 0)
+    {
+        // Out of the index, no other file can take a reference while the block changes
+        dedup_remove(old);
+        pthread_mutex_unlock(&dedup_lock);
+        disk_write(old, data);
+        pthread_mutex_lock(&dedup_lock);
+        dedup_insert(old, hash);
+        pthread_mutex_unlock(&dedup_lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&dedup_lock);
+
+    // Hold the tree blocks for the two extents the block could add before taking it
+    int extents = inode->isvalid & INODE_EXTENTS;
+    if (extents)
+    {
+        int reserve = extent_nodes(map->nextents + 3) - map->nmeta;
+        extent_reserve(map, reserve > 0 ? reserve : 0);
+    }
+    int previous = n > 0 && n <= map->nblocks ? map->blocks[n - 1] : 0;
+    num = block_alloc_near(previous ? previous + 1 : 0, map->inumber);
+    if (!num || !dedup_map(inode, map, n, num))
+    {
+        block_free(num);
+        if (extents)
+        {
+            extent_reserve_next(map);
+        }
+        return 0;
+    }
+    disk_write(num, data);
+    pthread_mutex_lock(&dedup_lock);
+    dedup_insert(num, hash);
+    pthread_mutex_unlock(&dedup_lock);
+    block_free(old);
+    return 1;
+}
+
+/* write_blocks for a deduplicated file, a whole block at a time */
+static int dedup_write(struct fs_inode *inode, struct fs_blockmap *map, const char *data, int length, int offset)
+{
+    int limit = inode->isvalid & INODE_EXTENTS ? EXTENT_MAX_BLOCKS : POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+    union fs_block block;
+    int written = 0;
+    while (written < length)
+    {
+        int n = (offset + written) / DISK_BLOCK_SIZE;
+        int skip = (offset + written) % DISK_BLOCK_SIZE;
+        if (n >= limit)
+        {
+            break;
+        }
+        int chunk = DISK_BLOCK_SIZE - skip < length - written ? DISK_BLOCK_SIZE - skip : length - written;
+
+        // The rest of the block comes from the old one, and is zero past the end of the file, so equal blocks compare equal
+        int old = inode_map(map, n, 0);
+        int end = inode->size - n * DISK_BLOCK_SIZE;
+        end = end < skip + chunk ? skip + chunk : end > DISK_BLOCK_SIZE ? DISK_BLOCK_SIZE : end;
+        if (old && chunk < DISK_BLOCK_SIZE)
+        {
+            disk_read(old, block.data);
+        }
+        memcpy(block.data + skip, data + written, chunk);
+        memset(block.data + end, 0, DISK_BLOCK_SIZE - end);
+        if (!old && skip > 0)
+        {
+            memset(block.data, 0, skip);
+        }
+        if (!dedup_store(inode, map, n, old, block.data))
+        {
+            break;
+        }
+
+        written += chunk;
+        if (offset + written > inode->size)
+        {
+            inode->size = offset + written;
+        }
+    }
+    inode_save(map->inumber);
+    return written;
+}
+
+/* Write to a locked inode through its pinned block map */
+static int write_blocks(struct fs_inode *inode, struct fs_blockmap *map, const char *data, int length, int offset)
+{
+    // Writes may overwrite or extend the file but not leave a hole
+    if (offset < 0 || offset > inode->size)
+    {
+        return 0;
+    }
+    stream_forget(map->inumber);
+    if ((inode->isvalid & INODE_INLINE) && offset + length <= INLINE_BYTES)
+    {
+        memcpy(inode->contents + offset, data, length);
+        if (offset + length > inode->size)
+        {
+            inode->size = offset + length;
+        }
+        inode_save(map->inumber);
+        return length;
+    }
+    if ((inode->isvalid & INODE_INLINE) && !inline_spill(inode, map))
+    {
+        return 0;
+    }
+    if (inode->isvalid & INODE_COMPRESSED)
+    {
+        return cluster_write(inode, map, data, length, offset);
+    }
+    if (inode->isvalid & INODE_DEDUP)
+    {
+        return dedup_write(inode, map, data, length, offset);
+    }
+
+    // Counter for amount of data written
+    int written = 0;
+
+    // Keep track of which block of the file we are in
+    int pointer_number = offset / DISK_BLOCK_SIZE;
+    int inner_offset = offset - (pointer_number * DISK_BLOCK_SIZE);
+
+    // While there is still data to write
+    while (written < length)
+    {
+        // Past the end of the map, buffer small writes; large ones know their run already
+        int remaining = (inner_offset + length - written + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+        if (pointer_number >= map->nblocks)
+        {
+            if (map->ndelayed > 0 || remaining < DELAY_BLOCKS)
+            {
+                int chunk = delay_write(map, pointer_number, inner_offset, data + written, length - written);
+                if (chunk == 0)
+                {
+                    break;
+                }
+                written += chunk;
+                pointer_number = (offset + written) / DISK_BLOCK_SIZE;
+                inner_offset = (offset + written) % DISK_BLOCK_SIZE;
+                continue;
+            }
+            blockmap_extend(map, remaining, 0);
+        }
+
+        int blocknum = inode_map(map, pointer_number, 1);
+        // If there are no more data blocks return the amount written
+        if (!blocknum)
+        {
+            break;
+        }
+
+        // Extend the run while the blocks stay adjacent; any past the map come on the next round
+        int run = 1;
+        while (run < remaining && inode_map(map, pointer_number + run, 0) == blocknum + run)
+        {
+            run++;
+        }
+
+        int chunk = run * DISK_BLOCK_SIZE - inner_offset;
+        if (chunk > length - written)
+        {
+            chunk = length - written;
+        }
+        write_run(blocknum, inner_offset, data + written, chunk, pointer_number, inode->size);
+
+        written += chunk;
+        pointer_number += run;
+        inner_offset = 0;
+    }
+
+    // Wait for the runs still in flight
+    disk_drain();
+
+    // Grow the inode if the write went past its end
+    if (offset + written > inode->size)
+    {
+        inode->size = offset + written;
+    }
+    inode_save(map->inumber);
+    return written;
+}
+
+static int write_file(int inumber, const char *data, int length, int offset)
+{
+    struct fs_inode *inode = inode_acquire(inumber, 1);
+    if (inode == NULL)
+    {
+        return -1;
+    }
+
+    // Clear all data blocks when writing to the start of an inode
+    struct fs_blockmap *map = blockmap_get(inumber);
+    if (offset == 0)
+    {
+        inode_truncate(map);
+    }
+    int result = write_blocks(inode, map, data, length, offset);
+    blockmap_put(map);
+    inode_release(inumber);
+    return result;
+}
+
+int fs_write(int inumber, const char *data, int length, int offset)
+{
+    struct stats_span span;
+    stats_begin(&span);
+    int result = write_file(inumber, data, length, offset);
+    stats_end(&span, STATS_FS_WRITE, result);
+    return result;
+}
+
+/*
+Open files. A handle pins the block map of its inode until it is
+closed, so calls through it skip the map lookup, and fs_append writes
+at the end of the file under the inode's lock. Handles pin at most
+half of the map slots, leaving the rest to fs_read and fs_write.
+Closing a handle writes its map back; the inode itself is written by
+fs_sync or fs_unmount, as for any other change.
+*/
+#define FS_HANDLES (BLOCKMAP_SLOTS / 2)
+
+struct fs_handle
+{
+    int inumber;  /* 0 for a closed handle */
+    struct fs_blockmap *map;
+};
+
+static struct fs_handle handles[FS_HANDLES];
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+Like inode_acquire, for the inode of an open handle, also returning
+the handle's map. Returns NULL, with nothing locked, if the handle is
+not open.
+*/
+static struct fs_inode *handle_acquire(int fd, int write, struct fs_blockmap **map)
+{
+    if (fd < 0 || fd >= FS_HANDLES)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&handle_lock);
+    int inumber = handles[fd].inumber;
+    pthread_mutex_unlock(&handle_lock);
+    struct fs_inode *inode = inumber ? inode_acquire(inumber, write) : NULL;
+    if (inode == NULL)
+    {
+        return NULL;
+    }
+
+    // The handle may have been closed, or its file deleted, in the meantime
+    pthread_mutex_lock(&handle_lock);
+    *map = handles[fd].inumber == inumber ? handles[fd].map : NULL;
+    pthread_mutex_unlock(&handle_lock);
+    if (*map == NULL)
+    {
+        inode_release(inumber);
+        return NULL;
+    }
+    return inode;
+}
+
+/* Close every handle on inumber, or on every inode if it is 0 */
+static void handle_forget(int inumber)
+{
+    pthread_mutex_lock(&handle_lock);
+    for (int i = 0; i < FS_HANDLES; i++)
+    {
+        if (handles[i].inumber && (!inumber || handles[i].inumber == inumber))
+        {
+            blockmap_put(handles[i].map);
+            handles[i].inumber = 0;
+            handles[i].map = NULL;
+        }
+    }
+    pthread_mutex_unlock(&handle_lock);
+}
+
+/* Pin the maps of the open handles again after blockmap_reset, closing those whose file is gone */
+static void handle_reload()
+{
+    pthread_mutex_lock(&handle_lock);
+    for (int i = 0; i < FS_HANDLES; i++)
+    {
+        if (handles[i].inumber && !inodes[handles[i].inumber].isvalid)
+        {
+            handles[i].inumber = 0;
+        }
+        handles[i].map = handles[i].inumber ? blockmap_get(handles[i].inumber) : NULL;
+    }
+    pthread_mutex_unlock(&handle_lock);
+}
+
+static int open_file(int inumber, int flags)
+{
+    int truncate = flags & FS_OPEN_TRUNCATE;
+    struct fs_inode *inode = inode_acquire(inumber, truncate);
+    if (inode == NULL)
+    {
+        return -1;
+    }
+    struct fs_blockmap *map = blockmap_get(inumber);
+    if (truncate)
+    {
+        stream_forget(inumber);
+        inode_truncate(map);
+        inode_save(inumber);
+    }
+
+    pthread_mutex_lock(&handle_lock);
+    int fd = 0;
+    while (fd < FS_HANDLES && handles[fd].inumber)
+    {
+        fd++;
+    }
+    if (fd < FS_HANDLES)
+    {
+        handles[fd].inumber = inumber;
+        handles[fd].map = map;
+    }
+    pthread_mutex_unlock(&handle_lock);
+
+    if (fd == FS_HANDLES)
+    {
+        blockmap_put(map);
+        fd = -1;
+    }
+    inode_release(inumber);
+    return fd;
+}
+
+int fs_open(int inumber, int flags)
+{
+    struct stats_span span;
+    stats_begin(&span);
+    int result = open_file(inumber, flags);
+    stats_end(&span, STATS_FS_OPEN, 0);
+    return result;
+}
+
+static int pread_file(int fd, char *data, int length, int offset)
+{
+    struct fs_blockmap *map;
+    struct fs_inode *inode = handle_acquire(fd, 0, &map);
+    if (inode == NULL)
+    {
+        return 0;
+    }
+    int result = read_blocks(inode, map, data, length, offset);
+    inode_release(map->inumber);
+    return result;
+}
+
+int fs_pread(int fd, char *data, int length, int offset)
+{
+    struct stats_span span;
+    stats_begin(&span);
+    int result = pread_file(fd, data, length, offset);
+    stats_end(&span, STATS_FS_READ, result);
+    return result;
+}
+
+/* Write through a handle at offset, or at the end of the file if append is set */
+static int pwrite_file(int fd, const char *data, int length, int offset, int append)
+{
+    struct fs_blockmap *map;
+    struct fs_inode *inode = handle_acquire(fd, 1, &map);
+    if (inode == NULL)
+    {
+        return -1;
+    }
+    int result = write_blocks(inode, map, data, length, append ? inode->size : offset);
+    inode_release(map->inumber);
+    return result;
+}
+
+int fs_pwrite(int fd, const char *data, int length, int offset)
+{
+    struct stats_span span;
+    stats_begin(&span);
+    int result = pwrite_file(fd, data, length, offset, 0);
+    stats_end(&span, STATS_FS_WRITE, result);
+    return result;
+}
+
+int fs_append(int fd, const char *data, int length)
+{
+    struct stats_span span;
+    stats_begin(&span);
+    int result = pwrite_file(fd, data, length, 0, 1);
+    stats_end(&span, STATS_FS_WRITE, result);
+    return result;
+}
+
+static int close_file(int fd)
+{
+    struct fs_blockmap *map;
+    struct fs_inode *inode = handle_acquire(fd, 1, &map);
+    if (inode == NULL)
+    {
+        return 0;
+    }
+    int inumber = map->inumber;
+    blockmap_store(map);
+
+    pthread_mutex_lock(&handle_lock);
+    handles[fd].inumber = 0;
+    handles[fd].map = NULL;
+    pthread_mutex_unlock(&handle_lock);
+    blockmap_put(map);
+    inode_release(inumber);
+    return 1;
+}
+
+int fs_close(int fd)
+{
+    struct stats_span span;
+    stats_begin(&span);
+    int result = close_file(fd);
+    stats_end(&span, STATS_FS_CLOSE, 0);
+    return result;
+}
+
+/*
+fs_check verifies the mounted filesystem as it stands on disk, reading
+each indirect block and extent tree node once. The first pass, split
+across threads with FS_CHECK_PARALLEL, walks the block map of every
+file and claims its blocks in check_owner, which ends up holding the
+lowest-numbered inode to claim each block. Files with a problem, or
+that lost a block to a lower-numbered file, are marked suspect. The
+second pass walks the suspect files again, in order, and reports what
+is wrong with each. With FS_CHECK_REPAIR it also cuts each of them
+short before its first bad block, and rewrites the block bitmap to
+hold exactly the blocks that some file keeps. The data blocks of
+deduplicated files are not claimed but counted in check_refs; a file
+that claims one of them for itself loses it, and the counts must
+match the references the filesystem keeps.
+*/
+static int *check_owner = NULL;     // per block: 1 + the inode that keeps it, 0 for none
+static char *check_suspect = NULL;  // per inode
+static int *check_refs = NULL;      // per block: references from deduplicated files, with FEATURE_DEDUP
+
+struct fs_check_file
+{
+    int inumber;
+    int report;    /* print each problem: second pass */
+    int problems;
+    int keep;      /* leading file blocks that can be kept */
+    struct fs_blockmap map;
+};
+
+struct fs_check_slice
+{
+    int first;  /* inode blocks [first, last) of the table */
+    int last;
+};
+
+static int check_range(int num)
+{
+    return num >= datastart && num < super.nblocks;
+}
+
+static void check_problem(struct fs_check_file *f, const char *fmt, ...)
+{
+    f->problems++;
+    if (!f->report)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    printf("check: inode %d: ", f->inumber);
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+static void check_cut(struct fs_check_file *f, int n)
+{
+    if (n < f->keep)
+    {
+        f->keep = n;
+    }
+}
+
+/* Load an extent tree node like extent_node_load, reporting what cannot be used */
+static void check_node(struct fs_check_file *f, int blocknum, int limit)
+{
+    if (!check_range(blocknum))
+    {
+        check_problem(f, "extent tree block %d is out of range", blocknum);
+        check_cut(f, f->map.nblocks);
+        return;
+    }
+
+    union fs_block block;
+    disk_read(blocknum, block.data);
+    struct fs_extent_node *node = &block.node;
+    int max = node->depth == 0 ? EXTENTS_PER_NODE : CHILDREN_PER_NODE;
+    if (node->depth < 0 || node->depth >= limit || node->count < 0 || node->count > max)
+    {
+        check_problem(f, "extent tree block %d is corrupt", blocknum);
+        check_cut(f, f->map.nblocks);
+        return;
+    }
+
+    blockmap_meta(&f->map, blocknum);
+    for (int k = 0; k < node->count; k++)
+    {
+        if (node->depth == 0)
+        {
+            extent_append(&f->map, &node->extent[k]);
+        }
+        else
+        {
+            check_node(f, node->child[k], node->depth);
+        }
+    }
+}
+
+/*
+Read the block map of a file and find how many of its blocks can be
+kept, given the blocks its size calls for. The indirect block may be
+passed in already read.
+*/
+static void check_walk(struct fs_check_file *f, const union fs_block *indirect)
+{
+    struct fs_inode *inode = &inodes[f->inumber];
+    struct fs_blockmap *map = &f->map;
+    map->nblocks = 0;
+    map->nmeta = 0;
+    map->nextents = 0;
+    f->problems = 0;
+    f->keep = INT_MAX;
+
+    if (inode->isvalid & ~(INODE_VALID | INODE_EXTENTS | INODE_INLINE | INODE_COMPRESSED | INODE_DEDUP))
+    {
+        check_problem(f, "has unknown flags %#x", inode->isvalid);
+    }
+
+    if (inode->isvalid & INODE_INLINE)
+    {
+        if (inode->size < 0 || inode->size > INLINE_BYTES)
+        {
+            check_problem(f, "has %d bytes in the inode", inode->size);
+        }
+        f->keep = 0;
+        return;
+    }
+
+    if (inode->isvalid & INODE_EXTENTS)
+    {
+        if (inode->tree)
+        {
+            check_node(f, inode->tree, EXTENT_MAX_DEPTH);
+        }
+        else
+        {
+            if (inode->nextents < 0 || inode->nextents > EXTENTS_PER_INODE)
+            {
+                check_problem(f, "has %d extents in the inode", inode->nextents);
+            }
+            for (int k = 0; k < inode->nextents && k < EXTENTS_PER_INODE; k++)
+            {
+                extent_append(map, &inode->extent[k]);
+            }
+        }
+    }
+    else
+    {
+        for (int k = 0; k < POINTERS_PER_INODE; k++)
+        {
+            blockmap_set(map, k, inode->direct[k]);
+        }
+        if (inode->indirect && !check_range(inode->indirect))
+        {
+            check_problem(f, "indirect block %d is out of range", inode->indirect);
+            check_cut(f, POINTERS_PER_INODE);
+        }
+        else if (inode->indirect)
+        {
+            union fs_block block;
+            if (indirect == NULL)
+            {
+                disk_read(inode->indirect, block.data);
+                indirect = &block;
+            }
+            blockmap_meta(map, inode->indirect);
+            for (int k = 0; k < POINTERS_PER_BLOCK; k++)
+            {
+                blockmap_set(map, POINTERS_PER_INODE + k, indirect->pointers[k]);
+            }
+        }
+    }
+
+    // Every block up to the size must be there, and none past it, but for the gaps compressed clusters leave
+    if (inode->size < 0)
+    {
+        check_problem(f, "has negative size %d", inode->size);
+    }
+    int needed = inode->size > 0 ? (inode->size - 1) / DISK_BLOCK_SIZE + 1 : 0;
+    int compressed = inode->isvalid & INODE_COMPRESSED;
+    if (compressed && map->nblocks < needed && needed <= (inode->isvalid & INODE_EXTENTS ? EXTENT_MAX_BLOCKS : POINTERS_PER_INODE + POINTERS_PER_BLOCK))
+    {
+        blockmap_set(map, needed - 1, 0);
+    }
+    for (int k = 0; k < needed && k < f->keep; k++)
+    {
+        int num = k < map->nblocks ? map->blocks[k] : 0;
+        if (num == 0 && (!compressed || k % CLUSTER_BLOCKS == 0))
+        {
+            check_problem(f, "size is %d bytes but file block %d is missing", inode->size, k);
+            check_cut(f, k);
+        }
+        else if (num == 0)
+        {
+            continue;
+        }
+        else if (!check_range(num))
+        {
+            check_problem(f, "block %d at file block %d is out of range", num, k);
+            check_cut(f, k);
+        }
+        else if (compressed && k % CLUSTER_BLOCKS != 0 && map->blocks[k - 1] == 0)
+        {
+            check_problem(f, "block %d at file block %d follows a gap in its cluster", num, k);
+            check_cut(f, k);
+        }
+    }
+    for (int k = needed; k < map->nblocks; k++)
+    {
+        if (map->blocks[k])
+        {
+            check_problem(f, "has blocks past its size of %d bytes", inode->size);
+            break;
+        }
+    }
+    check_cut(f, needed);
+
+    // A compressed cluster must decompress, or reading it fails
+    for (int c = 0; compressed && c * CLUSTER_BLOCKS < f->keep; c++)
+    {
+        char buffer[CLUSTER_BYTES];
+        int stored = cluster_stored(map, c);
+        int bytes = cluster_bytes(inode, c);
+        if (stored > 0 && stored * DISK_BLOCK_SIZE < bytes && c * CLUSTER_BLOCKS + stored <= f->keep &&
+            !cluster_unpack(map, c, stored, buffer))
+        {
+            check_problem(f, "cluster %d at file block %d does not decompress", c, c * CLUSTER_BLOCKS);
+            check_cut(f, c * CLUSTER_BLOCKS);
+        }
+    }
+}
+
+/* Make inumber the owner of num unless a lower-numbered inode already is */
+static void check_claim(int num, int inumber)
+{
+    int owner = __atomic_load_n(&check_owner[num], __ATOMIC_RELAXED);
+    while (1)
+    {
+        if (owner == inumber + 1 || (owner != 0 && owner < inumber + 1))
+        {
+            // Listed twice by this file, or already kept by a lower one
+            __atomic_store_n(&check_suspect[inumber], 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (__atomic_compare_exchange_n(&check_owner[num], &owner, inumber + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            if (owner != 0)
+            {
+                __atomic_store_n(&check_suspect[owner - 1], 1, __ATOMIC_RELAXED);
+            }
+            if (check_refs != NULL && __atomic_load_n(&check_refs[num], __ATOMIC_SEQ_CST) > 0)
+            {
+                __atomic_store_n(&check_suspect[inumber], 1, __ATOMIC_RELAXED);
+            }
+            return;
+        }
+    }
+}
+
+/* Count a reference to num from a deduplicated file, making suspect any file that claims it for itself */
+static void check_share(int num)
+{
+    __atomic_add_fetch(&check_refs[num], 1, __ATOMIC_SEQ_CST);
+    int owner = __atomic_load_n(&check_owner[num], __ATOMIC_SEQ_CST);
+    if (owner != 0)
+    {
+        __atomic_store_n(&check_suspect[owner - 1], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void check_first(struct fs_check_file *f, int inumber, const union fs_block *indirect)
+{
+    f->inumber = inumber;
+    f->report = 0;
+    check_walk(f, indirect);
+    if (f->problems)
+    {
+        __atomic_store_n(&check_suspect[inumber], 1, __ATOMIC_RELAXED);
+    }
+    for (int k = 0; k < f->map.nmeta; k++)
+    {
+        check_claim(f->map.meta[k], inumber);
+    }
+    int shared = check_refs != NULL && (inodes[inumber].isvalid & INODE_DEDUP);
+    for (int k = 0; k < f->keep; k++)
+    {
+        if (f->map.blocks[k] && shared)
+        {
+            check_share(f->map.blocks[k]);
+        }
+        else if (f->map.blocks[k])
+        {
+            check_claim(f->map.blocks[k], inumber);
+        }
+    }
+}
+
+/* First pass over a slice of the inode table, reading indirect blocks a batch at a time as mount does */
+static void *check_worker(void *arg)
+{
+    struct fs_check_slice *slice = (struct fs_check_slice *)arg;
+    union fs_block *batch = (union fs_block *)malloc(SCAN_BATCH * sizeof(union fs_block));
+    int waiting[SCAN_BATCH];
+    int n = 0;
+    struct fs_check_file f;
+    memset(&f, 0, sizeof(f));
+
+    for (int i = slice->first * INODES_PER_BLOCK; i <= slice->last * INODES_PER_BLOCK; i++)
+    {
+        if (n == SCAN_BATCH || (n > 0 && i == slice->last * INODES_PER_BLOCK))
+        {
+            disk_drain();
+            for (int k = 0; k < n; k++)
+            {
+                check_first(&f, waiting[k], &batch[k]);
+            }
+            n = 0;
+        }
+        if (i == slice->last * INODES_PER_BLOCK)
+        {
+            break;
+        }
+
+        struct fs_inode *inode = &inodes[i];
+        if (!inode->isvalid)
+        {
+            continue;
+        }
+        if (!(inode->isvalid & (INODE_EXTENTS | INODE_INLINE)) && check_range(inode->indirect))
+        {
+            struct iovec iov;
+            iov.iov_base = batch[n].data;
+            iov.iov_len = DISK_BLOCK_SIZE;
+            disk_submit_read(inode->indirect, &iov, 1);
+            waiting[n++] = i;
+            continue;
+        }
+        check_first(&f, i, NULL);
+    }
+
+    free(batch);
+    free(f.map.blocks);
+    free(f.map.meta);
+    return NULL;
+}
+
+/* Cut a file back to the blocks it keeps, and own exactly those */
+static void check_fix(struct fs_check_file *f, int found)
+{
+    struct fs_inode *inode = &inodes[f->inumber];
+    struct fs_blockmap *map = &f->map;
+    int owner = f->inumber + 1;
+    int shared = check_refs != NULL && (inode->isvalid & INODE_DEDUP);
+
+    // Let go of everything the file claimed in the first pass
+    for (int k = 0; k < map->nmeta; k++)
+    {
+        check_owner[map->meta[k]] = 0;
+    }
+    for (int k = 0; k < found; k++)
+    {
+        if (map->blocks[k] && shared)
+        {
+            check_refs[map->blocks[k]]--;
+        }
+        else if (map->blocks[k] && check_owner[map->blocks[k]] == owner)
+        {
+            check_owner[map->blocks[k]] = 0;
+        }
+    }
+
+    // A compressed cluster cut short cannot be read, so it goes as a whole
+    int needed = inode->size > 0 ? (inode->size - 1) / DISK_BLOCK_SIZE + 1 : 0;
+    if ((inode->isvalid & INODE_COMPRESSED) && f->keep < needed)
+    {
+        f->keep -= f->keep % CLUSTER_BLOCKS;
+    }
+
+    if (inode->isvalid & INODE_INLINE)
+    {
+        // Nothing but the size can be wrong
+        if (inode->size < 0 || inode->size > INLINE_BYTES)
+        {
+            inode->size = inode->size < 0 ? 0 : INLINE_BYTES;
+        }
+    }
+    else if (inode->isvalid & INODE_EXTENTS)
+    {
+        map->inumber = f->inumber;
+        map->nblocks = f->keep;
+        map->dirty = 1;
+        extents_store(map);
+        if (map->dirty)
+        {
+            // No room to rebuild the tree: give up the file's data
+            f->keep = 0;
+            map->nblocks = 0;
+            extents_store(map);
+        }
+        extent_reserve(map, 0);
+    }
+    else
+    {
+        for (int k = 0; k < POINTERS_PER_INODE; k++)
+        {
+            inode->direct[k] = k < f->keep ? map->blocks[k] : 0;
+        }
+        if (f->keep > POINTERS_PER_INODE && inode->indirect)
+        {
+            union fs_block block;
+            memset(block.data, 0, sizeof(block.data));
+            for (int k = POINTERS_PER_INODE; k < f->keep; k++)
+            {
+                block.pointers[k - POINTERS_PER_INODE] = map->blocks[k];
+            }
+            meta_write(inode->indirect, block.data);
+        }
+        else
+        {
+            inode->indirect = 0;
+            map->nmeta = 0;
+        }
+    }
+
+    for (int k = 0; k < map->nmeta; k++)
+    {
+        check_owner[map->meta[k]] = owner;
+    }
+    for (int k = 0; k < f->keep; k++)
+    {
+        if (map->blocks[k] && shared)
+        {
+            check_refs[map->blocks[k]]++;
+        }
+        else if (map->blocks[k])
+        {
+            check_owner[map->blocks[k]] = owner;
+        }
+    }
+
+    if (!(inode->isvalid & INODE_INLINE) && (inode->size > f->keep * DISK_BLOCK_SIZE || inode->size < 0))
+    {
+        inode->size = f->keep * DISK_BLOCK_SIZE;
+    }
+    inode->isvalid &= INODE_VALID | INODE_EXTENTS | INODE_INLINE | INODE_COMPRESSED | INODE_DEDUP;
+    inode_save(f->inumber);
+    printf("check: inode %d: repaired, now %d bytes\n", f->inumber, inode->size);
+}
+
+/* Second pass over one suspect file; returns the number of problems found */
+static int check_second(struct fs_check_file *f, int inumber, int repair)
+{
+    struct fs_blockmap *map = &f->map;
+    int owner = inumber + 1;
+
+    f->inumber = inumber;
+    f->report = 1;
+    check_walk(f, NULL);
+    int found = f->keep;
+
+    // The blocks holding the map must be this file's, and listed once
+    int nmeta = 0;
+    for (int k = 0; k < map->nmeta; k++)
+    {
+        int num = map->meta[k];
+        if (check_refs != NULL && check_refs[num] > 0)
+        {
+            check_problem(f, "block %d of its block map is also data of a deduplicated file", num);
+            if (!(inodes[inumber].isvalid & INODE_EXTENTS))
+            {
+                check_cut(f, POINTERS_PER_INODE);
+            }
+            continue;
+        }
+        if (check_owner[num] == 0)
+        {
+            check_owner[num] = owner;  // released by a file repaired before this one
+        }
+        if (check_owner[num] == owner)
+        {
+            check_owner[num] = -owner;
+            map->meta[nmeta++] = num;
+        }
+        else if (check_owner[num] == -owner)
+        {
+            check_problem(f, "block %d of its block map is listed twice", num);
+        }
+        else
+        {
+            check_problem(f, "block %d of its block map is also used by inode %d", num, check_owner[num] - 1);
+            if (!(inodes[inumber].isvalid & INODE_EXTENTS))
+            {
+                check_cut(f, POINTERS_PER_INODE);
+            }
+        }
+    }
+    map->nmeta = nmeta;
+
+    // Keep the data blocks up to the first that is not this file's alone; those of deduplicated files are counted
+    for (int k = 0; k < f->keep; k++)
+    {
+        int num = map->blocks[k];
+        if (num == 0 || (check_refs != NULL && (inodes[inumber].isvalid & INODE_DEDUP)))
+        {
+            continue;  // a gap after a compressed cluster, or a block that may be shared
+        }
+        if (check_refs != NULL && check_refs[num] > 0)
+        {
+            check_problem(f, "block %d at file block %d is also data of a deduplicated file", num, k);
+            check_cut(f, k);
+            continue;
+        }
+        if (check_owner[num] == 0)
+        {
+            check_owner[num] = owner;
+        }
+        if (check_owner[num] == -owner)
+        {
+            check_problem(f, "block %d at file block %d is listed twice", num, k);
+            check_cut(f, k);
+        }
+        else if (check_owner[num] != owner)
+        {
+            check_problem(f, "block %d at file block %d is also used by inode %d", num, k, check_owner[num] - 1);
+            check_cut(f, k);
+        }
+        else
+        {
+            check_owner[num] = -owner;
+        }
+    }
+
+    // Undo the marks that found the duplicates
+    for (int k = 0; k < map->nmeta; k++)
+    {
+        check_owner[map->meta[k]] = owner;
+    }
+    for (int k = 0; k < found; k++)
+    {
+        if (map->blocks[k] && check_owner[map->blocks[k]] == -owner)
+        {
+            check_owner[map->blocks[k]] = owner;
+        }
+    }
+
+    if (f->problems > 0 && repair)
+    {
+        check_fix(f, found);
+    }
+    return f->problems;
+}
+
+static int check_super()
+{
+    int problems = 0;
+    if (super.nblocks != disk_size())
+    {
+        printf("check: superblock: %d blocks, but the disk has %d\n", super.nblocks, disk_size());
+        problems++;
+    }
+    // Older formats gave nblocks / 10 + 1 blocks to inodes, so only the layout is checked
+    if (super.ninodeblocks <= 0 || datastart >= super.nblocks || super.ninodes != super.ninodeblocks * INODES_PER_BLOCK)
+    {
+        printf("check: superblock: %d inode blocks with %d inodes do not fit %d blocks\n", super.ninodeblocks, super.ninodes, super.nblocks);
+        problems++;
+    }
+    if (super.nbitmapblocks != 0 && super.nbitmapblocks != BITMAP_BLOCKS(super.nblocks))
+    {
+        printf("check: superblock: %d bitmap blocks, not %d\n", super.nbitmapblocks, BITMAP_BLOCKS(super.nblocks));
+        problems++;
+    }
+    if (super.features & ~(FEATURE_EXTENTS | FEATURE_JOURNAL | FEATURE_INLINE | FEATURE_COMPRESS | FEATURE_DEDUP))
+    {
+        printf("check: superblock: unknown features %#x\n", super.features);
+        problems++;
+    }
+    if (super.features & FEATURE_JOURNAL ? super.journalblocks < JOURNAL_MIN_BLOCKS : super.journalblocks != 0)
+    {
+        printf("check: superblock: %d journal blocks\n", super.journalblocks);
+        problems++;
+    }
+    return problems;
+}
+
+/* Compare the block bitmap with the blocks the files keep */
+static int check_bitmap()
+{
+    int leaked = 0, unmarked = 0;
+    for (int i = datastart; i < super.nblocks; i++)
+    {
+        int kept = check_owner[i] || (check_refs != NULL && check_refs[i] > 0);
+        if (bitmap_test(&bitmap, i) && !kept)
+        {
+            leaked++;
+        }
+        else if (!bitmap_test(&bitmap, i) && kept)
+        {
+            unmarked++;
+        }
+    }
+    if (leaked)
+    {
+        printf("check: %d blocks are marked used but no file keeps them\n", leaked);
+    }
+    if (unmarked)
+    {
+        printf("check: %d blocks in use are marked free\n", unmarked);
+    }
+    return (leaked > 0) + (unmarked > 0);
+}
+
+/* Compare the references counted in check_refs with those the filesystem keeps, and with repair take the counted ones */
+static int check_shares(int repair)
+{
+    int wrong = 0;
+    for (int i = 0; i < super.nblocks; i++)
+    {
+        int refs = check_refs[i] > DEDUP_MAX_SHARES + 1 ? DEDUP_MAX_SHARES + 1 : check_refs[i];
+        int shares = refs > 1 ? refs - 1 : 0;
+        if (dedup.shares[i] != shares)
+        {
+            wrong++;
+            if (repair)
+            {
+                dedup.shares[i] = shares;
+            }
+        }
+    }
+    if (wrong)
+    {
+        printf("check: %d blocks have the wrong number of references\n", wrong);
+    }
+    return wrong > 0;
+}
+
+/* Make the block bitmap hold the metadata and the blocks the files keep */
+static void check_rebuild()
+{
+    memset(bitmap.words, 0, BITMAP_WORDS(bitmap.nbits) * sizeof(uint64_t));
+    for (int i = 0; i < super.nblocks; i++)
+    {
+        if (i < datastart || check_owner[i] || (check_refs != NULL && check_refs[i] > 0))
+        {
+            bitmap.words[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+    }
+    bitmap_recount(&bitmap);
+    if (bitmap.dirty != NULL)
+    {
+        memset(bitmap.dirty, 1, BITMAP_BLOCKS(bitmap.nbits));
+    }
+}
+
+int fs_check(int flags)
+{
+    struct stats_span span;
+    stats_begin(&span);
+    pthread_rwlock_wrlock(&fs_lock);
+    if (inodes == NULL)
+    {
+        pthread_rwlock_unlock(&fs_lock);
+        stats_end(&span, STATS_FS_CHECK, 0);
+        return -1;
+    }
+
+    // Work from the disk alone: write back and forget the cached block maps
+    blockmap_flush();
+    blockmap_reset();
+    journal_checkpoint();
+    memset(streams, 0, sizeof(streams));
+
+    int repair = flags & FS_CHECK_REPAIR;
+    int problems = check_super();
+    check_owner = (int *)calloc(super.nblocks, sizeof(int));
+    check_suspect = (char *)calloc(super.ninodes, sizeof(char));
+    check_refs = dedup.shares != NULL ? (int *)calloc(super.nblocks, sizeof(int)) : NULL;
+
+    int nworkers = flags & FS_CHECK_PARALLEL ? scan_threads() : 1;
+    struct fs_check_slice slices[SCAN_THREADS];
+    for (int w = 0; w < nworkers; w++)
+    {
+        slices[w].first = (int)((long long)super.ninodeblocks * w / nworkers);
+        slices[w].last = (int)((long long)super.ninodeblocks * (w + 1) / nworkers);
+    }
+    scan_run(check_worker, slices, sizeof(slices[0]), nworkers);
+
+    // Let repairs allocate only blocks that no file claims
+    problems += check_bitmap();
+    if (repair)
+    {
+        check_rebuild();
+    }
+
+    struct fs_check_file f;
+    memset(&f, 0, sizeof(f));
+    int nrepaired = 0;
+    for (int i = 0; i < super.ninodes; i++)
+    {
+        if (check_suspect[i] && check_second(&f, i, repair) > 0)
+        {
+            problems += f.problems;
+            nrepaired += repair;
+        }
+    }
+    free(f.map.blocks);
+    free(f.map.meta);
+    if (check_refs != NULL)
+    {
+        problems += check_shares(repair);
+    }
+
+    if (repair && problems > 0)
+    {
+        // Blocks the repairs freed may still be in the index
+        dedup_forget();
+        check_rebuild();
+        inode_flush();
+        journal_checkpoint();
+        bitmap_flush(&bitmap, 1 + super.ninodeblocks);
+        disk_sync();
+    }
+
+    if (problems == 0)
+    {
+        printf("check: no problems found\n");
+    }
+    else if (repair)
+    {
+        printf("check: %d problems found, %d files repaired\n", problems, nrepaired);
+    }
+    else
+    {
+        printf("check: %d problems found\n", problems);
+    }
+
+    free(check_owner);
+    free(check_suspect);
+    free(check_refs);
+    check_owner = NULL;
+    check_refs = NULL;
+    check_suspect = NULL;
+    handle_reload();
+    pthread_rwlock_unlock(&fs_lock);
+    stats_end(&span, STATS_FS_CHECK, 0);
+    return problems;
+}
@@ -1,9 +1,27 @@
 #ifndef FS_H
 #define FS_H
 
+#define FS_FORMAT_WIPE     1  /* zero every data block, not just the metadata */
+#define FS_FORMAT_EXTENTS  2  /* store files as extents, with no 1029-block size limit */
+#define FS_FORMAT_JOURNAL  4  /* write metadata through a journal, so a crash leaves it consistent */
+#define FS_FORMAT_INLINE   8  /* keep the contents of small files in their inodes */
+#define FS_FORMAT_COMPRESS 16 /* store file data compressed, a few blocks at a time */
+#define FS_FORMAT_DEDUP    32 /* store blocks with the same contents once */
+
+#define FS_CHECK_REPAIR   1  /* cut damaged files short and rewrite the bitmap */
+#define FS_CHECK_PARALLEL 2  /* walk the inode table with several threads */
+
+#define FS_OPEN_TRUNCATE  1  /* empty the file on open */
+
 void fs_debug();
+void fs_summary();
+int  fs_check( int flags );
 int  fs_format();
+int  fs_format_flags( int flags );
 int  fs_mount();
+int  fs_sync();
+int  fs_unmount();
+int  fs_freeblocks();
 
 int  fs_create();
 int  fs_delete( int inumber );
@@ -12,4 +30,10 @@ int  fs_getsize();
 int  fs_read( int inumber, char *data, int length, int offset );
 int  fs_write( int inumber, const char *data, int length, int offset );
 
+int  fs_open( int inumber, int flags );
+int  fs_pread( int fd, char *data, int length, int offset );
+int  fs_pwrite( int fd, const char *data, int length, int offset );
+int  fs_append( int fd, const char *data, int length );
+int  fs_close( int fd );
+
 #endif
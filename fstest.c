@@ -0,0 +1,712 @@
+/*
+Tests for the simplefs library.
+
+Each test works on a scratch image of its own and ends by printing
+whether it passed; the exit status is 0 only if every test did.
+
+journal_overflow writes files that change many times more metadata
+than the journal holds, without ever syncing, then stops as a crash
+would. Group commit must have committed the metadata as it went, so
+mounting again replays the journal and finds all but the last few
+files intact. The disk cache is big enough that nothing but the
+commits themselves reaches the image before the crash.
+
+The check_ tests write two files, then damage the image while it is
+unmounted: a block claimed by both files, a used block no file has,
+a size past the blocks of its file, and a block in use marked free.
+fs_check must find the damage, repair it, and find nothing on a
+second pass or after a remount.
+
+The round-trip tests write, rewrite and read back files of one kind,
+and require a clean check and the same contents after a remount:
+inline grows a file in its inode past the INLINE_BYTES it holds and
+cuts it back; compress rewrites parts of clusters of a compressed
+file and cuts it short; dedup writes two files with the same blocks,
+which must share them until the last of the two is deleted.
+
+append grows two files in turn by small appends. Delayed allocation
+must still give each file one run of adjacent blocks, which the test
+reads from the inodes and indirect blocks of the unmounted image.
+
+stress runs the shell's multi-threaded stress test on each backend and
+then checks the filesystem. Its seed is printed, and can be given as
+the argument to replay a failing run's operations.
+*/
+
+#include "fs.h"
+#include "disk.h"
+#include "stress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define TEST_SCRATCH "test.scratch"
+#define TEST_BLOCKS 2000
+#define TEST_FILES 150
+#define TEST_FILE_SIZE (8*DISK_BLOCK_SIZE)	/* past the direct pointers, so each file has an indirect block */
+#define TEST_STRESS_THREADS 8
+#define TEST_STRESS_OPS 400
+
+static unsigned test_seed;
+
+/* The parts of the on-disk layout the check_ tests damage, as fs.c lays them out */
+#define TEST_INODES_PER_BLOCK 128
+#define TEST_BITS_PER_BLOCK (DISK_BLOCK_SIZE*8)
+
+struct test_super {
+	int magic;
+	int nblocks;
+	int ninodeblocks;
+	int ninodes;
+	int nbitmapblocks;
+	int clean;
+	int features;
+	int journalblocks;
+};
+
+struct test_inode {
+	int isvalid;
+	int size;
+	int direct[5];
+	int indirect;
+};
+
+#define TEST_CHECK_BLOCKS 3	/* blocks in each of the two files the check_ tests damage */
+#define TEST_INLINE_BYTES 24	/* bytes an inline inode holds */
+#define TEST_CLUSTER_BYTES (4*DISK_BLOCK_SIZE)	/* file data a compressed cluster holds */
+#define TEST_DEDUP_BLOCKS 4	/* blocks in each file the dedup test writes, all direct */
+#define TEST_APPEND_BLOCKS 20	/* blocks in each file the append test writes, fewer than DELAY_BLOCKS */
+#define TEST_APPEND_PIECE 1000	/* bytes in each append, less than a block and not a divisor of one */
+
+/* disk_close reports its counters on stdout; keep them out of the results */
+static void quiet_close()
+{
+	int saved, null;
+
+	fflush(stdout);
+	saved = dup(1);
+	null = open("/dev/null",O_WRONLY);
+	dup2(null,1);
+	disk_close();
+	fflush(stdout);
+	dup2(saved,1);
+	close(null);
+	close(saved);
+}
+
+static void fill_file( char *data, int file )
+{
+	int i;
+	for(i=0;i<TEST_FILE_SIZE;i++) data[i] = (char)(file*31+i/7);
+}
+
+static int test_journal_overflow()
+{
+	char *data = malloc(TEST_FILE_SIZE);
+	char *check = malloc(TEST_FILE_SIZE);
+	int i, inumber, intact, status, ok=1;
+	pid_t pid;
+
+	/* The child writes the files and crashes */
+	unlink(TEST_SCRATCH);
+	fflush(stdout);
+	pid = fork();
+	if(pid==0) {
+		if(!disk_init(TEST_SCRATCH,TEST_BLOCKS) || !disk_cache_size(TEST_BLOCKS) || !fs_format_flags(FS_FORMAT_JOURNAL) || !fs_mount()) _exit(1);
+		for(i=0;i<TEST_FILES;i++) {
+			fill_file(data,i);
+			inumber = fs_create();
+			if(inumber<=0 || fs_write(inumber,data,TEST_FILE_SIZE,0)!=TEST_FILE_SIZE) _exit(1);
+		}
+		_exit(0);
+	}
+	waitpid(pid,&status,0);
+	if(!WIFEXITED(status) || WEXITSTATUS(status)!=0) {
+		printf("journal_overflow: couldn't write the files\n");
+		ok = 0;
+	} else if(!disk_init(TEST_SCRATCH,TEST_BLOCKS) || !fs_mount()) {
+		printf("journal_overflow: couldn't mount after the crash\n");
+		ok = 0;
+	}
+
+	/* A fresh disk hands out inodes in order, from 1; the files written since the last commit are lost, or empty */
+	for(i=0;i<TEST_FILES && ok;i++) {
+		fill_file(data,i);
+		if(fs_read(i+1,check,TEST_FILE_SIZE,0)!=TEST_FILE_SIZE || memcmp(data,check,TEST_FILE_SIZE)) break;
+	}
+	intact = i;
+	for(;i<TEST_FILES && ok;i++) {
+		if(fs_getsize(i+1)>0) {
+			printf("journal_overflow: inode %d is partly there\n",i+1);
+			ok = 0;
+		}
+	}
+	if(ok && intact<TEST_FILES/2) {
+		printf("journal_overflow: only %d of %d files were committed\n",intact,TEST_FILES);
+		ok = 0;
+	}
+	if(ok && fs_check(0)!=0) {
+		printf("journal_overflow: check found problems\n");
+		ok = 0;
+	}
+
+	fs_unmount();
+	quiet_close();
+	unlink(TEST_SCRATCH);
+	free(data);
+	free(check);
+	return ok;
+}
+
+static int test_stress()
+{
+	static const struct {
+		const char *name;
+		int backend;
+	} backends[] = {
+		{ "stdio", DISK_BACKEND_STDIO },
+		{ "pread", DISK_BACKEND_PREAD },
+		{ "mmap", DISK_BACKEND_MMAP },
+	};
+	int i, ok=1;
+
+	for(i=0;i<sizeof(backends)/sizeof(backends[0]);i++) {
+		unlink(TEST_SCRATCH);
+		if(!disk_init_backend(TEST_SCRATCH,TEST_BLOCKS,backends[i].backend) || !fs_format() || !fs_mount()) {
+			printf("stress: couldn't set up the %s backend\n",backends[i].name);
+			ok = 0;
+			continue;
+		}
+		if(!stress_run(TEST_STRESS_THREADS,TEST_STRESS_OPS,test_seed)) {
+			printf("stress: the %s backend failed\n",backends[i].name);
+			ok = 0;
+		} else if(fs_check(0)!=0) {
+			printf("stress: check found problems on the %s backend\n",backends[i].name);
+			ok = 0;
+		}
+		fs_unmount();
+		quiet_close();
+	}
+
+	unlink(TEST_SCRATCH);
+	return ok;
+}
+
+static void inode_access( int inumber, struct test_inode *inode, int write )
+{
+	char block[DISK_BLOCK_SIZE];
+	int blocknum = 1+inumber/TEST_INODES_PER_BLOCK;
+	struct test_inode *slot = (struct test_inode*)block + inumber%TEST_INODES_PER_BLOCK;
+
+	disk_read(blocknum,block);
+	if(write) {
+		*slot = *inode;
+		disk_write(blocknum,block);
+	} else {
+		*inode = *slot;
+	}
+}
+
+/* Mark a block used or free in the on-disk bitmap */
+static void bitmap_mark( int num, int used )
+{
+	char block[DISK_BLOCK_SIZE];
+	struct test_super super;
+	int blocknum;
+
+	disk_read(0,block);
+	memcpy(&super,block,sizeof(super));
+	blocknum = 1+super.ninodeblocks+num/TEST_BITS_PER_BLOCK;
+	disk_read(blocknum,block);
+	if(used) {
+		block[num%TEST_BITS_PER_BLOCK/8] |= 1<<num%8;
+	} else {
+		block[num%TEST_BITS_PER_BLOCK/8] &= ~(1<<num%8);
+	}
+	disk_write(blocknum,block);
+}
+
+/* Format, write files 1 and 2 with TEST_CHECK_BLOCKS blocks each, and unmount, leaving the disk open */
+static int check_setup( char *data )
+{
+	int i;
+
+	unlink(TEST_SCRATCH);
+	if(!disk_init(TEST_SCRATCH,TEST_BLOCKS) || !fs_format() || !fs_mount()) return 0;
+	for(i=1;i<=2;i++) {
+		fill_file(data,i);
+		if(fs_create()!=i || fs_write(i,data,TEST_CHECK_BLOCKS*DISK_BLOCK_SIZE,0)!=TEST_CHECK_BLOCKS*DISK_BLOCK_SIZE) return 0;
+	}
+	return fs_unmount();
+}
+
+/* Mount the damaged image and have fs_check find the damage, repair it, and find nothing after */
+static int check_repair( const char *name )
+{
+	if(!fs_mount()) {
+		printf("%s: couldn't mount the damaged image\n",name);
+		return 0;
+	}
+	if(fs_check(0)<=0) {
+		printf("%s: check found nothing wrong\n",name);
+		return 0;
+	}
+	if(fs_check(FS_CHECK_REPAIR)<=0) {
+		printf("%s: repair found nothing wrong\n",name);
+		return 0;
+	}
+	if(fs_check(0)!=0) {
+		printf("%s: problems are left after the repair\n",name);
+		return 0;
+	}
+	if(!fs_unmount() || !fs_mount() || fs_check(0)!=0) {
+		printf("%s: the repair did not last a remount\n",name);
+		return 0;
+	}
+	return 1;
+}
+
+/* Whether file inumber still holds what check_setup wrote, blocks long */
+static int check_contents( int inumber, int blocks, char *data, char *check )
+{
+	fill_file(data,inumber);
+	return fs_getsize(inumber)==blocks*DISK_BLOCK_SIZE && fs_read(inumber,check,blocks*DISK_BLOCK_SIZE,0)==blocks*DISK_BLOCK_SIZE && !memcmp(data,check,blocks*DISK_BLOCK_SIZE);
+}
+
+static void check_teardown( char *data, char *check )
+{
+	fs_unmount();
+	quiet_close();
+	unlink(TEST_SCRATCH);
+	free(data);
+	free(check);
+}
+
+/* File 2 is given file 1's second block: file 1 keeps it, and file 2 is cut before it */
+static int test_check_double_owned()
+{
+	char *data = malloc(TEST_FILE_SIZE);
+	char *check = malloc(TEST_FILE_SIZE);
+	struct test_inode first, second;
+	int ok;
+
+	ok = check_setup(data);
+	if(ok) {
+		inode_access(1,&first,0);
+		inode_access(2,&second,0);
+		second.direct[1] = first.direct[1];
+		inode_access(2,&second,1);
+		ok = check_repair("check_double_owned");
+	}
+	if(ok && !check_contents(1,TEST_CHECK_BLOCKS,data,check)) {
+		printf("check_double_owned: the first owner lost data\n");
+		ok = 0;
+	}
+	if(ok && fs_getsize(2)!=DISK_BLOCK_SIZE) {
+		printf("check_double_owned: second owner has %d bytes, not %d\n",fs_getsize(2),DISK_BLOCK_SIZE);
+		ok = 0;
+	}
+
+	check_teardown(data,check);
+	return ok;
+}
+
+/* A free block is marked used: the repair gives it back */
+static int test_check_leaked_block()
+{
+	char *data = malloc(TEST_FILE_SIZE);
+	char *check = malloc(TEST_FILE_SIZE);
+	int ok, nfree=0;
+
+	ok = check_setup(data);
+	if(ok && fs_mount()) {
+		nfree = fs_freeblocks();
+		fs_unmount();
+		bitmap_mark(TEST_BLOCKS-1,1);
+		ok = check_repair("check_leaked_block");
+	} else {
+		ok = 0;
+	}
+	if(ok && fs_freeblocks()!=nfree) {
+		printf("check_leaked_block: %d blocks free, not %d\n",fs_freeblocks(),nfree);
+		ok = 0;
+	}
+	if(ok && (!check_contents(1,TEST_CHECK_BLOCKS,data,check) || !check_contents(2,TEST_CHECK_BLOCKS,data,check))) {
+		printf("check_leaked_block: a file lost data\n");
+		ok = 0;
+	}
+
+	check_teardown(data,check);
+	return ok;
+}
+
+/* File 1 claims more bytes than its blocks hold: the repair cuts the size back to them */
+static int test_check_bad_size()
+{
+	char *data = malloc(TEST_FILE_SIZE);
+	char *check = malloc(TEST_FILE_SIZE);
+	struct test_inode inode;
+	int ok;
+
+	ok = check_setup(data);
+	if(ok) {
+		inode_access(1,&inode,0);
+		inode.size = (TEST_CHECK_BLOCKS+2)*DISK_BLOCK_SIZE;
+		inode_access(1,&inode,1);
+		ok = check_repair("check_bad_size");
+	}
+	if(ok && !check_contents(1,TEST_CHECK_BLOCKS,data,check)) {
+		printf("check_bad_size: file has %d bytes, or lost data\n",fs_getsize(1));
+		ok = 0;
+	}
+
+	check_teardown(data,check);
+	return ok;
+}
+
+/* A block of file 2 is marked free: the repair marks it used, so it is not handed out again */
+static int test_check_orphaned_bit()
+{
+	char *data = malloc(TEST_FILE_SIZE);
+	char *check = malloc(TEST_FILE_SIZE);
+	struct test_inode inode;
+	int ok, nfree=0, inumber;
+
+	ok = check_setup(data);
+	if(ok && fs_mount()) {
+		nfree = fs_freeblocks();
+		fs_unmount();
+		inode_access(2,&inode,0);
+		bitmap_mark(inode.direct[0],0);
+		ok = check_repair("check_orphaned_bit");
+	} else {
+		ok = 0;
+	}
+	if(ok && fs_freeblocks()!=nfree) {
+		printf("check_orphaned_bit: %d blocks free, not %d\n",fs_freeblocks(),nfree);
+		ok = 0;
+	}
+
+	/* Fill what is left; file 2 must come through untouched */
+	if(ok) {
+		memset(data,0x5a,TEST_FILE_SIZE);
+		while(fs_freeblocks()>0) {
+			inumber = fs_create();
+			if(inumber<=0 || fs_write(inumber,data,TEST_FILE_SIZE,0)<=0 || !fs_sync()) break;
+		}
+		if(!check_contents(2,TEST_CHECK_BLOCKS,data,check)) {
+			printf("check_orphaned_bit: the block was handed out again\n");
+			ok = 0;
+		}
+	}
+
+	check_teardown(data,check);
+	return ok;
+}
+
+/* Format a fresh scratch image with flags and mount it */
+static int fresh_mount( int flags )
+{
+	unlink(TEST_SCRATCH);
+	return disk_init(TEST_SCRATCH,TEST_BLOCKS) && fs_format_flags(flags) && fs_mount();
+}
+
+static void fresh_unmount()
+{
+	fs_unmount();
+	quiet_close();
+	unlink(TEST_SCRATCH);
+}
+
+/* Whether file inumber holds exactly the size bytes of model */
+static int file_matches( int inumber, const char *model, int size )
+{
+	char *check = malloc(size+1);
+	int ok = fs_getsize(inumber)==size && fs_read(inumber,check,size+1,0)==size && !memcmp(check,model,size);
+	free(check);
+	return ok;
+}
+
+/* Free blocks once everything written has its blocks */
+static int blocks_free()
+{
+	fs_sync();
+	return fs_freeblocks();
+}
+
+/* Check the filesystem, remount it and check again, and see that file inumber still holds model */
+static int round_trip( const char *name, int inumber, const char *model, int size )
+{
+	if(fs_check(0)!=0) {
+		printf("%s: check found problems\n",name);
+		return 0;
+	}
+	if(!fs_unmount() || !fs_mount() || fs_check(0)!=0) {
+		printf("%s: check found problems after a remount\n",name);
+		return 0;
+	}
+	if(!file_matches(inumber,model,size)) {
+		printf("%s: the file changed across a remount\n",name);
+		return 0;
+	}
+	return 1;
+}
+
+/* An inline file grows one byte at a time to one byte past its inode, and is then cut back into it */
+static int test_inline()
+{
+	char model[2*TEST_INLINE_BYTES];
+	int inumber, size, nfree=0, ok;
+
+	ok = fresh_mount(FS_FORMAT_INLINE);
+	inumber = ok ? fs_create() : 0;
+	if(ok) nfree = blocks_free();
+	for(size=0;ok && size<=TEST_INLINE_BYTES;size++) {
+		model[size] = 'a'+size;
+		if(fs_write(inumber,model+size,1,size)!=1 || !file_matches(inumber,model,size+1)) {
+			printf("inline: wrong contents at %d bytes\n",size+1);
+			ok = 0;
+		}
+		/* Up to INLINE_BYTES the file takes no block; one byte more spills it to one */
+		if(ok && blocks_free()!=nfree-(size+1>TEST_INLINE_BYTES)) {
+			printf("inline: %d blocks used at %d bytes\n",nfree-blocks_free(),size+1);
+			ok = 0;
+		}
+	}
+	if(ok) ok = round_trip("inline",inumber,model,TEST_INLINE_BYTES+1);
+
+	/* Rewriting from the start cuts the file back, and it fits in its inode again */
+	if(ok) {
+		memcpy(model,"short",5);
+		if(fs_write(inumber,model,5,0)!=5 || !file_matches(inumber,model,5) || blocks_free()!=nfree) {
+			printf("inline: cutting the file back left %d bytes and %d blocks\n",fs_getsize(inumber),nfree-blocks_free());
+			ok = 0;
+		}
+	}
+	if(ok) ok = round_trip("inline",inumber,model,5);
+
+	fresh_unmount();
+	return ok;
+}
+
+/* Write length bytes at offset into both the file and its model, and see that they agree after */
+static int write_matches( int inumber, char *model, int *size, const char *data, int length, int offset )
+{
+	if(fs_write(inumber,data,length,offset)!=length) return 0;
+	memcpy(model+offset,data,length);
+	if(offset==0) {
+		*size = length;
+	} else if(offset+length>*size) {
+		*size = offset+length;
+	}
+	return file_matches(inumber,model,*size);
+}
+
+/*
+A compressed file two and a half clusters long has parts of clusters
+rewritten, with data that does not compress, and is then cut short.
+*/
+static int test_compress()
+{
+	int length = 2*TEST_CLUSTER_BYTES+TEST_CLUSTER_BYTES/2;
+	char *model = calloc(1,length+TEST_CLUSTER_BYTES);
+	char *data = malloc(length);
+	unsigned seed = test_seed;
+	int inumber, size=0, nfree=0, i, ok;
+
+	ok = fresh_mount(FS_FORMAT_COMPRESS);
+	inumber = ok ? fs_create() : 0;
+	if(ok) nfree = blocks_free();
+
+	/* Text-like data takes fewer blocks than it fills */
+	for(i=0;i<length;i++) data[i] = "compressed clusters "[i%20];
+	if(ok && (!write_matches(inumber,model,&size,data,length,0) || nfree-blocks_free()>=length/DISK_BLOCK_SIZE)) {
+		printf("compress: writing the file took %d blocks\n",nfree-blocks_free());
+		ok = 0;
+	}
+
+	/* Random bytes across the end of the first cluster, and across the end of the file */
+	for(i=0;i<length;i++) data[i] = rand_r(&seed);
+	if(ok && !write_matches(inumber,model,&size,data,300,TEST_CLUSTER_BYTES-100)) {
+		printf("compress: rewriting across clusters 0 and 1 went wrong\n");
+		ok = 0;
+	}
+	if(ok && !write_matches(inumber,model,&size,data+300,5000,size-200)) {
+		printf("compress: rewriting across the end of the file went wrong\n");
+		ok = 0;
+	}
+	if(ok) ok = round_trip("compress",inumber,model,size);
+
+	/* Rewriting from the start cuts the file to part of one cluster */
+	for(i=0;i<length;i++) data[i] = "compressed clusters "[i%20];
+	if(ok && (!write_matches(inumber,model,&size,data,TEST_CLUSTER_BYTES/3,0) || nfree-blocks_free()!=1)) {
+		printf("compress: cutting the file short left %d bytes in %d blocks\n",fs_getsize(inumber),nfree-blocks_free());
+		ok = 0;
+	}
+	if(ok) ok = round_trip("compress",inumber,model,size);
+
+	fresh_unmount();
+	free(model);
+	free(data);
+	return ok;
+}
+
+/*
+Two files of the same random blocks take the blocks of one. Deleting
+either leaves the blocks to the other, and deleting both frees them.
+*/
+static int test_dedup()
+{
+	int length = TEST_DEDUP_BLOCKS*DISK_BLOCK_SIZE;
+	char *model = malloc(length);
+	unsigned seed = test_seed;
+	int first, second, nfree=0, i, ok;
+
+	for(i=0;i<length;i++) model[i] = rand_r(&seed);
+
+	ok = fresh_mount(FS_FORMAT_DEDUP);
+	first = ok ? fs_create() : 0;
+	second = ok ? fs_create() : 0;
+	if(ok) nfree = blocks_free();
+	if(ok && (fs_write(first,model,length,0)!=length || fs_write(second,model,length,0)!=length)) {
+		printf("dedup: writing the files failed\n");
+		ok = 0;
+	}
+	if(ok && nfree-blocks_free()!=TEST_DEDUP_BLOCKS) {
+		printf("dedup: two files of %d blocks took %d\n",TEST_DEDUP_BLOCKS,nfree-blocks_free());
+		ok = 0;
+	}
+	if(ok) ok = round_trip("dedup",second,model,length);
+
+	/* The second file keeps the blocks the first one shared */
+	if(ok && (!fs_delete(first) || nfree-blocks_free()!=TEST_DEDUP_BLOCKS)) {
+		printf("dedup: deleting one file left %d blocks used\n",nfree-blocks_free());
+		ok = 0;
+	}
+	if(ok) ok = round_trip("dedup",second,model,length);
+
+	if(ok && (!fs_delete(second) || blocks_free()!=nfree)) {
+		printf("dedup: deleting both files left %d blocks used\n",nfree-blocks_free());
+		ok = 0;
+	}
+	if(ok && fs_check(0)!=0) {
+		printf("dedup: check found problems after deleting both files\n");
+		ok = 0;
+	}
+
+	fresh_unmount();
+	free(model);
+	return ok;
+}
+
+/* Whether the first nblocks blocks of file inumber on the unmounted image lie one after another */
+static int file_contiguous( int inumber, int nblocks )
+{
+	struct test_inode inode;
+	int pointers[DISK_BLOCK_SIZE/sizeof(int)];
+	int i, blocknum;
+
+	inode_access(inumber,&inode,0);
+	if(nblocks>5) {
+		if(!inode.indirect) return 0;
+		disk_read(inode.indirect,(char*)pointers);
+	}
+	for(i=0;i<nblocks;i++) {
+		blocknum = i<5 ? inode.direct[i] : pointers[i-5];
+		if(!blocknum || (i>0 && blocknum!=inode.direct[0]+i)) {
+			printf("append: file %d block %d is disk block %d, not %d\n",inumber,i,blocknum,inode.direct[0]+i);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+Two files are appended to in turn, a piece smaller than a block at a
+time, so that allocating as the data came would interleave them.
+*/
+static int test_append()
+{
+	int length = TEST_APPEND_BLOCKS*DISK_BLOCK_SIZE;
+	char *model[2];
+	unsigned seed = test_seed;
+	int inumber[2], fd[2], offset, piece, i, j, ok;
+
+	ok = fresh_mount(0);
+	for(i=0;i<2;i++) {
+		model[i] = malloc(length);
+		for(j=0;j<length;j++) model[i][j] = rand_r(&seed);
+		inumber[i] = ok ? fs_create() : 0;
+		fd[i] = ok ? fs_open(inumber[i],0) : -1;
+		if(fd[i]<0) ok = 0;
+	}
+	for(offset=0;ok && offset<length;offset+=piece) {
+		piece = length-offset<TEST_APPEND_PIECE ? length-offset : TEST_APPEND_PIECE;
+		for(i=0;i<2;i++) {
+			if(fs_append(fd[i],model[i]+offset,piece)!=piece) {
+				printf("append: appending to file %d at %d failed\n",inumber[i],offset);
+				ok = 0;
+			}
+		}
+	}
+	for(i=0;i<2;i++) {
+		if(fd[i]>=0) fs_close(fd[i]);
+	}
+
+	if(ok && fs_check(0)!=0) {
+		printf("append: check found problems\n");
+		ok = 0;
+	}
+	if(ok && !fs_unmount()) ok = 0;
+	for(i=0;ok && i<2;i++) ok = file_contiguous(inumber[i],TEST_APPEND_BLOCKS);
+	if(ok && !fs_mount()) ok = 0;
+	for(i=0;ok && i<2;i++) {
+		if(!file_matches(inumber[i],model[i],length)) {
+			printf("append: file %d changed across a remount\n",inumber[i]);
+			ok = 0;
+		}
+	}
+
+	fresh_unmount();
+	for(i=0;i<2;i++) free(model[i]);
+	return ok;
+}
+
+int main( int argc, char *argv[] )
+{
+	static const struct {
+		const char *name;
+		int (*run)();
+	} tests[] = {
+		{ "journal_overflow", test_journal_overflow },
+		{ "check_double_owned", test_check_double_owned },
+		{ "check_leaked_block", test_check_leaked_block },
+		{ "check_bad_size", test_check_bad_size },
+		{ "check_orphaned_bit", test_check_orphaned_bit },
+		{ "inline", test_inline },
+		{ "compress", test_compress },
+		{ "dedup", test_dedup },
+		{ "append", test_append },
+		{ "stress", test_stress },
+	};
+	int i, ok=1;
+
+	/* Tests that use random numbers take them from the seed, which can be given to replay a run */
+	test_seed = argc>1 ? strtoul(argv[1],0,10) : time(0);
+	printf("seed %u\n",test_seed);
+
+	for(i=0;i<sizeof(tests)/sizeof(tests[0]);i++) {
+		if(tests[i].run()) {
+			printf("%s: ok\n",tests[i].name);
+		} else {
+			printf("%s: FAILED\n",tests[i].name);
+			ok = 0;
+		}
+	}
+	return ok ? 0 : 1;
+}
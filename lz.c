@@ -0,0 +1,150 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+/*
+A byte-oriented LZ77 codec in the manner of LZ4. The compressed form
+is a series of sequences, each a token byte, a run of literals copied
+as is, and a match: a 16-bit offset back into the output and a length.
+The high nibble of the token is the literal count and the low nibble
+the match length less LZ_MIN_MATCH; a nibble of 15 is continued by
+bytes that are added to it, up to and including the first below 255.
+The last sequence has literals only. Matches are found through a hash
+of the next four bytes, keeping the last position each hash was seen.
+*/
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t read32( const char *p )
+{
+	uint32_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+static int hash( const char *p )
+{
+	return (read32(p)*2654435761u) >> (32-LZ_HASH_BITS);
+}
+
+/* Append a length past the 15 its nibble holds; returns the new end, or 0 if there is no room */
+static char * put_length( char *op, char *oend, int n )
+{
+	for(;n>=255;n-=255) {
+		if(op>=oend) return 0;
+		*op++ = (char)255;
+	}
+	if(op>=oend) return 0;
+	*op++ = (char)n;
+	return op;
+}
+
+/* Emit a sequence of nlit literals and, if mlen is nonzero, a match; returns the new end, or 0 if there is no room */
+static char * put_sequence( char *op, char *oend, const char *lit, int nlit, int offset, int mlen )
+{
+	char *token;
+	int m = mlen ? mlen-LZ_MIN_MATCH : 0;
+
+	if(op>=oend) return 0;
+	token = op++;
+	*token = (char)(((nlit<15 ? nlit : 15)<<4) | (m<15 ? m : 15));
+	if(nlit>=15 && !(op=put_length(op,oend,nlit-15))) return 0;
+	if(oend-op<nlit) return 0;
+	memcpy(op,lit,nlit);
+	op += nlit;
+	if(!mlen) return op;
+
+	if(oend-op<2) return 0;
+	*op++ = (char)(offset & 0xff);
+	*op++ = (char)(offset >> 8);
+	if(m>=15 && !(op=put_length(op,oend,m-15))) return 0;
+	return op;
+}
+
+/*
+Compress length bytes from src into dst. Returns the compressed length,
+or 0 if it would take more than capacity bytes.
+*/
+
+int lz_compress( const char *src, int length, char *dst, int capacity )
+{
+	int table[1<<LZ_HASH_BITS];
+	const char *ip = src, *anchor = src, *iend = src+length;
+	const char *mlimit = iend-LZ_MIN_MATCH;
+	char *op = dst, *oend = dst+capacity;
+	const char *ref;
+	int h, len;
+
+	for(h=0;h<(1<<LZ_HASH_BITS);h++) table[h] = -1;
+
+	while(ip<=mlimit) {
+		h = hash(ip);
+		ref = table[h]>=0 ? src+table[h] : 0;
+		table[h] = (int)(ip-src);
+		if(!ref || ip-ref>LZ_MAX_OFFSET || read32(ref)!=read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		len = LZ_MIN_MATCH;
+		while(ip+len<iend && ref[len]==ip[len]) len++;
+		op = put_sequence(op,oend,anchor,(int)(ip-anchor),(int)(ip-ref),len);
+		if(!op) return 0;
+		ip += len;
+		anchor = ip;
+	}
+
+	op = put_sequence(op,oend,anchor,(int)(iend-anchor),0,0);
+	return op ? (int)(op-dst) : 0;
+}
+
+/* Read a length continued past its nibble; returns -1 if the input ends first */
+static int get_length( const char **ip, const char *iend, int n )
+{
+	int b;
+	do {
+		if(*ip>=iend) return -1;
+		b = (unsigned char)*(*ip)++;
+		n += b;
+	} while(b==255);
+	return n;
+}
+
+/*
+Decompress length bytes from src into dst. Returns the decompressed
+length, or -1 if src is not a valid compressed form or its output
+would take more than capacity bytes.
+*/
+
+int lz_decompress( const char *src, int length, char *dst, int capacity )
+{
+	const char *ip = src, *iend = src+length;
+	char *op = dst, *oend = dst+capacity;
+	int token, nlit, mlen, offset;
+
+	while(ip<iend) {
+		token = (unsigned char)*ip++;
+		nlit = token>>4;
+		if(nlit==15 && (nlit=get_length(&ip,iend,nlit))<0) return -1;
+		if(iend-ip<nlit || oend-op<nlit) return -1;
+		memcpy(op,ip,nlit);
+		ip += nlit;
+		op += nlit;
+		if(ip==iend) break;
+
+		if(iend-ip<2) return -1;
+		offset = (unsigned char)ip[0] | (unsigned char)ip[1]<<8;
+		ip += 2;
+		mlen = token & 15;
+		if(mlen==15 && (mlen=get_length(&ip,iend,mlen))<0) return -1;
+		mlen += LZ_MIN_MATCH;
+		if(offset==0 || offset>op-dst || oend-op<mlen) return -1;
+
+		/* The match may overlap the bytes it produces, so it is copied a byte at a time */
+		for(;mlen>0;mlen--,op++) *op = op[-offset];
+	}
+	return (int)(op-dst);
+}
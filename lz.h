@@ -0,0 +1,7 @@
+#ifndef LZ_H
+#define LZ_H
+
+int lz_compress( const char *src, int length, char *dst, int capacity );
+int lz_decompress( const char *src, int length, char *dst, int capacity );
+
+#endif
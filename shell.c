@@ -1,71 +1,209 @@
 #include "fs.h"
 #include "disk.h"
+#include "stats.h"
+#include "stress.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define COPY_BUFFER_SIZE (1024*1024)
+
 
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static int format_options( char *options );
+static int check_options( char *options );
+static void report( const char *fmt, ... );
+
+/* Set by -s to leave out messages that only confirm success */
+static int quiet = 0;
 
 int main( int argc, char *argv[] )
 {
-	char line[1024];
-	char cmd[1024];
-	char arg1[1024];
-	char arg2[1024];
-	int inumber, result, args;
-
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	char *line = 0;
+	size_t linesize = 0;
+	char *cmd, *arg1, *arg2, *arg3, *word, *save;
+	int inumber, result, flags, args, opt, ok;
+	int cacheblocks = DISK_CACHE_DEFAULT;
+	int backend = DISK_BACKEND_DEFAULT;
+	int depth = DISK_QUEUE_DEPTH_DEFAULT;
+	int engine = DISK_ASYNC_AUTO;
+	const char *script = 0;
+	FILE *input = stdin;
+	int timing = 0, exitonerror = 0;
+	int ncommands = 0, nfailed = 0;
+	struct timespec start, end;
+	double elapsed, total = 0;
+
+	while((opt=getopt(argc,argv,"a:b:c:ef:q:st"))!=-1) {
+		switch(opt) {
+			case 'a':
+				if(!strcmp(optarg,"auto")) {
+					engine = DISK_ASYNC_AUTO;
+				} else if(!strcmp(optarg,"sync")) {
+					engine = DISK_ASYNC_SYNC;
+				} else if(!strcmp(optarg,"uring")) {
+					engine = DISK_ASYNC_URING;
+				} else if(!strcmp(optarg,"threads")) {
+					engine = DISK_ASYNC_THREADS;
+				} else {
+					printf("unknown async engine: %s\n",optarg);
+					return 1;
+				}
+				break;
+			case 'b':
+				if(!strcmp(optarg,"stdio")) {
+					backend = DISK_BACKEND_STDIO;
+				} else if(!strcmp(optarg,"pread")) {
+					backend = DISK_BACKEND_PREAD;
+				} else if(!strcmp(optarg,"mmap")) {
+					backend = DISK_BACKEND_MMAP;
+				} else {
+					printf("unknown backend: %s\n",optarg);
+					return 1;
+				}
+				break;
+			case 'c':
+				cacheblocks = atoi(optarg);
+				break;
+			case 'e':
+				exitonerror = 1;
+				break;
+			case 'f':
+				script = optarg;
+				break;
+			case 'q':
+				depth = atoi(optarg);
+				break;
+			case 's':
+				quiet = 1;
+				break;
+			case 't':
+				timing = 1;
+				break;
+			default:
+				argc = 0;
+				break;
+		}
+	}
+
+	if(argc-optind!=2) {
+		printf("use: %s [-a auto|sync|uring|threads] [-b stdio|pread|mmap] [-c cacheblocks] [-q depth] [-f script|-] [-e] [-s] [-t] <diskfile> <nblocks>\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
-		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
+	/*
+	With -f the commands come from a script (or stdin for "-") and no
+	prompt is shown. -s leaves out messages that only confirm success,
+	-t reports how long each command took on stderr so that stdout can
+	be compared between runs, and -e stops at the first failed command.
+	*/
+	if(script && strcmp(script,"-")) {
+		input = fopen(script,"r");
+		if(!input) {
+			printf("couldn't open %s: %s\n",script,strerror(errno));
+			return 1;
+		}
+	}
+
+	if(!disk_cache_size(cacheblocks)) {
+		printf("invalid cache size: %d\n",cacheblocks);
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	if(!disk_queue_depth(depth,engine)) {
+		printf("invalid queue depth: %d\n",depth);
+		return 1;
+	}
+
+	if(!disk_init_backend(argv[optind],atoi(argv[optind+1]),backend)) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
+
+	report("opened emulated disk image %s with %d blocks (%s I/O)\n",argv[optind],disk_size(),disk_queue_engine());
 
 	while(1) {
-		printf(" simplefs> ");
-		fflush(stdout);
+		if(!script) {
+			printf(" simplefs> ");
+			fflush(stdout);
+		}
 
-		if(!fgets(line,sizeof(line),stdin)) break;
+		if(getline(&line,&linesize,input)<0) break;
 
-		if(line[0]=='\n') continue;
-		line[strlen(line)-1] = 0;
+		/* Split the line in place into a command and up to three arguments */
+		cmd = arg1 = arg2 = arg3 = 0;
+		word = strtok_r(line," \t\r\n",&save);
+		for(args=0;word && args<4;args++) {
+			if(args==0) {
+				cmd = word;
+			} else if(args==1) {
+				arg1 = word;
+			} else if(args==2) {
+				arg2 = word;
+			} else {
+				arg3 = word;
+			}
+			word = strtok_r(0," \t\r\n",&save);
+		}
+		if(args==0 || cmd[0]=='#') continue;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
-		if(args==0) continue;
+		ok = 1;
+		if(timing) clock_gettime(CLOCK_MONOTONIC,&start);
 
 		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
-					printf("disk formatted.\n");
+			result = args==2 ? format_options(arg1) : 0;
+			if(args<=2 && result>=0) {
+				if(fs_format_flags(result)) {
+					report("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
+					ok = 0;
 				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [wipe,extents,journal,inline,compress,dedup]\n");
+				ok = 0;
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
 				if(fs_mount()) {
-					printf("disk mounted.\n");
+					report("disk mounted.\n");
 				} else {
 					printf("mount failed!\n");
+					ok = 0;
 				}
 			} else {
 				printf("use: mount\n");
+				ok = 0;
 			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
 				fs_debug();
+			} else if(args==2 && !strcmp(arg1,"summary")) {
+				fs_summary();
 			} else {
-				printf("use: debug\n");
+				printf("use: debug [summary]\n");
+				ok = 0;
+			}
+		} else if(!strcmp(cmd,"check")) {
+			flags = args==2 ? check_options(arg1) : 0;
+			if(args<=2 && flags>=0) {
+				result = fs_check(flags);
+				if(result<0) {
+					printf("check failed (is the disk mounted?)\n");
+					ok = 0;
+				} else if(result>0 && !(flags&FS_CHECK_REPAIR)) {
+					/* Problems left in place fail a script */
+					ok = 0;
+				}
+			} else {
+				printf("use: check [repair,parallel]\n");
+				ok = 0;
 			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
@@ -75,9 +213,11 @@ int main( int argc, char *argv[] )
 					printf("inode %d has size %d\n",inumber,result);
 				} else {
 					printf("getsize failed!\n");
+					ok = 0;
 				}
 			} else {
 				printf("use: getsize <inumber>\n");
+				ok = 0;
 			}
 			
 		} else if(!strcmp(cmd,"create")) {
@@ -87,68 +227,123 @@ int main( int argc, char *argv[] )
 					printf("created inode %d\n",inumber);
 				} else {
 					printf("create failed!\n");
+					ok = 0;
 				}
 			} else {
 				printf("use: create\n");
+				ok = 0;
 			}
 		} else if(!strcmp(cmd,"delete")) {
 			if(args==2) {
 				inumber = atoi(arg1);
 				if(fs_delete(inumber)) {
-					printf("inode %d deleted.\n",inumber);
+					report("inode %d deleted.\n",inumber);
 				} else {
 					printf("delete failed!\n");	
+					ok = 0;
 				}
 			} else {
 				printf("use: delete <inumber>\n");
+				ok = 0;
 			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
 				inumber = atoi(arg1);
+				/* The file goes out through a stream of its own */
+				fflush(stdout);
 				if(!do_copyout(inumber,"/dev/stdout")) {
 					printf("cat failed!\n");
+					ok = 0;
 				}
 			} else {
 				printf("use: cat <inumber>\n");
+				ok = 0;
 			}
 
 		} else if(!strcmp(cmd,"copyin")) {
 			if(args==3) {
 				inumber = atoi(arg2);
 				if(do_copyin(arg1,inumber)) {
-					printf("copied file %s to inode %d\n",arg1,inumber);
+					report("copied file %s to inode %d\n",arg1,inumber);
 				} else {
 					printf("copy failed!\n");
+					ok = 0;
 				}
 			} else {
 				printf("use: copyin <filename> <inumber>\n");
+				ok = 0;
 			}
 
 		} else if(!strcmp(cmd,"copyout")) {
 			if(args==3) {
 				inumber = atoi(arg1);
 				if(do_copyout(inumber,arg2)) {
-					printf("copied inode %d to file %s\n",inumber,arg2);
+					report("copied inode %d to file %s\n",inumber,arg2);
 				} else {
 					printf("copy failed!\n");
+					ok = 0;
 				}
 			} else {
 				printf("use: copyout <inumber> <filename>\n");
+				ok = 0;
+			}
+
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				if(fs_sync()) {
+					report("disk synced.\n");
+				} else {
+					disk_sync();
+					report("disk synced (not mounted).\n");
+				}
+			} else {
+				printf("use: sync\n");
+				ok = 0;
+			}
+
+		} else if(!strcmp(cmd,"stress")) {
+			if(args==3 || args==4) {
+				/* The seed a run reports replays its operations */
+				if(!stress_run(atoi(arg1),atoi(arg2),args==4 ? strtoul(arg3,0,10) : time(0))) {
+					printf("stress failed!\n");
+					ok = 0;
+				}
+			} else {
+				printf("use: stress <threads> <ops> [seed]\n");
+				ok = 0;
+			}
+
+		} else if(!strcmp(cmd,"stats")) {
+			if(args==1) {
+				stats_print(0);
+			} else if(args==2 && !strcmp(arg1,"json")) {
+				stats_print(1);
+			} else if(args==2 && !strcmp(arg1,"reset")) {
+				stats_reset();
+				report("statistics reset.\n");
+			} else {
+				printf("use: stats [json|reset]\n");
+				ok = 0;
 			}
 
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
+			printf("    format  [wipe,extents,journal,inline,compress,dedup]\n");
 			printf("    mount\n");
-			printf("    debug\n");
+			printf("    debug   [summary]\n");
+			printf("    check   [repair,parallel]\n");
 			printf("    create\n");
 			printf("    delete  <inode>\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
+			printf("    sync\n");
+			printf("    stress  <threads> <ops> [seed]\n");
+			printf("    stats   [json|reset]\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
+			printf("Lines starting with # are ignored.\n");
 		} else if(!strcmp(cmd,"quit")) {
 			break;
 		} else if(!strcmp(cmd,"exit")) {
@@ -156,21 +351,55 @@ int main( int argc, char *argv[] )
 		} else {
 			printf("unknown command: %s\n",cmd);
 			printf("type 'help' for a list of commands.\n");
-			result = 1;
+			ok = 0;
+		}
+
+		ncommands++;
+		if(timing) {
+			clock_gettime(CLOCK_MONOTONIC,&end);
+			elapsed = (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+			total += elapsed;
+			fflush(stdout);
+			fprintf(stderr,"%.6f s: %s%s%s%s%s%s\n",elapsed,cmd,arg1 ? " " : "",arg1 ? arg1 : "",arg2 ? " " : "",arg2 ? arg2 : "",ok ? "" : " (failed)");
 		}
+		if(!ok) {
+			nfailed++;
+			if(exitonerror) break;
+		}
+	}
+
+	if(timing) {
+		fprintf(stderr,"%d commands, %d failed, %.6f s\n",ncommands,nfailed,total);
 	}
 
-	printf("closing emulated disk.\n");
+	free(line);
+	if(input!=stdin) fclose(input);
+
+	fs_unmount();
+
+	report("closing emulated disk.\n");
 	disk_close();
 
-	return 0;
+	/* A script reports failed commands through the exit status */
+	return (script || exitonerror) && nfailed ? 1 : 0;
+}
+
+static void report( const char *fmt, ... )
+{
+	va_list args;
+
+	if(quiet) return;
+
+	va_start(args,fmt);
+	vprintf(fmt,args);
+	va_end(args);
 }
 
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
+	int offset=0, result, actual, fd, ok=1;
+	char *buffer;
 
 	file = fopen(filename,"r");
 	if(!file) {
@@ -178,34 +407,47 @@ static int do_copyin( const char *filename, int inumber )
 		return 0;
 	}
 
+	fd = fs_open(inumber,FS_OPEN_TRUNCATE);
+	if(fd<0) {
+		printf("couldn't open inode %d\n",inumber);
+		fclose(file);
+		return 0;
+	}
+
+	buffer = malloc(COPY_BUFFER_SIZE);
+
 	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
+		result = fread(buffer,1,COPY_BUFFER_SIZE,file);
 		if(result<=0) break;
 		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+			actual = fs_append(fd,buffer,result);
 			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
+				printf("ERROR: fs_append return invalid result %d\n",actual);
+				ok = 0;
 				break;
 			}
 			offset += actual;
 			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+				printf("WARNING: fs_append only wrote %d bytes, not %d bytes\n",actual,result);
+				ok = 0;
 				break;
 			}
 		}
 	}
 
-	printf("%d bytes copied\n",offset);
+	report("%d bytes copied\n",offset);
 
+	free(buffer);
 	fclose(file);
-	return 1;
+	fs_close(fd);
+	return ok;
 }
 
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
+	int offset=0, result, fd, size, ok=1;
+	char *buffer;
 
 	file = fopen(filename,"w");
 	if(!file) {
@@ -213,16 +455,87 @@ static int do_copyout( int inumber, const char *filename )
 		return 0;
 	}
 
+	fd = fs_open(inumber,0);
+	if(fd<0) {
+		printf("couldn't open inode %d\n",inumber);
+		fclose(file);
+		return 0;
+	}
+
+	buffer = malloc(COPY_BUFFER_SIZE);
+
 	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file);
+		result = fs_pread(fd,buffer,COPY_BUFFER_SIZE,offset);
+		if(result<0) {
+			printf("ERROR: fs_pread return invalid result %d\n",result);
+			ok = 0;
+			break;
+		}
+		if(result==0) break;
+		if((int)fwrite(buffer,1,result,file)!=result) {
+			printf("ERROR: couldn't write %s: %s\n",filename,strerror(errno));
+			ok = 0;
+			break;
+		}
 		offset += result;
 	}
 
-	printf("%d bytes copied\n",offset);
+	/* A read that stops short of the end of the file is a failure, not EOF */
+	size = fs_getsize(inumber);
+	if(ok && offset!=size) {
+		printf("WARNING: fs_pread only read %d bytes, not %d bytes\n",offset,size);
+		ok = 0;
+	}
 
-	fclose(file);
-	return 1;
+	report("%d bytes copied\n",offset);
+
+	free(buffer);
+	if(fclose(file)!=0) ok = 0;
+	fs_close(fd);
+	return ok;
+}
+
+/* Turn a comma-separated list of check options into FS_CHECK flags, or -1 if one is unknown */
+static int check_options( char *options )
+{
+	int flags = 0;
+	char *option;
+
+	for(option=strtok(options,",");option;option=strtok(0,",")) {
+		if(!strcmp(option,"repair")) {
+			flags |= FS_CHECK_REPAIR;
+		} else if(!strcmp(option,"parallel")) {
+			flags |= FS_CHECK_PARALLEL;
+		} else {
+			return -1;
+		}
+	}
+	return flags;
+}
+
+/* Turn a comma-separated list of format options into FS_FORMAT flags, or -1 if one is unknown */
+static int format_options( char *options )
+{
+	int flags = 0;
+	char *option;
+
+	for(option=strtok(options,",");option;option=strtok(0,",")) {
+		if(!strcmp(option,"wipe")) {
+			flags |= FS_FORMAT_WIPE;
+		} else if(!strcmp(option,"extents")) {
+			flags |= FS_FORMAT_EXTENTS;
+		} else if(!strcmp(option,"journal")) {
+			flags |= FS_FORMAT_JOURNAL;
+		} else if(!strcmp(option,"inline")) {
+			flags |= FS_FORMAT_INLINE;
+		} else if(!strcmp(option,"compress")) {
+			flags |= FS_FORMAT_COMPRESS;
+		} else if(!strcmp(option,"dedup")) {
+			flags |= FS_FORMAT_DEDUP;
+		} else {
+			return -1;
+		}
+	}
+	return flags;
 }
 
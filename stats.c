@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+/*
+Latencies go into log-linear histograms in the manner of HdrHistogram:
+values below STATS_SUB_BUCKETS nanoseconds get a bucket each, and every
+power of two above that is split into STATS_SUB_BUCKETS/2 buckets, so
+a bucket is never wider than about 3% of the values it holds. The top
+bucket collects everything past 2^40 ns (about 18 minutes).
+*/
+
+#define STATS_SUB_BITS 6
+#define STATS_SUB_BUCKETS (1<<STATS_SUB_BITS)
+#define STATS_HALF_BUCKETS (STATS_SUB_BUCKETS/2)
+#define STATS_MAX_BITS 40
+#define STATS_BUCKETS (STATS_SUB_BUCKETS+(STATS_MAX_BITS-STATS_SUB_BITS+1)*STATS_HALF_BUCKETS)
+
+/* Columns in the block heatmap and blocks listed as hottest */
+#define STATS_HEAT_COLUMNS 64
+#define STATS_HOTTEST 8
+
+struct stats_op {
+	long long calls;
+	long long bytes;
+	long long blocks;
+	long long total;   /* nanoseconds over all calls */
+	long long max;
+	long long histogram[STATS_BUCKETS];
+};
+
+static const char *op_names[STATS_NOPS] = {
+	"fs_format", "fs_mount", "fs_unmount", "fs_sync", "fs_debug",
+	"fs_create", "fs_delete", "fs_getsize", "fs_read", "fs_write", "fs_check",
+	"fs_open", "fs_close",
+	"disk_read", "disk_write", "disk_readv", "disk_writev",
+	"disk_submit_read", "disk_submit_write",
+};
+
+/*
+Counters are bumped with relaxed atomics from any thread. stats_lock
+only keeps the heatmap from being replaced while it is reset or shown.
+*/
+
+static struct stats_op ops[STATS_NOPS];
+static int *heat_reads=0;
+static int *heat_writes=0;
+static int heat_nblocks=0;
+static pthread_mutex_t stats_lock=PTHREAD_MUTEX_INITIALIZER;
+
+/* Blocks this thread has moved through the disk layer, for per-call deltas */
+static __thread long long thread_blocks=0;
+
+static long long stats_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static int histogram_bucket( long long v )
+{
+	int shift, b;
+
+	if(v<STATS_SUB_BUCKETS) return v<0 ? 0 : (int)v;
+
+	shift = 63-__builtin_clzll(v)-STATS_SUB_BITS+1;
+	b = STATS_SUB_BUCKETS + (shift-1)*STATS_HALF_BUCKETS + (int)(v>>shift) - STATS_HALF_BUCKETS;
+	return b<STATS_BUCKETS ? b : STATS_BUCKETS-1;
+}
+
+/* The largest value that falls into bucket b */
+
+static long long histogram_value( int b )
+{
+	int shift, m;
+
+	if(b<STATS_SUB_BUCKETS) return b;
+
+	shift = (b-STATS_SUB_BUCKETS)/STATS_HALF_BUCKETS + 1;
+	m = (b-STATS_SUB_BUCKETS)%STATS_HALF_BUCKETS + STATS_HALF_BUCKETS;
+	return ((long long)(m+1)<<shift) - 1;
+}
+
+/* The value at quantile q, reported as its bucket's upper bound but never above the max seen */
+
+static long long histogram_quantile( const struct stats_op *o, long long calls, double q )
+{
+	long long target, seen=0;
+	int b;
+
+	if(calls==0) return 0;
+
+	target = (long long)(q*calls+0.999999);
+	if(target<1) target = 1;
+
+	for(b=0;b<STATS_BUCKETS;b++) {
+		seen += __atomic_load_n(&o->histogram[b],__ATOMIC_RELAXED);
+		if(seen>=target) break;
+	}
+
+	if(b==STATS_BUCKETS || histogram_value(b)>o->max) return o->max;
+	return histogram_value(b);
+}
+
+void stats_begin( struct stats_span *s )
+{
+	s->start = stats_now();
+	s->blocks = thread_blocks;
+}
+
+/* Record one call of op that moved bytes of data, timed from stats_begin */
+
+void stats_end( struct stats_span *s, int op, long long bytes )
+{
+	struct stats_op *o = &ops[op];
+	long long elapsed = stats_now() - s->start;
+	long long max;
+
+	__atomic_add_fetch(&o->calls,1,__ATOMIC_RELAXED);
+	if(bytes>0) __atomic_add_fetch(&o->bytes,bytes,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&o->blocks,thread_blocks-s->blocks,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&o->total,elapsed,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&o->histogram[histogram_bucket(elapsed)],1,__ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&o->max,__ATOMIC_RELAXED);
+	while(elapsed>max && !__atomic_compare_exchange_n(&o->max,&max,elapsed,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+/*
+Note that the calling thread touched count blocks from blocknum on.
+They are charged to every operation the thread has in progress, and
+to each block's entry in the heatmap.
+*/
+
+void stats_blocks( int blocknum, int count, int write )
+{
+	int *heat = write ? heat_writes : heat_reads;
+	int i;
+
+	thread_blocks += count;
+
+	if(!heat || blocknum<0 || blocknum+count>heat_nblocks) return;
+	for(i=0;i<count;i++) {
+		__atomic_add_fetch(&heat[blocknum+i],1,__ATOMIC_RELAXED);
+	}
+}
+
+/* Size the heatmap for a disk of nblocks blocks. Call it while no I/O is in progress. */
+
+void stats_heatmap( int nblocks )
+{
+	pthread_mutex_lock(&stats_lock);
+	free(heat_reads);
+	free(heat_writes);
+	heat_reads = nblocks>0 ? calloc(nblocks,sizeof(int)) : 0;
+	heat_writes = nblocks>0 ? calloc(nblocks,sizeof(int)) : 0;
+	heat_nblocks = heat_reads && heat_writes ? nblocks : 0;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_reset()
+{
+	int i, b;
+
+	pthread_mutex_lock(&stats_lock);
+	for(i=0;i<STATS_NOPS;i++) {
+		__atomic_store_n(&ops[i].calls,0,__ATOMIC_RELAXED);
+		__atomic_store_n(&ops[i].bytes,0,__ATOMIC_RELAXED);
+		__atomic_store_n(&ops[i].blocks,0,__ATOMIC_RELAXED);
+		__atomic_store_n(&ops[i].total,0,__ATOMIC_RELAXED);
+		__atomic_store_n(&ops[i].max,0,__ATOMIC_RELAXED);
+		for(b=0;b<STATS_BUCKETS;b++) {
+			__atomic_store_n(&ops[i].histogram[b],0,__ATOMIC_RELAXED);
+		}
+	}
+	for(i=0;i<heat_nblocks;i++) {
+		__atomic_store_n(&heat_reads[i],0,__ATOMIC_RELAXED);
+		__atomic_store_n(&heat_writes[i],0,__ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* Sum the heatmap into STATS_HEAT_COLUMNS equal runs of blocks */
+
+static void heat_columns( const int *heat, long long *columns )
+{
+	int i;
+
+	memset(columns,0,STATS_HEAT_COLUMNS*sizeof(long long));
+	for(i=0;i<heat_nblocks;i++) {
+		columns[(long long)i*STATS_HEAT_COLUMNS/heat_nblocks] += __atomic_load_n(&heat[i],__ATOMIC_RELAXED);
+	}
+}
+
+/* Find the most accessed blocks, busiest first; returns how many were found */
+
+static int heat_hottest( int *hottest )
+{
+	long long total, other;
+	int i, j, n=0;
+
+	for(i=0;i<heat_nblocks;i++) {
+		total = (long long)heat_reads[i]+heat_writes[i];
+		if(total==0) continue;
+		for(j=n;j>0;j--) {
+			other = (long long)heat_reads[hottest[j-1]]+heat_writes[hottest[j-1]];
+			if(other>=total) break;
+			if(j<STATS_HOTTEST) hottest[j] = hottest[j-1];
+		}
+		if(j<STATS_HOTTEST) hottest[j] = i;
+		if(n<STATS_HOTTEST) n++;
+	}
+
+	return n;
+}
+
+static int log2_floor( long long v )
+{
+	return v>0 ? 63-__builtin_clzll(v) : 0;
+}
+
+/* One row of the text heatmap, darker characters meaning more accesses on a log scale */
+
+static void heat_row( const char *label, const long long *columns )
+{
+	static const char ramp[] = " .:-=+*#%@";
+	long long max=0;
+	int i, level, top;
+
+	for(i=0;i<STATS_HEAT_COLUMNS;i++) {
+		if(columns[i]>max) max = columns[i];
+	}
+	top = log2_floor(max);
+
+	printf("    %-6s |",label);
+	for(i=0;i<STATS_HEAT_COLUMNS;i++) {
+		if(columns[i]==0) {
+			level = 0;
+		} else if(top==0) {
+			level = 9;
+		} else {
+			level = 1 + 8*log2_floor(columns[i])/top;
+		}
+		putchar(ramp[level]);
+	}
+	printf("|\n");
+}
+
+static void stats_print_text()
+{
+	long long reads[STATS_HEAT_COLUMNS], writes[STATS_HEAT_COLUMNS];
+	int hottest[STATS_HOTTEST];
+	long long calls;
+	struct stats_op *o;
+	int i, n;
+
+	printf("%-18s %10s %14s %11s %10s %10s %10s %10s %10s\n","operation","calls","bytes","blocks/call","mean us","p50 us","p90 us","p99 us","max us");
+	for(i=0;i<STATS_NOPS;i++) {
+		o = &ops[i];
+		calls = __atomic_load_n(&o->calls,__ATOMIC_RELAXED);
+		if(calls==0) continue;
+		printf("%-18s %10lld %14lld %11.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+			op_names[i],
+			calls,
+			o->bytes,
+			(double)o->blocks/calls,
+			o->total/1000.0/calls,
+			histogram_quantile(o,calls,0.50)/1000.0,
+			histogram_quantile(o,calls,0.90)/1000.0,
+			histogram_quantile(o,calls,0.99)/1000.0,
+			o->max/1000.0);
+	}
+
+	if(heat_nblocks==0) return;
+
+	heat_columns(heat_reads,reads);
+	heat_columns(heat_writes,writes);
+	printf("block heatmap: %d blocks, about %d per column\n",heat_nblocks,(heat_nblocks+STATS_HEAT_COLUMNS-1)/STATS_HEAT_COLUMNS);
+	heat_row("reads",reads);
+	heat_row("writes",writes);
+
+	n = heat_hottest(hottest);
+	if(n==0) return;
+	printf("hottest blocks:");
+	for(i=0;i<n;i++) {
+		printf(" %d (%d r, %d w)",hottest[i],heat_reads[hottest[i]],heat_writes[hottest[i]]);
+	}
+	printf("\n");
+}
+
+static void json_columns( const char *name, const long long *columns )
+{
+	int i;
+
+	printf("\"%s\":[",name);
+	for(i=0;i<STATS_HEAT_COLUMNS;i++) {
+		printf("%s%lld",i ? "," : "",columns[i]);
+	}
+	printf("]");
+}
+
+/* Everything on one line, with each histogram given as [upper bound ns, count] pairs */
+
+static void stats_print_json()
+{
+	long long reads[STATS_HEAT_COLUMNS], writes[STATS_HEAT_COLUMNS];
+	int hottest[STATS_HOTTEST];
+	long long calls, count;
+	struct stats_op *o;
+	int i, b, n, first;
+
+	printf("{\"ops\":{");
+	for(i=0;i<STATS_NOPS;i++) {
+		o = &ops[i];
+		calls = __atomic_load_n(&o->calls,__ATOMIC_RELAXED);
+		printf("%s\"%s\":{\"calls\":%lld,\"bytes\":%lld,\"blocks\":%lld,",i ? "," : "",op_names[i],calls,o->bytes,o->blocks);
+		printf("\"latency_ns\":{\"mean\":%lld,\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"p999\":%lld,\"max\":%lld,\"histogram\":[",
+			calls ? o->total/calls : 0,
+			histogram_quantile(o,calls,0.50),
+			histogram_quantile(o,calls,0.90),
+			histogram_quantile(o,calls,0.99),
+			histogram_quantile(o,calls,0.999),
+			o->max);
+		for(b=0,first=1;b<STATS_BUCKETS;b++) {
+			count = __atomic_load_n(&o->histogram[b],__ATOMIC_RELAXED);
+			if(count==0) continue;
+			printf("%s[%lld,%lld]",first ? "" : ",",histogram_value(b),count);
+			first = 0;
+		}
+		printf("]}}");
+	}
+	printf("},");
+
+	heat_columns(heat_reads,reads);
+	heat_columns(heat_writes,writes);
+	printf("\"heatmap\":{\"blocks\":%d,\"columns\":%d,",heat_nblocks,STATS_HEAT_COLUMNS);
+	json_columns("reads",reads);
+	printf(",");
+	json_columns("writes",writes);
+	printf("},\"hottest\":[");
+
+	n = heat_hottest(hottest);
+	for(i=0;i<n;i++) {
+		printf("%s{\"block\":%d,\"reads\":%d,\"writes\":%d}",i ? "," : "",hottest[i],heat_reads[hottest[i]],heat_writes[hottest[i]]);
+	}
+	printf("]}\n");
+}
+
+void stats_print( int json )
+{
+	pthread_mutex_lock(&stats_lock);
+	if(json) {
+		stats_print_json();
+	} else {
+		stats_print_text();
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
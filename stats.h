@@ -0,0 +1,38 @@
+#ifndef STATS_H
+#define STATS_H
+
+/* Operations that are timed and counted, one entry point each */
+#define STATS_FS_FORMAT         0
+#define STATS_FS_MOUNT          1
+#define STATS_FS_UNMOUNT        2
+#define STATS_FS_SYNC           3
+#define STATS_FS_DEBUG          4
+#define STATS_FS_CREATE         5
+#define STATS_FS_DELETE         6
+#define STATS_FS_GETSIZE        7
+#define STATS_FS_READ           8
+#define STATS_FS_WRITE          9
+#define STATS_FS_CHECK          10
+#define STATS_FS_OPEN           11
+#define STATS_FS_CLOSE          12
+#define STATS_DISK_READ         13
+#define STATS_DISK_WRITE        14
+#define STATS_DISK_READV        15
+#define STATS_DISK_WRITEV       16
+#define STATS_DISK_SUBMIT_READ  17
+#define STATS_DISK_SUBMIT_WRITE 18
+#define STATS_NOPS              19
+
+struct stats_span {
+	long long start;   /* nanoseconds, monotonic */
+	long long blocks;  /* this thread's block count at the start */
+};
+
+void stats_begin( struct stats_span *s );
+void stats_end( struct stats_span *s, int op, long long bytes );
+void stats_blocks( int blocknum, int count, int write );
+void stats_heatmap( int nblocks );
+void stats_reset();
+void stats_print( int json );
+
+#endif
@@ -0,0 +1,212 @@
+#include "stress.h"
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define STRESS_MAX_WRITE (64*1024)
+#define STRESS_MAX_FILE (1024*1024)
+
+/*
+The stress test runs threads that each write, read back, delete and
+recreate a file of their own against an in-memory copy, and also read
+a file they all share. Afterwards every file is checked, and checked
+again after a remount, before it is deleted. Everything the threads
+do comes from the seed, which is reported so that a failing run can
+be tried again with it, though they interleave differently each time.
+*/
+
+struct stress_thread {
+	pthread_t thread;
+	int id;
+	int nops;
+	unsigned seed;
+	int inumber;
+	char *model;
+	int size;
+	int maxsize;
+	int failed;
+};
+
+static int stress_shared;
+static char *stress_shared_data;
+static int stress_shared_size;
+
+static int stress_check( int id, int inumber, const char *model, int size, int offset, int length, char *buffer )
+{
+	int expected = size-offset<length ? size-offset : length;
+	int actual;
+
+	if(expected<0) expected = 0;
+	actual = fs_read(inumber,buffer,length,offset);
+	if(actual!=expected) {
+		printf("stress: thread %d: read %d bytes at %d of inode %d, got %d not %d\n",id,length,offset,inumber,actual,expected);
+		return 0;
+	}
+	if(memcmp(buffer,model+offset,actual)) {
+		printf("stress: thread %d: wrong data in %d bytes at %d of inode %d\n",id,length,offset,inumber);
+		return 0;
+	}
+	return 1;
+}
+
+static void * stress_worker( void *arg )
+{
+	struct stress_thread *t = arg;
+	char *buffer = malloc(STRESS_MAX_FILE);
+	int i, k, op, offset, length, actual;
+
+	for(i=0;i<t->nops && !t->failed;i++) {
+		op = rand_r(&t->seed)%10;
+		if(op<4) {
+			offset = t->size ? rand_r(&t->seed)%(t->size+1) : 0;
+			if(offset>=t->maxsize) offset = 0;
+			length = 1+rand_r(&t->seed)%STRESS_MAX_WRITE;
+			if(offset+length>t->maxsize) length = t->maxsize-offset;
+			for(k=0;k<length;k++) buffer[k] = rand_r(&t->seed);
+			actual = fs_write(t->inumber,buffer,length,offset);
+			if(actual<0) {
+				printf("stress: thread %d: write to inode %d failed\n",t->id,t->inumber);
+				t->failed = 1;
+				break;
+			}
+			/* A short write means the disk is full; keep what got there */
+			memcpy(t->model+offset,buffer,actual);
+			if(offset==0) {
+				t->size = actual;
+			} else if(offset+actual>t->size) {
+				t->size = offset+actual;
+			}
+			if(fs_getsize(t->inumber)!=t->size) {
+				printf("stress: thread %d: inode %d has size %d not %d\n",t->id,t->inumber,fs_getsize(t->inumber),t->size);
+				t->failed = 1;
+			}
+		} else if(op<7) {
+			offset = t->size ? rand_r(&t->seed)%t->size : 0;
+			length = 1+rand_r(&t->seed)%STRESS_MAX_FILE;
+			if(!stress_check(t->id,t->inumber,t->model,t->size,offset,length,buffer)) t->failed = 1;
+		} else if(op<9) {
+			offset = stress_shared_size ? rand_r(&t->seed)%stress_shared_size : 0;
+			length = 1+rand_r(&t->seed)%STRESS_MAX_FILE;
+			if(!stress_check(t->id,stress_shared,stress_shared_data,stress_shared_size,offset,length,buffer)) t->failed = 1;
+		} else {
+			if(!fs_delete(t->inumber)) {
+				printf("stress: thread %d: delete of inode %d failed\n",t->id,t->inumber);
+				t->failed = 1;
+				break;
+			}
+			t->inumber = fs_create();
+			t->size = 0;
+			if(t->inumber<=0) {
+				printf("stress: thread %d: create failed\n",t->id);
+				t->failed = 1;
+			}
+		}
+	}
+
+	free(buffer);
+	return 0;
+}
+
+static int stress_verify( struct stress_thread *threads, int nthreads )
+{
+	char *buffer = malloc(STRESS_MAX_FILE);
+	int i, ok=1;
+
+	ok = stress_check(-1,stress_shared,stress_shared_data,stress_shared_size,0,STRESS_MAX_FILE,buffer);
+	for(i=0;i<nthreads;i++) {
+		if(!stress_check(i,threads[i].inumber,threads[i].model,threads[i].size,0,STRESS_MAX_FILE,buffer)) ok = 0;
+	}
+
+	free(buffer);
+	return ok;
+}
+
+int stress_run( int nthreads, int nops, unsigned seed )
+{
+	struct stress_thread *threads;
+	struct timespec start, end;
+	unsigned first_seed = seed;
+	int i, k, maxsize, ok=1;
+
+	if(nthreads<1 || nthreads>STRESS_MAX_THREADS || nops<0) {
+		printf("stress: use 1 to %d threads\n",STRESS_MAX_THREADS);
+		return 0;
+	}
+
+	/* Leave the files room to grow without filling the disk */
+	maxsize = (int)((long)disk_size()*DISK_BLOCK_SIZE/4/(nthreads+1));
+	if(maxsize>STRESS_MAX_FILE) maxsize = STRESS_MAX_FILE;
+	if(maxsize<1) maxsize = 1;
+
+	stress_shared = fs_create();
+	if(stress_shared<=0) {
+		printf("stress: couldn't create the shared file (is the disk mounted?)\n");
+		return 0;
+	}
+	stress_shared_data = malloc(STRESS_MAX_FILE);
+	for(k=0;k<maxsize;k++) stress_shared_data[k] = rand_r(&seed);
+	stress_shared_size = fs_write(stress_shared,stress_shared_data,maxsize,0);
+	if(stress_shared_size<0) stress_shared_size = 0;
+
+	threads = calloc(nthreads,sizeof(*threads));
+	for(i=0;i<nthreads;i++) {
+		threads[i].id = i;
+		threads[i].nops = nops;
+		threads[i].seed = seed+i;
+		threads[i].model = malloc(STRESS_MAX_FILE);
+		threads[i].maxsize = maxsize;
+		threads[i].inumber = fs_create();
+		if(threads[i].inumber<=0) {
+			printf("stress: couldn't create a file for thread %d\n",i);
+			free(threads[i].model);
+			nthreads = i;
+			ok = 0;
+			break;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	if(ok) {
+		for(i=0;i<nthreads;i++) {
+			pthread_create(&threads[i].thread,0,stress_worker,&threads[i]);
+		}
+		/* Join every worker before the files and models below are freed */
+		for(i=0;i<nthreads;i++) {
+			pthread_join(threads[i].thread,0);
+		}
+		for(i=0;i<nthreads;i++) {
+			if(threads[i].failed) ok = 0;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+
+	if(ok) ok = stress_verify(threads,nthreads);
+	if(ok) {
+		if(!fs_unmount() || !fs_mount()) {
+			printf("stress: remount failed\n");
+			ok = 0;
+		} else {
+			ok = stress_verify(threads,nthreads);
+		}
+	}
+
+	for(i=0;i<nthreads;i++) {
+		fs_delete(threads[i].inumber);
+		free(threads[i].model);
+	}
+	fs_delete(stress_shared);
+	free(stress_shared_data);
+	free(threads);
+
+	if(ok) {
+		printf("stress: %d threads, %d operations each, seed %u, %.3f seconds, files consistent\n",nthreads,nops,first_seed,(end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9);
+	} else {
+		printf("stress: seed %u\n",first_seed);
+	}
+	return ok;
+}
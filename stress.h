@@ -0,0 +1,8 @@
+#ifndef STRESS_H
+#define STRESS_H
+
+#define STRESS_MAX_THREADS 64
+
+int stress_run( int nthreads, int nops, unsigned seed );
+
+#endif